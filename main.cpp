@@ -9,7 +9,129 @@
  * format and saved. Supports images up to 2000x2000 in size.
  *
  * Usage:
- * ./executable <file_path>
+ * ./executable [options] <file_path>
+ *
+ * Options:
+ * --index-only        Record header offset, type and dimensions of every hit
+ *                     without reading or saving pixel payloads.
+ * --manifest <path>   Write a CSV manifest of hits ("-" for stdout). Index-only
+ *                     runs print the manifest to stdout by default.
+ * --index <path>      Write a binary hit index that can be mmapped and searched
+ *                     by offset or payload hash without parsing.
+ * --dedup             Write each distinct payload only once.
+ * --dedup-against <index>
+ *                     Also skip payloads already present in an earlier index.
+ * --skip-blank        Do not write thumbnails flagged as blank or solid color.
+ * --blank-threshold <value>
+ *                     Mean absolute deviation from the mean color at or below
+ *                     which a thumbnail counts as blank (default 2.0).
+ * --skip-high-entropy Do not search 64 KiB extents whose byte entropy is at or
+ *                     above 7.99 bits (encrypted or compressed data).
+ * --entropy-threshold <bits>
+ *                     Enable the skip with a different threshold.
+ * --threads <n>       Encode and write BMPs on n worker threads while the main
+ *                     thread scans (default 1: everything on the main thread).
+ * --numa              Pin encode threads to NUMA nodes, one shard of workers,
+ *                     queue and node-local job buffers per node.
+ * --mmap              Map the input instead of reading it with pread.
+ * --huge-pages        Back read and pixel buffers with huge pages (hugetlb when
+ *                     available, THP otherwise) and ask for THP on the mapping.
+ * --archive           Treat the input as a tar (optionally gzipped) or zip
+ *                     archive and scan each member file without unpacking it.
+ *                     Manifest offsets are then relative to the entry named in
+ *                     an extra entry column. Not with --index or --mmap.
+ * --virtual-disk      Treat the input as a qcow2 image or VMDK sparse extent
+ *                     and scan the logical disk, skipping unallocated clusters
+ *                     and inflating compressed ones. Offsets are logical; pass
+ *                     --virtual-disk to extract as well. Not with --archive,
+ *                     --mmap or --async.
+ * --ewf               Treat the input as the first segment of an EWF (E01)
+ *                     image and scan the acquired media. Later segments are
+ *                     found next to it; chunks are decompressed on several
+ *                     threads ahead of the scan. Offsets are logical; pass
+ *                     --ewf to extract as well. Not with --archive,
+ *                     --virtual-disk, --mmap or --async.
+ * --memory-budget <bytes>
+ *                     Memory for the EWF chunk cache (default 64M).
+ * --skip-errors       Keep scanning past unreadable areas of a failing drive,
+ *                     skipping ahead in growing steps until reads succeed
+ *                     again. Without it a read error ends the scan.
+ * --mapfile <path>    Never read the bad areas of a ddrescue mapfile.
+ * --write-mapfile <path>
+ *                     Write the ranges read, found unreadable and not tried
+ *                     as a ddrescue mapfile. Both imply --skip-errors;
+ *                     none work with --archive, --virtual-disk, --ewf, --mmap
+ *                     or --async.
+ * --hash <list>       Hash the whole input (md5, sha256 or md5,sha256) in the
+ *                     same pass as the carve and print the digests to stderr.
+ *                     With --virtual-disk or --ewf the logical media is hashed
+ *                     and an E01 acquisition MD5 is checked. Not with
+ *                     --archive or --async.
+ * --output-hashes     Add the SHA-256 of each written payload and of its BMP to
+ *                     the manifest, computed in memory by whichever thread
+ *                     encodes the BMP.
+ * --ignore-hashes <path>
+ *                     Record but never write payloads whose SHA-256 is listed
+ *                     in path (one hex digest per line).
+ * --alert-hashes <path>
+ *                     Report payloads whose SHA-256 is listed in path on
+ *                     stderr as soon as they are found. Both lists add a known
+ *                     column to the manifest; neither works with --index-only.
+ * --pack <path>       Write thumbnails into one pack file instead of BMPs, each
+ *                     a zstd frame compressed with a dictionary trained on
+ *                     the first payloads. Not with --index-only or --async.
+ * --stats             Print scan statistics, heap allocations per stage and the
+ *                     selected SIMD kernel variant to stderr.
+ * --assert-zero-alloc Fail if any hit after the first few allocates on the heap.
+ * --trace <path>      Record per-thread spans of every pipeline stage and write
+ *                     them as Chrome trace JSON (chrome://tracing, Perfetto).
+ * --metrics-file <path>
+ *                     Keep an OpenMetrics textfile with counters and latency
+ *                     histograms up to date while the job runs.
+ * --metrics-interval <seconds>
+ *                     How often the textfile is rewritten (default 10).
+ * --metrics-port <port>
+ *                     Serve the same metrics at http://127.0.0.1:<port>/metrics.
+ *
+ * ./executable --async [--threads <n>] [options] <file_path>...
+ * ./executable --stdin [--threads <n>] [options] < path_list
+ *
+ * Carves many inputs at once as C++20 coroutines on n scheduler threads, with
+ * reads and writes in flight on io_uring (pread/pwrite without it). --stdin
+ * takes the inputs as a NUL- or newline-separated list on stdin. Dedup state
+ * and the manifest, which gains a source column, are shared by all inputs.
+ * Inputs are grouped by disk: spinning disks are read one input at a time,
+ * other devices up to 8 at a time (--streams-per-device <n> overrides).
+ * Takes the options above except --index-only, --index, --mmap, --numa and
+ * --assert-zero-alloc.
+ *
+ * ./executable extract (--from-manifest <path> | --from-index <path>)
+ *                      [--hits <list>] [--virtual-disk | --ewf] <file_path>
+ *
+ * Re-extracts hits recorded in a manifest or index straight from their offsets.
+ * --hits selects hit indices such as "3,7,10-12"; all hits are written otherwise.
+ *
+ * ./executable unpack [--hits <list>] <pack_path>
+ *
+ * Writes thumbnails from a --pack file as the BMPs a normal run would have
+ * written, all of them or the --hits selected.
+ *
+ * ./executable triage [--block-size <bytes>] [--sample-bytes <bytes>]
+ *                     [--time-limit <seconds>] [--random] [--seed <n>] <file_path>
+ *
+ * Scans a stratified (or --random) sample of blocks and estimates the number
+ * of hits, output size and full runtime with 95% confidence intervals.
+ *
+ * ./executable bench-io [--synthetic <bytes>]... [--runs <n>] [--warm] [<file_path>...]
+ *
+ * Runs the scan over each input with every read backend (ifstream, pread at
+ * several block sizes, mmap with and without madvise hints, O_DIRECT and
+ * io_uring) and prints throughput and CPU time per backend in one table.
+ *
+ * ./executable bench-threads [--max-threads <n>] [--runs <n>] [--csv <path>] <file_path>...
+ *
+ * Runs the full extraction over the given corpus at 1..n encode threads and
+ * writes throughput, speedup, efficiency and per-stage busy time as CSV.
  ******************************************************************************/
 
 #include <cstdint>
@@ -20,6 +142,67 @@
 #include <stdexcept>
 #include <array>
 #include <string_view>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_set>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <random>
+#include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <thread>
+#include <condition_variable>
+#include <map>
+#include <charconv>
+#include <new>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <latch>
+#include <iterator>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RTTI_HAVE_ISA_DISPATCH 1
+#endif
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+
+#include <zlib.h>
+#include <zstd.h>
+#include <zdict.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define RTTI_HAVE_IO_URING 1
+#endif
 
 namespace fs = std::filesystem;
 
@@ -29,151 +212,8289 @@ struct ImageConfig {
 	
     static constexpr int MaxWidth = 2000;
     static constexpr int MaxHeight = 2000;
+    static constexpr std::size_t MaxPayloadSize = static_cast<std::size_t>(MaxWidth) * MaxHeight * 3;
 
 };
 
-class ImageFile {
+// A payload whose mean absolute deviation from its mean color is at or below
+// the threshold (in 0-255 channel units) is flagged as blank: all-black,
+// all-white or solid placeholder thumbnails, allowing for a little noise.
+
+struct BlankConfig {
+
+    static constexpr double DefaultThreshold = 2.0;
+
+};
+
+// EWF (E01) chunks are decompressed ahead of the scan into a cache of
+// --memory-budget bytes, by up to MaxWorkers threads.
+
+struct EwfConfig {
+
+    static constexpr std::size_t DescriptorSize = 76;
+    static constexpr std::size_t TableHeaderSize = 24;
+    static constexpr std::size_t MaxChunkSize = 64 << 20;
+    static constexpr std::uint64_t DefaultCacheBytes = 64 << 20;
+    static constexpr int MaxWorkers = 8;
+
+};
+
+struct ProcessOptions {
+
+    bool index_only = false;
+    fs::path manifest_path;
+    fs::path index_path;
+    bool dedup = false;
+    fs::path dedup_index_path;
+    bool skip_blank = false;
+    double blank_threshold = BlankConfig::DefaultThreshold;
+    double entropy_threshold = 0;
+    bool stats = false;
+    fs::path trace_path;
+    fs::path metrics_path;
+    double metrics_interval = 10;
+    int metrics_port = 0;
+    bool assert_zero_alloc = false;
+    int threads = 1;
+    bool numa = false;
+    bool huge_pages = false;
+    bool mmap_input = false;
+    bool async = false;
+    int streams_per_device = 0;
+    bool archive = false;
+    bool virtual_disk = false;
+    bool ewf = false;
+    std::uint64_t memory_budget = EwfConfig::DefaultCacheBytes;
+    bool skip_errors = false;
+    fs::path mapfile_path;
+    fs::path write_mapfile_path;
+    bool hash_md5 = false;
+    bool hash_sha256 = false;
+    bool output_hashes = false;
+    fs::path ignore_hashes_path;
+    fs::path alert_hashes_path;
+    fs::path pack_path;
+
+};
+
+// Re-extraction reads hits sorted by offset. Neighbouring hits are fetched
+// with a single pread as long as the hole between them stays small.
+
+struct ExtractConfig {
+
+    static constexpr std::uint64_t MaxBatchGap = 1 << 20;
+    static constexpr std::uint64_t MaxBatchBytes = 64 << 20;
+
+};
+
+// Triage scans a sample of fixed-size blocks and extrapolates to the whole
+// input. A handful of sampled hits are also encoded to estimate per-hit cost.
+
+struct TriageConfig {
+
+    static constexpr std::uint64_t DefaultBlockSize = 1 << 20;
+    static constexpr std::uint64_t DefaultSampleBytes = 64 << 20;
+    static constexpr int EncodeProbes = 8;
+    static constexpr double Z95 = 1.96;
+
+};
+
+struct TriageOptions {
+
+    std::uint64_t block_size = TriageConfig::DefaultBlockSize;
+    std::uint64_t sample_bytes = TriageConfig::DefaultSampleBytes;
+    double time_limit = 0;
+    bool stratified = true;
+    std::uint64_t seed = 0;
+
+};
+
+// The I/O benchmark runs the regular scan (HitScanner plus payload hashing)
+// once per backend and input. Synthetic inputs are pseudo-random data with a
+// thumbnail every SyntheticHitSpacing bytes.
+
+struct BenchConfig {
+
+    static constexpr std::size_t DirectAlignment = 4096;
+    static constexpr unsigned UringDepth = 4;
+    static constexpr std::uint64_t SyntheticHitSpacing = 1 << 20;
+    static constexpr int SyntheticWidth = 160;
+    static constexpr int SyntheticHeight = 120;
+
+};
+
+struct BenchOptions {
+
+    std::vector<fs::path> inputs;
+    std::vector<std::uint64_t> synthetic_sizes;
+    int runs = 3;
+    bool warm = false;
+
+};
+
+// bench-threads runs Process over a fixed corpus at 1..max_threads encode
+// threads and writes one CSV row per thread count.
+
+struct ScalingOptions {
+
+    std::vector<fs::path> inputs;
+    int max_threads = 0;
+    int runs = 3;
+    fs::path csv_path;
+
+};
+
+// An inclusive range of hit indices selected with --hits. Selections are kept
+// as sorted, merged ranges rather than expanded, so "1-2000000000" costs no
+// more than "7".
+
+struct HitRange {
+
+    int first = 0;
+    int last = 0;
+
+};
+
+struct UnpackOptions {
+
+    std::vector<HitRange> hits;
+
+};
+
+struct ExtractOptions {
+
+    fs::path manifest_path;
+    fs::path index_path;
+    std::vector<HitRange> hits;
+    bool virtual_disk = false;
+    bool ewf = false;
+
+};
+
+// One located image: header offset in the input, header type and dimensions.
+// output is empty when nothing was written for the hit (index-only runs).
+// The SHA-256 digests of the payload and of the BMP written for it are only
+// filled in (digested) when output hashes are requested. known is "ignore" or
+// "alert" for payloads on a known-hash list.
+
+struct HitRecord {
+
+    int index = 0;
+    std::uint64_t offset = 0;
+    std::string_view type;
+    int width = 0;
+    int height = 0;
+    bool payload_read = false;
+    std::uint64_t payload_hash = 0;
+    bool blank = false;
+    std::string output;
+    std::string_view entry;
+    std::string_view source;
+    bool digested = false;
+    std::array<unsigned char, 32> payload_sha256{};
+    std::array<unsigned char, 32> output_sha256{};
+    std::string_view known;
+
+};
+
+class Manifest {
 
 public:
-    static bool FindHeader(
-        std::ifstream& file
+    // With entries, an entry column names the archive entry holding each hit
+    // (whose offset is then inside the entry); with sources, a trailing
+    // source column names the input of each hit; with digests, the SHA-256
+    // of each payload and of its BMP follow the output column; with known, a
+    // known column marks payloads found on a known-hash list.
+    bool Open(
+        const fs::path& path,
+        bool with_sources = false,
+        bool with_entries = false,
+        bool with_digests = false,
+        bool with_known = false
     );
 
-    static std::pair<int, int> ReadDimensions(
-        std::ifstream& file
+    void Add(
+        const HitRecord& hit
     );
 
-    static void SaveAsBMP(
-        const fs::path& output_path,
-        const std::vector<unsigned char>& img_data,
-        int width,
-        int height
+    // Rows of a manifest with a source column are only loaded when they name
+    // source (the same path or another path to the same file).
+    static std::vector<HitRecord> Load(
+        const fs::path& path,
+        const fs::path& source = {}
     );
 
-    static void Process(
-        const fs::path& file_path
+private:
+    std::ofstream file;
+    std::ostream* out = nullptr;
+    bool with_sources = false;
+    bool with_entries = false;
+    bool with_digests = false;
+    bool with_known = false;
+};
+
+// Binary hit index: a header, fixed-size records sorted by offset, then a
+// table of (payload hash, record) pairs sorted by hash. Everything is stored
+// little-endian with natural alignment so the file can be mmapped and binary
+// searched in place instead of being parsed.
+
+struct HitIndexConfig {
+
+    static constexpr std::array<char, 8> Magic = {'R', 'T', 'T', 'I', 'I', 'D', 'X', '1'};
+    static constexpr std::uint32_t Version = 1;
+
+    static constexpr std::uint8_t FlagHashed = 1;
+    static constexpr std::uint8_t FlagWritten = 2;
+    static constexpr std::uint8_t FlagBlank = 4;
+
+};
+
+struct HitIndexHeader {
+
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t record_size;
+    std::uint64_t record_count;
+    std::uint64_t hash_count;
+
+};
+
+struct HitIndexRecord {
+
+    std::uint64_t offset;
+    std::uint64_t payload_hash;
+    std::uint32_t index;
+    std::uint16_t width;
+    std::uint16_t height;
+    std::uint8_t type;
+    std::uint8_t flags;
+    std::uint16_t reserved0;
+    std::uint32_t reserved1;
+
+};
+
+struct HitIndexHashEntry {
+
+    std::uint64_t hash;
+    std::uint32_t record;
+    std::uint32_t reserved;
+
+};
+
+static_assert(sizeof(HitIndexHeader) == 32 && sizeof(HitIndexRecord) == 32 && sizeof(HitIndexHashEntry) == 16);
+
+class HitIndexWriter {
+
+public:
+    void Add(
+        const HitRecord& hit
     );
+
+    bool Write(
+        const fs::path& path
+    );
+
+private:
+    std::vector<HitIndexRecord> records;
 };
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <file_path>\n";
-        return 1;
-    }
+class HitIndex {
 
-    ImageFile::Process(argv[1]);
+public:
+    HitIndex() = default;
+    HitIndex(const HitIndex&) = delete;
+    HitIndex& operator=(const HitIndex&) = delete;
+    ~HitIndex();
 
-    return 0;
-}
+    bool Open(
+        const fs::path& path
+    );
 
-bool ImageFile::FindHeader(std::ifstream& file) {
-    std::string buffer;
-    char ch;
+    const HitIndexRecord* FindOffset(
+        std::uint64_t offset
+    ) const;
 
-    while (file.get(ch)) {
-        buffer.push_back(ch);
-        for (auto header : ImageConfig::Headers) {
-            if (buffer.size() > header.size()) buffer.erase(buffer.begin());
-            if (buffer == header) return true;
-        }
-        if (buffer.size() > ImageConfig::Headers[0].length()) buffer.erase(buffer.begin());
-    }
-    return false;
-}
+    bool ContainsHash(
+        std::uint64_t hash
+    ) const;
 
-std::pair<int, int> ImageFile::ReadDimensions(std::ifstream& file) {
-    unsigned char bytes[4];
-    int width, height;
+    const HitIndexRecord* begin() const { return records; }
+    const HitIndexRecord* end() const { return records + record_count; }
 
-    for (int i = 0; i < 2; ++i) {
-        if (!file.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) {
-            throw std::runtime_error("Failed to read dimensions from file.");
-        }
-        int& dimension = (i == 0) ? width : height;
-        dimension = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
-    }
+private:
+    void* mapping = nullptr;
+    std::size_t mapping_size = 0;
+    const HitIndexRecord* records = nullptr;
+    std::size_t record_count = 0;
+    const HitIndexHashEntry* hashes = nullptr;
+    std::size_t hash_count = 0;
+};
 
-    return {width, height};
-}
+// Payload hashes already seen by a --dedup run. Open addressing with linear
+// probing in a power-of-two table that is kept at most half full; hashes are
+// XXH64 values, so their low bits index the table directly and 0 marks an
+// empty slot (a zero hash is tracked on the side). Inserting never allocates
+// except when the table doubles.
 
-void ImageFile::SaveAsBMP(
-    const fs::path& output_path,
-    const std::vector<unsigned char>& img_data,
-    int width,
-    int height
-) 
+struct DedupConfig {
 
-{
-    std::ofstream file(output_path, std::ios::binary);
-    if (!file) {
-        std::cerr << "Failed to open output file.\n";
-        return;
-}
+    static constexpr std::size_t InitialSlots = 1024;
 
-// Set up BMP file header and info header with appropriate values for a BMP image.
-// Adjust padding for each row based on width to ensure proper alignment.
-// Write the headers to the file stream.
+};
 
-    unsigned char bmpFileHeader[14] = {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
-    unsigned char bmpInfoHeader[40] = {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
-    int paddingAmount = (4 - (width * 3) % 4) % 4;
-    int fileSize = 54 + (width * 3 + paddingAmount) * height;
+class PayloadSet {
 
-    bmpFileHeader[2] = fileSize;
-    bmpFileHeader[3] = fileSize >> 8;
-    bmpFileHeader[4] = fileSize >> 16;
-    bmpFileHeader[5] = fileSize >> 24;
+public:
+    bool Insert(
+        std::uint64_t hash
+    );
 
-    bmpInfoHeader[4] = width;
-    bmpInfoHeader[5] = width >> 8;
-    bmpInfoHeader[6] = width >> 16;
-    bmpInfoHeader[7] = width >> 24;
-    bmpInfoHeader[8] = height;
-    bmpInfoHeader[9] = height >> 8;
-    bmpInfoHeader[10] = height >> 16;
-    bmpInfoHeader[11] = height >> 24;
+private:
+    void Grow();
 
-    file.write(reinterpret_cast<char*>(bmpFileHeader), sizeof(bmpFileHeader));
-    file.write(reinterpret_cast<char*>(bmpInfoHeader), sizeof(bmpInfoHeader));
+    std::vector<std::uint64_t> slots;
+    std::size_t size = 0;
+    bool has_zero = false;
+};
 
-// Create padding array to ensure proper alignment of pixel data.
-// Iterate over each row of the image data, swapping red and blue channels for each pixel.
-// Write the modified image row to the file stream, followed by padding to align to 4-byte boundaries.
+// Binary fuse filter (Graf and Lemire) with 8-bit fingerprints and three
+// probes: about 9 bits per key and a false positive rate near 1/256. It is
+// built once from distinct 64-bit keys; a lookup reads three bytes.
 
-    unsigned char padding[3] = {0, 0, 0};
-    for (int i = height - 1; i >= 0; --i) {
-        for (int j = 0; j < width; ++j) {
-			unsigned char& pixel_red = const_cast<unsigned char&>(img_data[(i * width * 3) + (j * 3)]);
-			unsigned char& pixel_blue = const_cast<unsigned char&>(img_data[(i * width * 3) + (j * 3) + 2]);
-			std::swap(pixel_red, pixel_blue);
-        }
-        file.write(reinterpret_cast<const char*>(img_data.data() + (i * width * 3)), width * 3);
-        file.write(reinterpret_cast<const char*>(padding), paddingAmount);
+class FuseFilter {
+
+public:
+    bool Build(
+        const std::vector<std::uint64_t>& keys
+    );
+
+    bool Contains(
+        std::uint64_t key
+    ) const;
+
+    std::size_t Bytes() const { return fingerprints.size(); }
+
+private:
+    std::array<std::uint32_t, 3> Positions(
+        std::uint64_t hash
+    ) const;
+
+    std::uint64_t seed = 0;
+    std::uint32_t segment_length = 0;
+    std::uint32_t segment_mask = 0;
+    std::uint32_t segment_count_length = 0;
+    std::vector<std::uint8_t> fingerprints;
+};
+
+// Known payload SHA-256 digests, read from a text file with one hex digest at
+// the start of each line (bare lists and sha256sum output both work; other
+// lines are skipped). Lookups go to a fuse filter keyed by the first eight
+// digest bytes, and only filter hits are confirmed by binary search in the
+// exact sorted table, so the table is rarely touched for unlisted payloads.
+
+class KnownHashes {
+
+public:
+    bool Load(
+        const fs::path& path
+    );
+
+    bool Contains(
+        const unsigned char* sha256
+    ) const;
+
+    bool Empty() const { return digests.empty(); }
+
+    std::size_t Size() const { return digests.size(); }
+
+    std::size_t FilterBytes() const { return filter.Bytes(); }
+
+private:
+    std::vector<std::array<unsigned char, 32>> digests;
+    FuseFilter filter;
+};
+
+// Heap allocation accounting. The global operator new is replaced so that,
+// once counting is enabled, every allocation is charged to the innermost
+// TraceSpan of the calling thread ("other" outside any span). Allocations in
+// the bookkeeping stages grow per-run tables (manifest index, pack entry
+// table, trace buffers, the doublings of the dedup table) or render reports
+// (metrics, statistics) and are left out of the steady-state count, which
+// only covers hits after a short warm-up.
+
+struct AllocConfig {
+
+    static constexpr std::uint64_t WarmupHits = 4;
+    static constexpr std::array<std::string_view, 5> Bookkeeping = {"dedup growth", "record", "trace", "metrics", "stats"};
+    static constexpr std::size_t MaxStages = 32;
+
+};
+
+struct AllocCounter {
+
+    std::atomic<const char*> name{nullptr};
+    std::atomic<std::uint64_t> count{0};
+    std::atomic<std::uint64_t> bytes{0};
+
+};
+
+class Allocations {
+
+public:
+    static void Enable() { enabled.store(true, std::memory_order_relaxed); }
+
+    static bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+    static void Count(
+        std::size_t size
+    );
+
+    static const char* SetStage(
+        const char* name
+    );
+
+    static void MarkWarm();
+
+    static void MarkEnd(
+        std::uint64_t hits
+    );
+
+    static std::uint64_t SteadyAllocations() { return steady_allocations; }
+
+    static std::uint64_t SteadyHits() { return steady_hits; }
+
+    static void Print(
+        std::ostream& out
+    );
+
+private:
+    static std::uint64_t HotPathCount();
+
+    static inline std::atomic<bool> enabled{false};
+    static inline std::array<AllocCounter, AllocConfig::MaxStages> stages{};
+    static inline thread_local const char* stage = nullptr;
+    static inline std::uint64_t warm_count = 0;
+    static inline std::uint64_t steady_allocations = 0;
+    static inline std::uint64_t steady_hits = 0;
+    static inline bool marked_end = false;
+};
+
+// Optional span tracing in Chrome trace format. Each thread appends to its own
+// buffer, registered once under a lock, so recording a span never contends.
+// Buffers outlive their threads and are written out after all work is done.
+
+struct TraceEvent {
+
+    const char* name;
+    std::int64_t start;
+    std::int64_t end;
+
+};
+
+class Trace {
+
+public:
+    static void Enable();
+
+    static bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+    static std::int64_t Now();
+
+    static void Record(
+        const char* name,
+        std::int64_t start,
+        std::int64_t end
+    );
+
+    static void SetThreadName(
+        std::string_view name
+    );
+
+    static bool Write(
+        const fs::path& path
+    );
+
+    // Busy seconds per span name, summed over all threads.
+    static std::map<std::string, double> Totals();
+
+    static void Clear();
+
+private:
+    struct ThreadBuffer {
+        int tid = 0;
+        std::string name;
+        std::vector<TraceEvent> events;
+    };
+
+    static ThreadBuffer& Local();
+
+    static inline std::atomic<bool> enabled{false};
+    static inline std::chrono::steady_clock::time_point origin;
+    static inline std::mutex registry_mutex;
+    static inline std::vector<std::unique_ptr<ThreadBuffer>> registry;
+};
+
+class TraceSpan {
+
+public:
+    explicit TraceSpan(const char* name)
+        : name(name), previous_stage(Allocations::SetStage(name)), start(Trace::Enabled() ? Trace::Now() : -1) {}
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan() {
+        if (start >= 0) Trace::Record(name, start, Trace::Now());
+        Allocations::SetStage(previous_stage);
     }
-}
 
-// Try to read dimensions of the image; if unsuccessful, continue to the next header.
-// Check if image dimensions exceed maximum allowed values; if so, skip processing.
-// Allocate memory for image data and read the pixel data from the file.
+private:
+    const char* name;
+    const char* previous_stage;
+    std::int64_t start;
+};
 
-void ImageFile::Process(const fs::path& file_path) {
-    std::ifstream file(file_path, std::ios::binary);
-    if (!file) return;
+// Process-wide counters and latency histograms, updated with relaxed atomics
+// from any thread and rendered in OpenMetrics text format on demand.
 
-    static int image_counter = 0;
-    while (FindHeader(file)) {
-        file.ignore(1);
-        try {
-            auto [width, height] = ReadDimensions(file);
-            if (width > ImageConfig::MaxWidth || height > ImageConfig::MaxHeight) continue;
+class Histogram {
+
+public:
+    static constexpr std::array<double, 12> Bounds = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1.0
+    };
+
+    void Observe(
+        double seconds
+    );
 
-            std::vector<unsigned char> img_data(width * height * 3);
-            if (!file.read(reinterpret_cast<char*>(img_data.data()), img_data.size())) continue;
+    void Render(
+        std::ostream& out,
+        std::string_view name
+    ) const;
 
-            fs::path output_path = file_path.stem().string() + "_extracted_" + std::to_string(++image_counter) + ".bmp";
-            SaveAsBMP(output_path, img_data, width, height);
-        } catch (const std::runtime_error&) {
-            continue;
+private:
+    std::array<std::atomic<std::uint64_t>, Bounds.size() + 1> buckets{};
+    std::atomic<std::uint64_t> sum_ns{0};
+};
+
+struct Metrics {
+
+    enum Rejection { RejectDimensions, RejectTruncated, RejectBlank, RejectDuplicate, RejectKnown, RejectionCount };
+    static constexpr std::array<std::string_view, RejectionCount> RejectionNames = {"dimensions", "truncated", "blank", "duplicate", "known"};
+
+    static inline std::atomic<std::uint64_t> bytes_scanned{0};
+    static inline std::atomic<std::uint64_t> bytes_skipped_entropy{0};
+    static inline std::atomic<std::uint64_t> bytes_skipped_payload{0};
+    static inline std::array<std::atomic<std::uint64_t>, ImageConfig::Headers.size()> hits{};
+    static inline std::array<std::atomic<std::uint64_t>, RejectionCount> rejections{};
+    static inline std::atomic<std::uint64_t> outputs_written{0};
+    static inline std::atomic<std::uint64_t> output_bytes{0};
+    static inline std::atomic<std::uint64_t> alerts{0};
+    static inline std::atomic<std::int64_t> encode_queue_depth{0};
+    static inline Histogram encode_seconds;
+    static inline Histogram write_seconds;
+
+    static void Reject(Rejection reason) { rejections[reason].fetch_add(1, std::memory_order_relaxed); }
+
+    static std::string Render();
+
+};
+
+// Publishes Metrics::Render() while a job runs: rewritten periodically into a
+// textfile (via rename, so collectors never see a partial file) and/or served
+// over HTTP on a localhost port. The textfile gets a final update on shutdown.
+
+class MetricsExporter {
+
+public:
+    MetricsExporter(
+        const fs::path& file_path,
+        double interval,
+        int port
+    );
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+    ~MetricsExporter();
+
+private:
+    void WriteFile();
+
+    void Serve();
+
+    fs::path file_path;
+    double interval;
+    int listen_fd = -1;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread writer;
+    std::thread server;
+};
+
+// A run of input bytes at a logical offset. Blocks stay valid until the
+// reader's next call to Next(). Consecutive blocks need not be contiguous: a
+// jump in offset means the bytes in between are not available.
+
+struct InputBlock {
+
+    std::uint64_t offset = 0;
+    const unsigned char* data = nullptr;
+    std::size_t size = 0;
+
+};
+
+class InputReader {
+
+public:
+    virtual ~InputReader() = default;
+
+    virtual bool Next(
+        InputBlock& block
+    ) = 0;
+
+    // Nothing before offset is needed any more; readers may seek past it.
+    virtual void SkipTo(
+        std::uint64_t /* offset */
+    ) {}
+
+    virtual std::uint64_t Size() const = 0;
+
+    // Whether the next block, and enough input after it to complete any hit
+    // that starts in it, can be returned without waiting. Readers fed
+    // asynchronously return false until that input has arrived.
+    virtual bool Ready() const { return true; }
+
+    // Whether input between the blocks handed out reads as zeros, as the
+    // holes of a sparse image do, rather than being unavailable.
+    virtual bool HolesAreZero() const { return false; }
+};
+
+// Page-aligned buffers straight from anonymous mmap. With huge pages
+// requested the buffer comes from the hugetlb pool when one is configured and
+// is otherwise aligned to a huge page and madvised for transparent huge pages,
+// which cuts TLB misses when scanning or copying megabytes at a time.
+
+struct HugePageConfig {
+
+    static constexpr std::size_t PageSize = 2 << 20;
+
+};
+
+class PageBuffer {
+
+public:
+    PageBuffer() = default;
+
+    PageBuffer(
+        std::size_t size,
+        bool huge_pages
+    );
+
+    PageBuffer(PageBuffer&& other) noexcept;
+    PageBuffer& operator=(PageBuffer&& other) noexcept;
+    ~PageBuffer();
+
+    unsigned char* data() const { return memory; }
+
+    std::size_t size() const { return length; }
+
+    // Bytes obtained from the hugetlb pool and bytes madvised for THP.
+    static inline std::atomic<std::uint64_t> hugetlb_bytes{0};
+    static inline std::atomic<std::uint64_t> thp_bytes{0};
+
+private:
+    unsigned char* memory = nullptr;
+    std::size_t length = 0;
+    std::size_t mapped = 0;
+};
+
+class PreadReader : public InputReader {
+
+public:
+    PreadReader(
+        int fd,
+        std::uint64_t size,
+        std::size_t block_size,
+        bool huge_pages = false
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    void SkipTo(
+        std::uint64_t offset
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    int fd;
+    std::uint64_t size;
+    std::uint64_t position = 0;
+    PageBuffer buffer;
+};
+
+// A range of the input with its status in ddrescue mapfile terms: '+' read,
+// '-' bad, '?' not tried; '*' and '/' mark areas ddrescue has not finished
+// with, which still hold unreadable sectors.
+
+struct RescueRange {
+
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+    char status = '?';
+
+};
+
+// After a read error the reader probes one sector-sized piece at a time,
+// FirstSkip past the error and then twice as far each time the probe fails.
+
+struct RescueConfig {
+
+    static constexpr std::size_t ProbeSize = 4096;
+    static constexpr std::uint64_t FirstSkip = 64 << 10;
+    static constexpr std::uint64_t MaxSkip = 256 << 20;
+
+};
+
+// Reads like PreadReader but keeps going past unreadable areas of a failing
+// drive, and never touches ranges an earlier ddrescue run found bad. What
+// was read, failed or jumped over is kept as a ddrescue mapfile.
+
+class RescueReader : public InputReader {
+
+public:
+    RescueReader(
+        int fd,
+        std::uint64_t size,
+        std::size_t block_size,
+        std::vector<RescueRange> known_bad,
+        bool huge_pages = false
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    void SkipTo(
+        std::uint64_t offset
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+    std::uint64_t SkippedBytes() const { return skipped_bytes; }
+
+    std::uint64_t SkippedRanges() const { return skipped_ranges; }
+
+    bool WriteMapfile(
+        const fs::path& path
+    ) const;
+
+    // The bad, non-trimmed and non-scraped ranges of a ddrescue mapfile,
+    // sorted, with adjacent ranges of the same status merged.
+    static bool LoadMapfile(
+        const fs::path& path,
+        std::vector<RescueRange>& bad
+    );
+
+private:
+    std::uint64_t Probe(
+        std::uint64_t from
+    );
+
+    void RecordUntried(
+        std::uint64_t from,
+        std::uint64_t to
+    );
+
+    void Record(
+        std::uint64_t offset,
+        std::uint64_t length,
+        char status
+    );
+
+    int fd;
+    std::uint64_t size;
+    std::uint64_t position = 0;
+    std::size_t failed_size = 0;
+    PageBuffer buffer;
+    std::vector<RescueRange> bad;
+    std::size_t next_bad = 0;
+    std::vector<RescueRange> map;
+    std::uint64_t skipped_bytes = 0;
+    std::uint64_t skipped_ranges = 0;
+};
+
+// Alternative readers, used by the I/O benchmark to compare strategies. Each
+// hands out the input in blocks of block_size bytes like PreadReader.
+
+class StreamReader : public InputReader {
+
+public:
+    StreamReader(
+        const fs::path& path,
+        std::uint64_t size,
+        std::size_t block_size
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    std::ifstream file;
+    std::uint64_t size;
+    std::uint64_t position = 0;
+    std::vector<unsigned char> buffer;
+};
+
+// Maps the whole input read-only; blocks point straight into the mapping.
+// advice is passed to madvise (0 for none), and huge_pages additionally asks
+// for transparent huge pages on the mapping.
+
+class MmapReader : public InputReader {
+
+public:
+    MmapReader(
+        int fd,
+        std::uint64_t size,
+        std::size_t block_size,
+        int advice,
+        bool huge_pages = false
+    );
+
+    MmapReader(const MmapReader&) = delete;
+    MmapReader& operator=(const MmapReader&) = delete;
+    ~MmapReader() override;
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    void SkipTo(
+        std::uint64_t offset
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    const unsigned char* data = nullptr;
+    std::uint64_t size;
+    std::size_t block_size;
+    std::uint64_t position = 0;
+};
+
+// Reads with O_DIRECT, bypassing the page cache. Offsets, sizes and the buffer
+// are kept aligned to BenchConfig::DirectAlignment; Open() fails on
+// filesystems without O_DIRECT support.
+
+class DirectReader : public InputReader {
+
+public:
+    DirectReader(
+        std::uint64_t size,
+        std::size_t block_size
+    );
+
+    DirectReader(const DirectReader&) = delete;
+    DirectReader& operator=(const DirectReader&) = delete;
+    ~DirectReader() override;
+
+    bool Open(
+        const fs::path& path
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    void SkipTo(
+        std::uint64_t offset
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    int fd = -1;
+    std::uint64_t size;
+    std::size_t block_size;
+    std::uint64_t position = 0;
+    unsigned char* buffer = nullptr;
+};
+
+#ifdef RTTI_HAVE_IO_URING
+
+// Minimal io_uring ring driven through the raw system calls, without liburing:
+// set up the ring, queue reads or writes tagged with user data and reap their
+// completions.
+
+class IoRing {
+
+public:
+    IoRing() = default;
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+    ~IoRing();
+
+    bool Open(
+        unsigned entries
+    );
+
+    // Queue one operation without entering the kernel. A full submission
+    // queue is submitted first.
+    void Queue(
+        int opcode,
+        int fd,
+        void* buffer,
+        unsigned length,
+        std::uint64_t offset,
+        std::uint64_t user_data
+    );
+
+    // Hand every queued operation to the kernel with one io_uring_enter.
+    void Submit();
+
+    // Block until at least one completion is available.
+    bool Wait();
+
+    template <typename Completion>
+    void Reap(
+        Completion&& completion
+    );
+
+private:
+    int ring_fd = -1;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    std::size_t sq_ring_size = 0;
+    std::size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    std::size_t sqes_size = 0;
+    unsigned sq_entries = 0;
+    unsigned queued = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+};
+
+template <typename Completion>
+void IoRing::Reap(Completion&& completion) {
+    unsigned head = *cq_head;
+    const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        completion(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Keeps depth block reads in flight on an io_uring driven through the raw
+// system calls. Blocks are handed out in order; a slot is only resubmitted
+// once the caller has moved past the block it holds.
+
+class UringReader : public InputReader {
+
+public:
+    UringReader(
+        int fd,
+        std::uint64_t size,
+        std::size_t block_size,
+        unsigned depth
+    );
+
+    ~UringReader() override;
+
+    bool Open();
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    void Queue(
+        unsigned slot
+    );
+
+    bool Reap(
+        bool wait
+    );
+
+    int fd;
+    std::uint64_t size;
+    std::size_t block_size;
+    unsigned depth;
+
+    IoRing ring;
+    std::vector<std::vector<unsigned char>> buffers;
+    std::vector<std::uint64_t> slot_offset;
+    std::vector<int> slot_result;
+    std::vector<bool> slot_pending;
+    std::uint64_t submit_offset = 0;
+    std::uint64_t delivered = 0;
+    bool holding = false;
+};
+
+#endif
+
+// Hands out blocks that an asynchronous producer has already loaded into a
+// ring of slots. The producer reserves free slots in offset order, fills them
+// and commits them; a slot is reused once the block after it has been handed
+// out. There are enough slots to hold the lookahead past the next block plus
+// the block still being scanned, so Ready() can always become true. The slot
+// buffers belong to the caller, who can reuse them for the next input.
+
+class WindowReader : public InputReader {
+
+public:
+    WindowReader(
+        std::vector<PageBuffer>& slots,
+        std::uint64_t size,
+        std::size_t block_size,
+        std::size_t lookahead,
+        bool huge_pages
+    );
+
+    struct Slot {
+        unsigned char* data = nullptr;
+        std::size_t length = 0;
+        std::uint64_t offset = 0;
+    };
+
+    bool Reserve(
+        Slot& slot
+    );
+
+    // Complete the oldest reserved slot with got bytes. A short block marks
+    // the end of the input and cancels the reservations after it.
+    void Commit(
+        std::size_t got
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    bool Ready() const override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    std::uint64_t size;
+    std::size_t block_size;
+    std::size_t lookahead;
+    std::vector<PageBuffer>& buffers;
+    std::size_t slots;
+    std::vector<std::size_t> slot_size;
+    std::uint64_t reserved = 0;
+    std::uint64_t loaded = 0;
+    std::uint64_t delivered = 0;
+    bool holding = false;
+};
+
+// Sequential byte sources for archive input. Reads return fewer bytes than
+// asked for only at the end of the stream or after an error.
+
+class ByteStream {
+
+public:
+    virtual ~ByteStream() = default;
+
+    virtual std::size_t Read(
+        unsigned char* data,
+        std::size_t size
+    ) = 0;
+
+    // Drop the next size bytes; returns how many were actually dropped.
+    virtual std::uint64_t Skip(
+        std::uint64_t size
+    );
+};
+
+// Bytes begin..end of a file, read with pread.
+
+class FileStream : public ByteStream {
+
+public:
+    FileStream(
+        int fd,
+        std::uint64_t begin,
+        std::uint64_t end
+    );
+
+    std::size_t Read(
+        unsigned char* data,
+        std::size_t size
+    ) override;
+
+    std::uint64_t Skip(
+        std::uint64_t size
+    ) override;
+
+private:
+    int fd;
+    std::uint64_t position;
+    std::uint64_t end;
+};
+
+// Inflates another stream with zlib: raw deflate for zip members
+// (window_bits -15) or gzip (31), where concatenated members are read as one.
+
+class InflateStream : public ByteStream {
+
+public:
+    InflateStream(
+        ByteStream& source,
+        int window_bits
+    );
+
+    InflateStream(const InflateStream&) = delete;
+    InflateStream& operator=(const InflateStream&) = delete;
+    ~InflateStream() override;
+
+    std::size_t Read(
+        unsigned char* data,
+        std::size_t size
+    ) override;
+
+    bool Failed() const { return failed; }
+
+private:
+    ByteStream& source;
+    int window_bits;
+    z_stream stream{};
+    std::vector<unsigned char> input;
+    bool finished = false;
+    bool failed = false;
+};
+
+// A regular file inside an archive. Hits in it are reported by entry name and
+// offset inside the decoded entry.
+
+struct ArchiveEntry {
+
+    std::string name;
+    std::uint64_t size = 0;
+
+};
+
+// Walks the regular files of a tar (plain or gzip-compressed) or zip archive
+// in archive order. The decoded bytes of the current entry come from Data();
+// Next() moves on, dropping whatever of the current entry was not read.
+
+class Archive {
+
+public:
+    virtual ~Archive() = default;
+
+    // Detects the format from the first bytes; null when fd holds no archive.
+    static std::unique_ptr<Archive> Open(
+        int fd,
+        std::uint64_t size
+    );
+
+    virtual bool Next(
+        ArchiveEntry& entry
+    ) = 0;
+
+    virtual ByteStream& Data() = 0;
+};
+
+// Streams the archive front to back. GNU long names ('L') and pax path and
+// size records ('x') are applied to the entry that follows them.
+
+class TarArchive : public Archive {
+
+public:
+    TarArchive(
+        int fd,
+        std::uint64_t size,
+        bool gzip
+    );
+
+    bool Next(
+        ArchiveEntry& entry
+    ) override;
+
+    ByteStream& Data() override { return data; }
+
+private:
+    class EntryStream : public ByteStream {
+
+    public:
+        explicit EntryStream(TarArchive& archive) : archive(archive) {}
+
+        std::size_t Read(
+            unsigned char* data,
+            std::size_t size
+        ) override;
+
+    private:
+        TarArchive& archive;
+    };
+
+    bool ReadString(
+        std::uint64_t size,
+        std::string& value
+    );
+
+    FileStream file;
+    std::unique_ptr<InflateStream> gunzip;
+    ByteStream* source;
+    EntryStream data{*this};
+    std::uint64_t remaining = 0;
+    std::uint64_t padding = 0;
+};
+
+// Reads the central directory (zip64 included) and opens each member at its
+// local header. Stored members are read in place, deflated ones inflated on
+// the fly; encrypted members and other methods are skipped with a warning.
+
+class ZipArchive : public Archive {
+
+public:
+    ZipArchive(
+        int fd,
+        std::uint64_t size
+    );
+
+    bool Load();
+
+    bool Next(
+        ArchiveEntry& entry
+    ) override;
+
+    ByteStream& Data() override { return *data; }
+
+private:
+    struct Member {
+        std::string name;
+        std::uint16_t flags = 0;
+        std::uint16_t method = 0;
+        std::uint64_t compressed = 0;
+        std::uint64_t size = 0;
+        std::uint64_t local_offset = 0;
+    };
+
+    int fd;
+    std::uint64_t size;
+    std::vector<Member> members;
+    std::size_t next = 0;
+    std::unique_ptr<FileStream> raw;
+    std::unique_ptr<InflateStream> inflate;
+    ByteStream* data = nullptr;
+};
+
+// Hands out the decoded bytes of one archive entry in blocks, with offsets
+// counted from the start of the entry.
+
+class EntryReader : public InputReader {
+
+public:
+    EntryReader(
+        std::size_t block_size,
+        bool huge_pages
+    );
+
+    void Start(
+        ByteStream& stream,
+        std::uint64_t size
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    std::uint64_t Size() const override { return size; }
+
+private:
+    ByteStream* stream = nullptr;
+    std::uint64_t size = 0;
+    std::uint64_t position = 0;
+    PageBuffer buffer;
+};
+
+// Inflates whole compressed chunks read straight from a file. One inflater
+// serves one thread; its stream and input buffer are reused between chunks.
+
+class ChunkInflater {
+
+public:
+    explicit ChunkInflater(int window_bits) : window_bits(window_bits) {}
+
+    ChunkInflater(const ChunkInflater&) = delete;
+    ChunkInflater& operator=(const ChunkInflater&) = delete;
+    ~ChunkInflater();
+
+    // Inflate the size bytes at offset of fd into exactly out_size bytes.
+    bool Inflate(
+        int fd,
+        std::uint64_t offset,
+        std::size_t size,
+        unsigned char* out,
+        std::size_t out_size
+    );
+
+private:
+    int window_bits;
+    z_stream stream{};
+    bool ready = false;
+    std::vector<unsigned char> input;
+};
+
+// qemu refuses L1 tables larger than 32 MiB, and so do we. Host offsets in
+// qcow2 L1 and L2 entries sit in bits 9 to 55.
+
+struct VirtualDiskConfig {
+
+    static constexpr std::size_t SectorSize = 512;
+    static constexpr std::size_t MaxL1Bytes = 32 << 20;
+    static constexpr std::uint64_t Qcow2OffsetMask = 0x00FFFFFFFFFFFE00;
+
+};
+
+// Where a logical cluster of a virtual disk lives in the image file. A
+// compressed cluster is compressed_size bytes of deflate data at host_offset;
+// a stored one is a whole cluster there.
+
+struct ClusterLocation {
+
+    std::uint64_t host_offset = 0;
+    std::uint64_t compressed_size = 0;
+
+};
+
+// qcow2 images and VMDK sparse extents map the logical disk onto host
+// clusters (grains, in VMDK terms) through two-level tables. Locate()
+// translates one logical cluster and returns false for clusters with no host
+// data: unallocated ones, and those marked as reading back as zeros.
+
+class VirtualDisk {
+
+public:
+    virtual ~VirtualDisk() = default;
+
+    // Detects the format from the image header. Returns null, after saying
+    // why, for other files and for images using features not handled here.
+    static std::unique_ptr<VirtualDisk> Open(
+        int fd,
+        std::uint64_t size
+    );
+
+    std::uint64_t Size() const { return size; }
+
+    std::size_t ClusterSize() const { return cluster_size; }
+
+    virtual bool Locate(
+        std::uint64_t cluster,
+        ClusterLocation& location
+    ) = 0;
+
+    // Read or decompress the cluster at location into out. A stored location
+    // may stand for several clusters that follow each other in the image;
+    // stored data missing from the end of the image reads as zeros.
+    bool Fetch(
+        const ClusterLocation& location,
+        unsigned char* out,
+        std::size_t clusters = 1
+    );
+
+    // Read a logical byte range, clusters without host data as zeros.
+    std::size_t Read(
+        unsigned char* data,
+        std::size_t length,
+        std::uint64_t offset
+    );
+
+protected:
+    VirtualDisk(
+        int fd,
+        int window_bits
+    );
+
+    int fd;
+    std::uint64_t size = 0;
+    std::size_t cluster_size = 0;
+
+private:
+    ChunkInflater inflater;
+    std::vector<unsigned char> scratch;
+};
+
+// qcow2 versions 2 and 3. Only the active L1 table is read; snapshots, a
+// backing file and refcounts are ignored, and one L2 table is cached at a
+// time, which suits a front-to-back scan.
+
+class Qcow2Disk : public VirtualDisk {
+
+public:
+    Qcow2Disk(
+        int fd,
+        std::uint64_t file_size
+    );
+
+    bool Load();
+
+    bool Locate(
+        std::uint64_t cluster,
+        ClusterLocation& location
+    ) override;
+
+private:
+    std::uint64_t file_size;
+    unsigned cluster_bits = 0;
+    std::vector<std::uint64_t> l1;
+    std::vector<std::uint64_t> l2;
+    std::uint64_t l2_index = std::numeric_limits<std::uint64_t>::max();
+};
+
+// A single VMDK sparse extent (monolithicSparse, or streamOptimized with its
+// header in the footer). Descriptor files that list several extents are not
+// followed; each extent can be scanned on its own.
+
+class VmdkDisk : public VirtualDisk {
+
+public:
+    VmdkDisk(
+        int fd,
+        std::uint64_t file_size
+    );
+
+    bool Load();
+
+    bool Locate(
+        std::uint64_t cluster,
+        ClusterLocation& location
+    ) override;
+
+private:
+    std::uint64_t file_size;
+    bool compressed_grains = false;
+    bool zeroed_grains = false;
+    std::uint32_t table_entries = 0;
+    std::vector<std::uint32_t> directory;
+    std::vector<std::uint32_t> table;
+    std::uint64_t table_index = std::numeric_limits<std::uint64_t>::max();
+};
+
+// Hands out the logical disk in blocks of whole clusters, with logical
+// offsets. Clusters without host data are never read: blocks end before them
+// and the next block starts at the following allocated cluster. Stored
+// clusters that sit back to back in the image are read with one pread.
+
+class VirtualDiskReader : public InputReader {
+
+public:
+    VirtualDiskReader(
+        VirtualDisk& disk,
+        std::size_t block_size,
+        bool huge_pages
+    );
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    void SkipTo(
+        std::uint64_t offset
+    ) override;
+
+    std::uint64_t Size() const override { return disk.Size(); }
+
+    bool HolesAreZero() const override { return true; }
+
+    // Logical bytes skipped because no host cluster backs them.
+    std::uint64_t Unallocated() const { return unallocated; }
+
+private:
+    VirtualDisk& disk;
+    PageBuffer buffer;
+    std::uint64_t next_cluster = 0;
+    std::uint64_t unallocated = 0;
+};
+
+// A chunk as stored in a segment file: stored chunks are the plain bytes
+// followed by an Adler-32 checksum, compressed ones a zlib stream.
+
+struct EwfChunk {
+
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+    std::uint32_t segment = 0;
+    bool compressed = false;
+
+};
+
+// An Expert Witness (EWF-E01) image split over segment files x.E01, x.E02,
+// ..., x.E99, x.EAA and on. The sections of every segment are walked once to
+// find the volume geometry and the chunk tables; the entries of a table are
+// only read when a chunk it lists is located, one table at a time.
+
+class EwfImage {
+
+public:
+    EwfImage(
+        const fs::path& path,
+        int fd
+    );
+
+    EwfImage(const EwfImage&) = delete;
+    EwfImage& operator=(const EwfImage&) = delete;
+    ~EwfImage();
+
+    bool Load();
+
+    std::uint64_t Size() const { return size; }
+
+    std::size_t ChunkSize() const { return chunk_size; }
+
+    std::uint64_t Chunks() const { return (size + chunk_size - 1) / chunk_size; }
+
+    std::size_t Segments() const { return fds.size(); }
+
+    // The MD5 recorded at acquisition time from a hash or digest section,
+    // in hex; empty when the image carries none.
+    const std::string& AcquisitionMd5() const { return acquisition_md5; }
+
+    // Not thread-safe: it caches the table it read last.
+    bool Locate(
+        std::uint64_t chunk,
+        EwfChunk& location
+    );
+
+    // Read the chunk's first size decoded bytes into out. Safe to call from
+    // several threads, each with its own inflater.
+    bool Fetch(
+        const EwfChunk& location,
+        unsigned char* out,
+        std::size_t size,
+        ChunkInflater& inflater
+    ) const;
+
+    // Read a logical byte range; stops at a chunk that cannot be read.
+    std::size_t Read(
+        unsigned char* data,
+        std::size_t length,
+        std::uint64_t offset
+    );
+
+private:
+    struct Table {
+        std::uint64_t first_chunk = 0;
+        std::uint32_t count = 0;
+        std::uint32_t segment = 0;
+        std::uint64_t entries_offset = 0;
+        std::uint64_t base_offset = 0;
+        std::uint64_t data_end = 0;
+    };
+
+    bool LoadSegment(
+        std::uint32_t segment,
+        bool& last
+    );
+
+    fs::path SegmentPath(
+        std::uint32_t segment
+    ) const;
+
+    fs::path path;
+    std::vector<int> fds;
+    std::uint64_t size = 0;
+    std::size_t chunk_size = 0;
+    std::uint64_t table_chunks = 0;
+    std::vector<Table> tables;
+    std::size_t loaded = std::numeric_limits<std::size_t>::max();
+    std::vector<std::uint32_t> entries;
+    ChunkInflater inflater{MAX_WBITS};
+    std::vector<unsigned char> scratch;
+    std::string acquisition_md5;
+};
+
+// Hands out the logical image in blocks of whole chunks. Worker threads
+// decompress the chunks ahead of the scan into a ring of cache slots; a slot
+// is reused once the scanner has moved past the block holding it. A chunk
+// that cannot be read ends the block before it and is left out as a gap.
+
+class EwfReader : public InputReader {
+
+public:
+    EwfReader(
+        EwfImage& image,
+        std::size_t block_size,
+        std::uint64_t cache_bytes,
+        bool huge_pages
+    );
+
+    EwfReader(const EwfReader&) = delete;
+    EwfReader& operator=(const EwfReader&) = delete;
+    ~EwfReader();
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    void SkipTo(
+        std::uint64_t offset
+    ) override;
+
+    std::uint64_t Size() const override { return image.Size(); }
+
+    std::size_t Slots() const { return slots; }
+
+    std::size_t Workers() const { return workers.size(); }
+
+private:
+    enum class SlotState : unsigned char { Free, Pending, Done, Failed };
+
+    void Schedule();
+
+    void Work();
+
+    EwfImage& image;
+    std::size_t block_chunks;
+    std::size_t slots;
+    PageBuffer cache;
+    std::vector<EwfChunk> locations;
+    std::vector<SlotState> states;
+    std::uint64_t cursor = 0;
+    std::uint64_t released = 0;
+    std::uint64_t scheduled = 0;
+    std::uint64_t claimed = 0;
+    std::uint64_t pending = 0;
+    bool stopping = false;
+    bool warned_missing = false;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable chunk_done;
+    std::vector<std::thread> workers;
+};
+
+// Streaming MD5 (RFC 1321) and SHA-256 (FIPS 180-4). Input is gathered into
+// 64-byte blocks; SHA-256 blocks go through the selected kernel, which uses
+// the SHA extensions where the CPU has them.
+
+class Digest {
+
+public:
+    virtual ~Digest() = default;
+
+    virtual std::string_view Name() const = 0;
+
+    virtual std::size_t Size() const = 0;
+
+    void Update(
+        const unsigned char* data,
+        std::size_t size
+    );
+
+    // Write Size() bytes of digest to out. The digest is spent afterwards.
+    void Final(
+        unsigned char* out
+    );
+
+    std::string Hex();
+
+protected:
+    virtual void Blocks(
+        const unsigned char* data,
+        std::size_t blocks
+    ) = 0;
+
+    virtual bool BigEndian() const = 0;
+
+    virtual void Store(
+        unsigned char* out
+    ) const = 0;
+
+private:
+    std::array<unsigned char, 64> pending{};
+    std::size_t pending_size = 0;
+    std::uint64_t length = 0;
+};
+
+class Md5Digest : public Digest {
+
+public:
+    std::string_view Name() const override { return "md5"; }
+
+    std::size_t Size() const override { return 16; }
+
+protected:
+    void Blocks(
+        const unsigned char* data,
+        std::size_t blocks
+    ) override;
+
+    bool BigEndian() const override { return false; }
+
+    void Store(
+        unsigned char* out
+    ) const override;
+
+private:
+    std::array<std::uint32_t, 4> state{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+};
+
+class Sha256Digest : public Digest {
+
+public:
+    std::string_view Name() const override { return "sha256"; }
+
+    std::size_t Size() const override { return 32; }
+
+    static void Compute(
+        const unsigned char* data,
+        std::size_t size,
+        unsigned char* out
+    );
+
+protected:
+    void Blocks(
+        const unsigned char* data,
+        std::size_t blocks
+    ) override;
+
+    bool BigEndian() const override { return true; }
+
+    void Store(
+        unsigned char* out
+    ) const override;
+
+private:
+    std::array<std::uint32_t, 8> state{0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+};
+
+// Hashes everything another reader hands out on dedicated threads, one per
+// digest, straight from that reader's buffers: each block is posted to the
+// hashing threads as it is returned, and the next call waits for them before
+// letting the inner reader reuse its buffer. Payload skips are not passed on,
+// since every byte has to be hashed; gaps between blocks hash as zeros.
+
+class HashingReader : public InputReader {
+
+public:
+    HashingReader(
+        InputReader& inner,
+        std::vector<std::unique_ptr<Digest>> digests
+    );
+
+    HashingReader(const HashingReader&) = delete;
+    HashingReader& operator=(const HashingReader&) = delete;
+    ~HashingReader();
+
+    bool Next(
+        InputBlock& block
+    ) override;
+
+    std::uint64_t Size() const override { return inner.Size(); }
+
+    bool Ready() const override { return inner.Ready(); }
+
+    bool HolesAreZero() const override { return inner.HolesAreZero(); }
+
+    // Hash up to the end of the input and finish the digests.
+    void Finish();
+
+    const std::vector<std::unique_ptr<Digest>>& Digests() const { return digests; }
+
+    // Bytes hashed as zeros because the inner reader left them out.
+    std::uint64_t ZeroFilled() const { return zero_filled; }
+
+private:
+    void Post(
+        std::uint64_t gap,
+        const unsigned char* data,
+        std::size_t size
+    );
+
+    void Wait();
+
+    void Work(
+        Digest& digest
+    );
+
+    InputReader& inner;
+    std::vector<std::unique_ptr<Digest>> digests;
+    std::uint64_t hashed_end = 0;
+    std::uint64_t zero_filled = 0;
+    std::uint64_t gap = 0;
+    const unsigned char* data = nullptr;
+    std::size_t size = 0;
+    std::uint64_t generation = 0;
+    std::size_t busy = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::vector<std::thread> threads;
+};
+
+// Index-only scans read smaller blocks so that little of a skipped payload is
+// pulled in with the block holding its header.
+//
+// Reader blocks are split into fixed-size extents for entropy classification.
+// Random, encrypted and compressed data sits just below 8 bits per byte while
+// raw RGB pixels stay well under it, so the default threshold only catches
+// extents that cannot hold an uncompressed payload.
+
+struct ScanConfig {
+
+    static constexpr std::size_t BlockSize = 4 << 20;
+    static constexpr std::size_t IndexOnlyBlockSize = 128 << 10;
+    static constexpr std::size_t ExtentSize = 64 << 10;
+    static constexpr double DefaultEntropyThreshold = 7.99;
+
+};
+
+struct ScanStats {
+
+    std::uint64_t bytes_read = 0;
+    std::uint64_t bytes_skipped_entropy = 0;
+    std::uint64_t bytes_skipped_payload = 0;
+    std::uint64_t headers = 0;
+    std::uint64_t rejected = 0;
+    std::uint64_t hits = 0;
+
+};
+
+// A header with valid dimensions. payload points at width*height*3 bytes and
+// stays valid until the next call to HitScanner::Next(); it is null when the
+// scanner was asked to skip payloads.
+
+struct ScannedHit {
+
+    std::uint64_t offset = 0;
+    std::string_view type;
+    int width = 0;
+    int height = 0;
+    const unsigned char* payload = nullptr;
+    std::size_t payload_size = 0;
+
+};
+
+class HitScanner {
+
+public:
+    HitScanner(
+        InputReader& reader,
+        bool read_payloads,
+        double entropy_threshold,
+        bool huge_pages = false
+    );
+
+    // Scan payloads using a caller-owned assembly buffer of at least
+    // ImageConfig::MaxPayloadSize bytes, so it can be reused across inputs.
+    HitScanner(
+        InputReader& reader,
+        double entropy_threshold,
+        unsigned char* assembly
+    );
+
+    bool Next(
+        ScannedHit& hit
+    );
+
+    const ScanStats& Stats() const { return stats; }
+
+    // Next() returned false because the reader was not Ready(), not because
+    // the input ended. Calling Next() again resumes the scan.
+    bool Stalled() const { return stalled; }
+
+private:
+    bool Pull();
+
+    void Classify();
+
+    const unsigned char* Ensure(
+        std::uint64_t from,
+        std::size_t size
+    );
+
+    InputReader& reader;
+    bool read_payloads;
+    double entropy_threshold;
+    bool done = false;
+    bool stalled = false;
+
+    InputBlock block;
+    std::uint64_t position = 0;
+    std::vector<bool> skip_extent;
+
+    std::array<unsigned char, 16> tail{};
+    std::size_t tail_size = 0;
+    std::uint64_t tail_offset = 0;
+
+    PageBuffer assembly;
+    unsigned char* assembled;
+    ScanStats stats;
+};
+
+// The hot kernels are compiled for several instruction sets into the same
+// binary with target attributes, and the best variant the CPU supports is
+// picked once through CPUID. RTTI_ISA=baseline|avx2|avx512 in the environment
+// caps the choice, e.g. to compare variants on one host.
+
+enum class IsaLevel { Baseline, Avx2, Avx512 };
+
+struct Kernels {
+
+    IsaLevel level = IsaLevel::Baseline;
+    std::string_view name;
+    // Returns the start of the first header in [begin, end), or nullptr when
+    // none is fully contained in the range.
+    const unsigned char* (*find_header)(const unsigned char* begin, const unsigned char* end) = nullptr;
+    void (*channel_sums)(const unsigned char* data, std::size_t size, std::uint64_t* sums) = nullptr;
+    std::uint64_t (*deviation)(const unsigned char* data, std::size_t size, const unsigned char* mean) = nullptr;
+    void (*swap_red_blue)(unsigned char* out, const unsigned char* row, std::size_t size) = nullptr;
+    std::string_view sha256_name;
+    void (*sha256_blocks)(std::uint32_t* state, const unsigned char* data, std::size_t blocks) = nullptr;
+
+};
+
+class Isa {
+
+public:
+    static const Kernels& Selected();
+
+private:
+    static Kernels Select();
+};
+
+class ImageFile {
+
+public:
+    static const unsigned char* FindHeader(
+        const unsigned char* begin,
+        const unsigned char* end
+    );
+
+    static std::pair<int, int> ReadDimensions(
+        const unsigned char* bytes
+    );
+
+    static double ByteEntropy(
+        const unsigned char* data,
+        std::size_t size
+    );
+
+    static double MeanDeviation(
+        const unsigned char* img_data,
+        std::size_t size
+    );
+
+    static void EncodeBMP(
+        std::vector<unsigned char>& bmp,
+        const unsigned char* img_data,
+        int width,
+        int height
+    );
+
+    // With digest buffers given, the SHA-256 of the payload and of the
+    // encoded BMP are computed from memory on the calling thread.
+    static void SaveAsBMP(
+        const std::string& output_path,
+        const unsigned char* img_data,
+        int width,
+        int height,
+        unsigned char* payload_sha256 = nullptr,
+        unsigned char* output_sha256 = nullptr
+    );
+
+    static std::vector<unsigned char>& EncodeBuffer();
+
+    static void Process(
+        const fs::path& file_path,
+        const ProcessOptions& options = {}
+    );
+
+    static void ProcessAsync(
+        const std::vector<fs::path>& files,
+        const ProcessOptions& options = {}
+    );
+
+    static void Extract(
+        const fs::path& file_path,
+        const ExtractOptions& options
+    );
+
+    static void Unpack(
+        const fs::path& pack_path,
+        const UnpackOptions& options
+    );
+
+    static void Triage(
+        const fs::path& file_path,
+        const TriageOptions& options
+    );
+
+    static void BenchIO(
+        const BenchOptions& options
+    );
+
+    static void BenchThreads(
+        const ScalingOptions& options
+    );
+};
+
+// Thumbnail pack: every payload is run through a pixel predictor and its
+// residuals compressed on their own as a zstd frame with a dictionary trained
+// on the first payloads of the run, so that similar thumbnails compress better
+// than each would alone. The window covers the largest payload, so matches
+// reach back across the whole thumbnail. Runs with too few payloads to train
+// on are packed without a dictionary. Layout, all little-endian: header,
+// dictionary, records (output name followed by the compressed residuals) and a
+// table of entries sorted by hit index for random access. The header is
+// rewritten with the table's place once it is known.
+
+struct PackConfig {
+
+    static constexpr std::array<char, 8> Magic = {'R', 'T', 'T', 'I', 'P', 'A', 'C', 'K'};
+    static constexpr std::uint32_t Version = 2;
+
+    static constexpr std::size_t DictionarySize = 112 << 10;
+    static constexpr std::size_t TrainingSamples = 32;
+    static constexpr std::size_t MinTrainingSamples = 8;
+    static constexpr std::size_t TrainingBytes = 48 << 20;
+    static constexpr std::size_t TrainingNameBytes = TrainingSamples * 256;
+    static constexpr int WindowLog = 24;
+    static constexpr int Level = 9;
+
+    static_assert(std::size_t{1} << WindowLog >= ImageConfig::MaxPayloadSize);
+
+};
+
+struct PackHeader {
+
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t dictionary_size;
+    std::uint64_t entry_count;
+    std::uint64_t table_offset;
+
+};
+
+struct PackEntry {
+
+    std::uint64_t offset;
+    std::uint32_t size;
+    std::uint32_t index;
+    std::uint16_t width;
+    std::uint16_t height;
+    std::uint16_t name_size;
+    std::uint16_t reserved;
+
+};
+
+class ThumbnailPack {
+
+public:
+    ThumbnailPack() = default;
+    ThumbnailPack(const ThumbnailPack&) = delete;
+    ThumbnailPack& operator=(const ThumbnailPack&) = delete;
+    ~ThumbnailPack();
+
+    bool Create(
+        const fs::path& path
+    );
+
+    // Safe to call from several threads. The first payloads are copied into
+    // the training buffer and held back until the dictionary has been
+    // trained on them; digests, when asked for, are those of the payload and
+    // of the BMP unpack writes for it.
+    void Add(
+        const std::string& name,
+        int index,
+        const unsigned char* pixels,
+        int width,
+        int height,
+        unsigned char* payload_sha256 = nullptr,
+        unsigned char* output_sha256 = nullptr
+    );
+
+    // Write the table and header once every Add has returned.
+    bool Finish();
+
+    // The calling thread's compression context and output buffer, set up on
+    // first use; call it early so that is not on the hot path.
+    static void Warm();
+
+    std::uint64_t Entries() const { return entries.size(); }
+
+    std::uint64_t RawBytes() const { return raw_bytes; }
+
+    std::uint64_t PackedBytes() const { return end; }
+
+    std::size_t DictionaryBytes() const { return dictionary.size(); }
+
+private:
+    // A payload held back for training; its residuals and output name live in
+    // the training buffers, which are allocated up front by Create.
+    struct Held {
+        std::size_t name_offset = 0;
+        std::size_t name_size = 0;
+        std::size_t pixels_offset = 0;
+        int index = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    void Train();
+
+    void StoreHeld();
+
+    void Store(
+        std::string_view name,
+        int index,
+        const unsigned char* residuals,
+        int width,
+        int height
+    );
+
+    int fd = -1;
+    bool trained = false;
+    std::vector<Held> held;
+    std::vector<unsigned char> samples;
+    std::vector<std::size_t> sample_sizes;
+    std::string held_names;
+    std::vector<unsigned char> dictionary;
+    ZSTD_CDict* cdict = nullptr;
+    std::vector<PackEntry> entries;
+    std::uint64_t end = 0;
+    std::uint64_t raw_bytes = 0;
+    std::mutex mutex;
+};
+
+// With output hashes, a job also points at the manifest row waiting for it:
+// the worker stores both digests there and then marks the row done. Rows are
+// kept in a ring so the manifest stays in scan order; the scan only waits for
+// a worker once the ring is full.
+
+struct EncodeConfig {
+
+    static constexpr std::size_t PendingRows = 256;
+
+};
+
+struct PendingRow {
+
+    HitRecord hit;
+    std::atomic<bool> done{true};
+
+};
+
+struct EncodeJob {
+
+    std::string output;
+    PageBuffer pixels;
+    int width = 0;
+    int height = 0;
+    std::size_t shard = 0;
+    int index = 0;
+    PendingRow* row = nullptr;
+
+};
+
+// Encodes and writes BMPs on worker threads while the calling thread keeps
+// scanning. Payloads are copied into one of a fixed set of job buffers, each
+// reserved for the largest thumbnail, so the scan only waits when every
+// buffer is queued or being encoded.
+//
+// With NUMA placement the pool is split into one shard per memory node: each
+// shard has its own workers pinned to the node, its own job buffers placed on
+// the node and its own queue. Hits are dealt to the shards round-robin, so
+// encoding reads and writes stay within one socket's memory.
+
+class EncodePool {
+
+public:
+    // With a pack, jobs are added to it instead of being written as BMPs.
+    EncodePool(
+        int threads,
+        bool numa,
+        bool huge_pages,
+        ThumbnailPack* pack = nullptr
+    );
+
+    EncodePool(const EncodePool&) = delete;
+    EncodePool& operator=(const EncodePool&) = delete;
+    ~EncodePool();
+
+    EncodeJob& Acquire();
+
+    void Submit(
+        EncodeJob& job
+    );
+
+private:
+    struct Shard {
+        int node = -1;
+        std::vector<std::unique_ptr<EncodeJob>> jobs;
+        std::vector<EncodeJob*> free_jobs;
+        std::vector<EncodeJob*> queue;
+        std::size_t queue_head = 0;
+        std::size_t queued = 0;
+        bool stopping = false;
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable job_free;
+    };
+
+    void Work(
+        Shard& shard,
+        int worker
+    );
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::size_t next_shard = 0;
+    ThumbnailPack* pack = nullptr;
+    std::vector<std::thread> workers;
+};
+
+// NUMA placement without libnuma: the CPUs of each node come from sysfs,
+// threads are pinned with sched_setaffinity and memory ranges are steered to
+// a node with mbind(2). Without /sys/devices/system/node the machine is a
+// single node holding every CPU.
+
+struct NumaNode {
+
+    int id = 0;
+    std::vector<int> cpus;
+
+};
+
+class Numa {
+
+public:
+    static const std::vector<NumaNode>& Nodes();
+
+    static bool PinThread(
+        const NumaNode& node
+    );
+
+    static void PreferNode(
+        const void* data,
+        std::size_t size,
+        const NumaNode& node
+    );
+};
+
+// The async pipeline reads each input in BlockSize pieces through a window
+// that holds the largest payload past the block being scanned. Each device
+// gets a bounded number of concurrent input streams: a single one for
+// spinning disks, where a second sequential stream turns both into seeks,
+// and several for solid-state and virtual devices.
+
+struct AsyncConfig {
+
+    static constexpr std::size_t BlockSize = 1 << 20;
+    static constexpr int RotationalStreams = 1;
+    static constexpr int SolidStateStreams = 8;
+    static constexpr unsigned IoDepth = 64;
+
+};
+
+// Inputs grouped by the disk they live on. Files on different partitions of
+// one disk, or on a device-mapper or md volume over it, share a group. A
+// block device given as input belongs to its own disk.
+
+struct InputDevice {
+
+    std::string name;
+    bool rotational = false;
+    int streams = 1;
+    std::vector<std::size_t> files;
+
+};
+
+class Devices {
+
+public:
+    static std::vector<InputDevice> Group(
+        const std::vector<fs::path>& files,
+        int streams_per_device
+    );
+
+private:
+    static std::string DiskOf(
+        dev_t device,
+        bool& rotational
+    );
+};
+
+// A lazily started coroutine. Awaiting a Task starts it and resumes the
+// awaiting coroutine, on whatever thread the Task finished on, when it
+// completes; exceptions are rethrown there.
+
+class Task {
+
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr exception;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept { return handle.promise().continuation; }
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    void await_resume() const {
+        if (handle.promise().exception) std::rethrow_exception(handle.promise().exception);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Runs coroutines on a small pool of threads. co_await Schedule() moves the
+// awaiting coroutine onto the pool.
+
+class Scheduler {
+
+public:
+    explicit Scheduler(
+        int threads
+    );
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    ~Scheduler();
+
+    void Post(
+        std::coroutine_handle<> handle
+    );
+
+    auto Schedule() {
+        struct Awaiter {
+            Scheduler& scheduler;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { scheduler.Post(handle); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+    // Start task on the pool and count done down when it has finished.
+    void Spawn(
+        Task task,
+        std::latch& done
+    );
+
+private:
+    void Work(
+        int worker
+    );
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::coroutine_handle<>> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+class AsyncIo;
+struct IoBatch;
+
+// One read or write of an IoBatch. result is the byte count or -errno.
+
+struct IoRequest {
+
+    void* buffer = nullptr;
+    std::size_t length = 0;
+    std::uint64_t offset = 0;
+    std::int64_t result = 0;
+    IoBatch* batch = nullptr;
+
+};
+
+// Awaitable group of reads or writes on one file descriptor. The awaiting
+// coroutine is resumed on the scheduler once every request has completed.
+
+struct IoBatch {
+
+    AsyncIo& io;
+    bool write;
+    int fd;
+    IoRequest* requests;
+    std::size_t count;
+    std::atomic<std::size_t> remaining{0};
+    std::coroutine_handle<> handle{};
+
+    bool await_ready();
+
+    void await_suspend(
+        std::coroutine_handle<> awaiting
+    );
+
+    void await_resume() const noexcept {}
+
+};
+
+// Asynchronous file I/O for coroutines. Requests go to an io_uring ring whose
+// completions are reaped on a dedicated thread, which hands the finished
+// coroutines back to the scheduler. Without io_uring every request completes
+// inline with pread or pwrite and the awaiting coroutine does not suspend.
+
+class AsyncIo {
+
+public:
+    AsyncIo(
+        Scheduler& scheduler,
+        unsigned depth
+    );
+
+    AsyncIo(const AsyncIo&) = delete;
+    AsyncIo& operator=(const AsyncIo&) = delete;
+    ~AsyncIo();
+
+    bool Uring() const { return uring; }
+
+    IoBatch Read(
+        int fd,
+        IoRequest* requests,
+        std::size_t count
+    );
+
+    IoBatch Write(
+        int fd,
+        IoRequest* requests,
+        std::size_t count
+    );
+
+private:
+    friend struct IoBatch;
+
+    void Reap();
+
+    Scheduler& scheduler;
+    bool uring = false;
+#ifdef RTTI_HAVE_IO_URING
+    IoRing ring;
+    std::mutex submit_mutex;
+    std::atomic<bool> stopping{false};
+    std::thread reaper;
+#endif
+};
+
+// Parse a byte count with an optional K, M or G suffix (powers of 1024).
+
+static bool ParseByteSize(std::string_view text, std::uint64_t& value) {
+    std::uint64_t multiplier = 1;
+    if (!text.empty()) {
+        switch (text.back()) {
+            case 'K': case 'k': multiplier = 1ULL << 10; break;
+            case 'M': case 'm': multiplier = 1ULL << 20; break;
+            case 'G': case 'g': multiplier = 1ULL << 30; break;
+        }
+        if (multiplier != 1) text.remove_suffix(1);
+    }
+    try {
+        std::size_t used = 0;
+        value = std::stoull(std::string(text), &used) * multiplier;
+        return used == text.size() && value > 0;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Parse a comma-separated list of image digests to compute.
+
+static bool ParseHashList(std::string_view list, ProcessOptions& options) {
+    while (!list.empty()) {
+        const std::size_t comma = list.find(',');
+        const std::string_view name = list.substr(0, comma);
+        list = (comma == std::string_view::npos) ? std::string_view() : list.substr(comma + 1);
+        if (name == "md5") {
+            options.hash_md5 = true;
+        } else if (name == "sha256") {
+            options.hash_sha256 = true;
+        } else {
+            return false;
+        }
+    }
+    return options.hash_md5 || options.hash_sha256;
+}
+
+static int RunProcess(int argc, char** argv) {
+    ProcessOptions options;
+    std::vector<fs::path> files;
+    bool from_stdin = false;
+    bool usage = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--index-only") {
+            options.index_only = true;
+        } else if (arg == "--manifest" && i + 1 < argc) {
+            options.manifest_path = argv[++i];
+        } else if (arg == "--index" && i + 1 < argc) {
+            options.index_path = argv[++i];
+        } else if (arg == "--skip-blank") {
+            options.skip_blank = true;
+        } else if (arg == "--blank-threshold" && i + 1 < argc) {
+            char* end = nullptr;
+            options.blank_threshold = std::strtod(argv[++i], &end);
+            if (*end != '\0' || options.blank_threshold < 0) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--skip-high-entropy") {
+            if (options.entropy_threshold <= 0) options.entropy_threshold = ScanConfig::DefaultEntropyThreshold;
+        } else if (arg == "--entropy-threshold" && i + 1 < argc) {
+            char* end = nullptr;
+            options.entropy_threshold = std::strtod(argv[++i], &end);
+            if (*end != '\0' || options.entropy_threshold <= 0 || options.entropy_threshold > 8) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--assert-zero-alloc") {
+            options.assert_zero_alloc = true;
+        } else if (arg == "--numa") {
+            options.numa = true;
+        } else if (arg == "--huge-pages") {
+            options.huge_pages = true;
+        } else if (arg == "--mmap") {
+            options.mmap_input = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+            if (options.threads < 1 || options.threads > 256) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--trace" && i + 1 < argc) {
+            options.trace_path = argv[++i];
+        } else if (arg == "--metrics-file" && i + 1 < argc) {
+            options.metrics_path = argv[++i];
+        } else if (arg == "--metrics-interval" && i + 1 < argc) {
+            options.metrics_interval = std::atof(argv[++i]);
+            if (options.metrics_interval <= 0) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            options.metrics_port = std::atoi(argv[++i]);
+            if (options.metrics_port <= 0 || options.metrics_port > 65535) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--archive") {
+            options.archive = true;
+        } else if (arg == "--virtual-disk") {
+            options.virtual_disk = true;
+        } else if (arg == "--ewf") {
+            options.ewf = true;
+        } else if (arg == "--skip-errors") {
+            options.skip_errors = true;
+        } else if (arg == "--mapfile" && i + 1 < argc) {
+            options.skip_errors = true;
+            options.mapfile_path = argv[++i];
+        } else if (arg == "--write-mapfile" && i + 1 < argc) {
+            options.skip_errors = true;
+            options.write_mapfile_path = argv[++i];
+        } else if (arg == "--memory-budget" && i + 1 < argc) {
+            if (!ParseByteSize(argv[++i], options.memory_budget)) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--ignore-hashes" && i + 1 < argc) {
+            options.ignore_hashes_path = argv[++i];
+        } else if (arg == "--alert-hashes" && i + 1 < argc) {
+            options.alert_hashes_path = argv[++i];
+        } else if (arg == "--pack" && i + 1 < argc) {
+            options.pack_path = argv[++i];
+        } else if (arg == "--output-hashes") {
+            options.output_hashes = true;
+        } else if (arg == "--hash" && i + 1 < argc) {
+            if (!ParseHashList(argv[++i], options)) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--async") {
+            options.async = true;
+        } else if (arg == "--streams-per-device" && i + 1 < argc) {
+            options.streams_per_device = std::atoi(argv[++i]);
+            if (options.streams_per_device < 1 || options.streams_per_device > 256) {
+                usage = true;
+                break;
+            }
+        } else if (arg == "--stdin") {
+            options.async = true;
+            from_stdin = true;
+        } else if (arg == "--dedup") {
+            options.dedup = true;
+        } else if (arg == "--dedup-against" && i + 1 < argc) {
+            options.dedup = true;
+            options.dedup_index_path = argv[++i];
+        } else if (!arg.empty() && arg[0] != '-' && (files.empty() || options.async)) {
+            files.push_back(argv[i]);
+        } else {
+            usage = true;
+            break;
+        }
+    }
+
+// The async pipeline carves full payloads into BMPs only; it writes no index
+// and reads with its own backend.
+    if (options.async && (options.index_only || !options.index_path.empty()
+                          || options.mmap_input || options.numa || options.assert_zero_alloc)) {
+        usage = true;
+    }
+
+// Archive entries are streamed, so hits have no input offset an index or a
+// mapping could refer to.
+    if (options.archive && (options.async || !options.index_path.empty() || options.mmap_input)) usage = true;
+    if (options.virtual_disk && (options.archive || options.async || options.mmap_input)) usage = true;
+    if (options.ewf && (options.virtual_disk || options.archive || options.async || options.mmap_input)) usage = true;
+    if (options.skip_errors && (options.ewf || options.virtual_disk || options.archive || options.async || options.mmap_input)) usage = true;
+    if ((options.hash_md5 || options.hash_sha256) && (options.archive || options.async)) usage = true;
+
+// The pack is written by the encode pool of a single-input run.
+    if (!options.pack_path.empty() && (options.index_only || options.async)) usage = true;
+
+// Known-hash lists are matched against payloads, which index-only runs skip.
+    if (options.index_only && (!options.ignore_hashes_path.empty() || !options.alert_hashes_path.empty())) usage = true;
+
+// Paths on stdin are separated by NUL bytes (find -print0) when the list
+// contains any, and by line breaks otherwise.
+    if (from_stdin && !usage) {
+        const std::string list{std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>()};
+        const char separator = list.find('\0') != std::string::npos ? '\0' : '\n';
+        std::size_t start = 0;
+        while (start < list.size()) {
+            std::size_t stop = list.find(separator, start);
+            if (stop == std::string::npos) stop = list.size();
+            std::string_view path(list.data() + start, stop - start);
+            if (separator == '\n' && !path.empty() && path.back() == '\r') path.remove_suffix(1);
+            if (!path.empty()) files.emplace_back(path);
+            start = stop + 1;
+        }
+    }
+
+    if (usage || (files.empty() && !from_stdin)) {
+        std::cerr << "Usage: " << argv[0] << " [--index-only] [--manifest <path>] [--index <path>]"
+                  << " [--dedup] [--dedup-against <index>] [--skip-blank] [--blank-threshold <value>]"
+                  << " [--skip-high-entropy] [--entropy-threshold <bits>] [--threads <n>] [--numa] [--mmap] [--huge-pages] [--archive] [--virtual-disk] [--ewf] [--memory-budget <bytes>] [--skip-errors] [--mapfile <path>] [--write-mapfile <path>] [--hash <list>] [--output-hashes] [--ignore-hashes <path>] [--alert-hashes <path>] [--pack <path>] [--stats] [--assert-zero-alloc] [--trace <path>]"
+                  << " [--metrics-file <path>] [--metrics-interval <seconds>] [--metrics-port <port>] <file_path>\n"
+                  << "       " << argv[0] << " (--async <file_path>... | --stdin) [--threads <n>] [--streams-per-device <n>] [--manifest <path>] [--dedup] [--skip-blank] [--skip-high-entropy] [--huge-pages] [--output-hashes] [--ignore-hashes <path>] [--alert-hashes <path>] [--stats]\n"
+                  << "       " << argv[0] << " extract (--from-manifest <path> | --from-index <path>) [--hits <list>] [--virtual-disk | --ewf] <file_path>\n"
+                  << "       " << argv[0] << " unpack [--hits <list>] <pack_path>\n"
+                  << "       " << argv[0] << " triage [options] <file_path>\n";
+        return 1;
+    }
+
+    if (options.index_only && options.manifest_path.empty() && options.index_path.empty()) options.manifest_path = "-";
+
+    if (!options.trace_path.empty()) {
+        Trace::Enable();
+        Trace::SetThreadName("main");
+    }
+    if (options.stats || options.assert_zero_alloc) Allocations::Enable();
+
+    {
+        std::unique_ptr<MetricsExporter> exporter;
+        if (!options.metrics_path.empty() || options.metrics_port > 0) {
+            exporter = std::make_unique<MetricsExporter>(options.metrics_path, options.metrics_interval, options.metrics_port);
+        }
+        if (options.async) {
+            ImageFile::ProcessAsync(files, options);
+        } else {
+            ImageFile::Process(files.front(), options);
+        }
+    }
+
+    if (!options.trace_path.empty() && !Trace::Write(options.trace_path)) return 1;
+
+    if (options.assert_zero_alloc && Allocations::SteadyAllocations() > 0) {
+        std::cerr << Allocations::SteadyAllocations() << " heap allocations in " << Allocations::SteadyHits()
+                  << " steady-state hits.\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+// Parse a hit selection such as "3,7,10-12" into sorted, merged ranges. Hit
+// indices start at 1; reversed ranges, indices out of int range and items
+// that are not entirely numbers are rejected.
+
+static bool ParseHitList(std::string_view list, std::vector<HitRange>& hits) {
+    auto parse = [](std::string_view text, int& value) {
+        const char* end = text.data() + text.size();
+        const auto [ptr, error] = std::from_chars(text.data(), end, value);
+        return error == std::errc() && ptr == end && value >= 1;
+    };
+    while (!list.empty()) {
+        const std::size_t comma = list.find(',');
+        const std::string_view item = list.substr(0, comma);
+        list = (comma == std::string_view::npos) ? std::string_view() : list.substr(comma + 1);
+
+        const std::size_t dash = item.find('-');
+        HitRange range;
+        if (!parse(item.substr(0, dash), range.first)) return false;
+        range.last = range.first;
+        if (dash != std::string_view::npos && !parse(item.substr(dash + 1), range.last)) return false;
+        if (range.last < range.first) return false;
+        hits.push_back(range);
+    }
+
+    std::sort(hits.begin(), hits.end(), [](const HitRange& a, const HitRange& b) { return a.first < b.first; });
+    std::vector<HitRange> merged;
+    for (const HitRange& range : hits) {
+        if (!merged.empty() && static_cast<std::int64_t>(range.first) <= static_cast<std::int64_t>(merged.back().last) + 1) {
+            merged.back().last = std::max(merged.back().last, range.last);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    hits = std::move(merged);
+    return true;
+}
+
+static bool HitSelected(const std::vector<HitRange>& hits, int index) {
+    auto after = std::upper_bound(hits.begin(), hits.end(), index, [](int value, const HitRange& range) { return value < range.first; });
+    return after != hits.begin() && index <= std::prev(after)->last;
+}
+
+// Report the selected hits that were not found, given the sorted indices that
+// were. Runs of missing indices are reported as one range.
+
+static void ReportMissingHits(const std::vector<HitRange>& hits, const std::vector<int>& found, const char* source) {
+    auto report = [source](std::int64_t first, std::int64_t last) {
+        if (first == last) {
+            std::cerr << "Hit " << first << " is not in the " << source << ".\n";
+        } else {
+            std::cerr << "Hits " << first << "-" << last << " are not in the " << source << ".\n";
+        }
+    };
+    auto next_found = found.begin();
+    for (const HitRange& range : hits) {
+        std::int64_t next = range.first;
+        next_found = std::lower_bound(next_found, found.end(), range.first);
+        for (; next_found != found.end() && *next_found <= range.last; ++next_found) {
+            if (*next_found > next) report(next, *next_found - 1);
+            next = static_cast<std::int64_t>(*next_found) + 1;
+        }
+        if (next <= range.last) report(next, range.last);
+    }
+}
+
+static int RunExtract(int argc, char** argv) {
+    ExtractOptions options;
+    fs::path file_path;
+    bool valid = true;
+
+    for (int i = 2; i < argc && valid; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--from-manifest" && i + 1 < argc) {
+            options.manifest_path = argv[++i];
+        } else if (arg == "--from-index" && i + 1 < argc) {
+            options.index_path = argv[++i];
+        } else if (arg == "--hits" && i + 1 < argc) {
+            valid = ParseHitList(argv[++i], options.hits);
+        } else if (arg == "--virtual-disk") {
+            options.virtual_disk = true;
+        } else if (arg == "--ewf") {
+            options.ewf = true;
+        } else if (!arg.empty() && arg[0] != '-' && file_path.empty()) {
+            file_path = argv[i];
+        } else {
+            valid = false;
+        }
+    }
+
+    if (!valid || file_path.empty() || options.manifest_path.empty() == options.index_path.empty() || (options.virtual_disk && options.ewf)) {
+        std::cerr << "Usage: " << argv[0] << " extract (--from-manifest <path> | --from-index <path>) [--hits <list>] [--virtual-disk | --ewf] <file_path>\n";
+        return 1;
+    }
+
+    try {
+        ImageFile::Extract(file_path, options);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+static int RunUnpack(int argc, char** argv) {
+    UnpackOptions options;
+    fs::path pack_path;
+    bool valid = true;
+
+    for (int i = 2; i < argc && valid; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--hits" && i + 1 < argc) {
+            valid = ParseHitList(argv[++i], options.hits);
+        } else if (!arg.empty() && arg[0] != '-' && pack_path.empty()) {
+            pack_path = argv[i];
+        } else {
+            valid = false;
+        }
+    }
+
+    if (!valid || pack_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " unpack [--hits <list>] <pack_path>\n";
+        return 1;
+    }
+
+    try {
+        ImageFile::Unpack(pack_path, options);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+static int RunTriage(int argc, char** argv) {
+    TriageOptions options;
+    fs::path file_path;
+    bool valid = true;
+
+    for (int i = 2; i < argc && valid; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--block-size" && i + 1 < argc) {
+            valid = ParseByteSize(argv[++i], options.block_size);
+        } else if (arg == "--sample-bytes" && i + 1 < argc) {
+            valid = ParseByteSize(argv[++i], options.sample_bytes);
+        } else if (arg == "--time-limit" && i + 1 < argc) {
+            options.time_limit = std::atof(argv[++i]);
+            valid = options.time_limit > 0;
+        } else if (arg == "--random") {
+            options.stratified = false;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (!arg.empty() && arg[0] != '-' && file_path.empty()) {
+            file_path = argv[i];
+        } else {
+            valid = false;
+        }
+    }
+
+    if (!valid || file_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " triage [--block-size <bytes>] [--sample-bytes <bytes>]"
+                  << " [--time-limit <seconds>] [--random] [--seed <n>] <file_path>\n";
+        return 1;
+    }
+
+    try {
+        ImageFile::Triage(file_path, options);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+static int RunBenchIO(int argc, char** argv) {
+    BenchOptions options;
+    bool valid = true;
+
+    for (int i = 2; i < argc && valid; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--synthetic" && i + 1 < argc) {
+            std::uint64_t size = 0;
+            valid = ParseByteSize(argv[++i], size) && size > 0;
+            options.synthetic_sizes.push_back(size);
+        } else if (arg == "--runs" && i + 1 < argc) {
+            options.runs = std::atoi(argv[++i]);
+            valid = options.runs > 0;
+        } else if (arg == "--warm") {
+            options.warm = true;
+        } else if (!arg.empty() && arg[0] != '-') {
+            options.inputs.push_back(argv[i]);
+        } else {
+            valid = false;
+        }
+    }
+
+    if (!valid || (options.inputs.empty() && options.synthetic_sizes.empty())) {
+        std::cerr << "Usage: " << argv[0] << " bench-io [--synthetic <bytes>]... [--runs <n>] [--warm] [<file_path>...]\n";
+        return 1;
+    }
+
+    try {
+        ImageFile::BenchIO(options);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+static int RunBenchThreads(int argc, char** argv) {
+    ScalingOptions options;
+    bool valid = true;
+
+    for (int i = 2; i < argc && valid; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--max-threads" && i + 1 < argc) {
+            options.max_threads = std::atoi(argv[++i]);
+            valid = options.max_threads > 0 && options.max_threads <= 256;
+        } else if (arg == "--runs" && i + 1 < argc) {
+            options.runs = std::atoi(argv[++i]);
+            valid = options.runs > 0;
+        } else if (arg == "--csv" && i + 1 < argc) {
+            options.csv_path = argv[++i];
+        } else if (!arg.empty() && arg[0] != '-') {
+            options.inputs.push_back(argv[i]);
+        } else {
+            valid = false;
+        }
+    }
+
+    if (!valid || options.inputs.empty()) {
+        std::cerr << "Usage: " << argv[0] << " bench-threads [--max-threads <n>] [--runs <n>] [--csv <path>] <file_path>...\n";
+        return 1;
+    }
+    if (options.max_threads == 0) options.max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    try {
+        ImageFile::BenchThreads(options);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    Isa::Selected();
+
+    if (argc > 1 && std::string_view(argv[1]) == "extract") return RunExtract(argc, argv);
+    if (argc > 1 && std::string_view(argv[1]) == "unpack") return RunUnpack(argc, argv);
+    if (argc > 1 && std::string_view(argv[1]) == "triage") return RunTriage(argc, argv);
+    if (argc > 1 && std::string_view(argv[1]) == "bench-io") return RunBenchIO(argc, argv);
+    if (argc > 1 && std::string_view(argv[1]) == "bench-threads") return RunBenchThreads(argc, argv);
+
+    return RunProcess(argc, argv);
+}
+
+// Quote a CSV field only when it contains a separator, quote or line break.
+
+static void WriteCsvField(std::ostream& out, std::string_view field) {
+    if (field.find_first_of(",\"\n") == std::string_view::npos) {
+        out << field;
+        return;
+    }
+    out << '"';
+    for (char ch : field) {
+        if (ch == '"') out << '"';
+        out << ch;
+    }
+    out << '"';
+}
+
+static std::vector<std::string> SplitCsvLine(const std::string& line) {
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+
+    for (std::size_t i = 0; i < line.size(); ++i) {
+        char ch = line[i];
+        if (quoted) {
+            if (ch == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                fields.back().push_back('"');
+                ++i;
+            } else if (ch == '"') {
+                quoted = false;
+            } else {
+                fields.back().push_back(ch);
+            }
+        } else if (ch == '"') {
+            quoted = true;
+        } else if (ch == ',') {
+            fields.emplace_back();
+        } else if (ch != '\r') {
+            fields.back().push_back(ch);
+        }
+    }
+    return fields;
+}
+
+// Lowercase hex of size bytes into out, which must hold 2 * size characters.
+
+static void HexDigits(const unsigned char* data, std::size_t size, char* out) {
+    static constexpr char Digits[] = "0123456789abcdef";
+    for (std::size_t i = 0; i < size; ++i) {
+        out[2 * i] = Digits[data[i] >> 4];
+        out[2 * i + 1] = Digits[data[i] & 0xF];
+    }
+}
+
+static std::string HexString(const unsigned char* data, std::size_t size) {
+    std::string hex(2 * size, '0');
+    HexDigits(data, size, hex.data());
+    return hex;
+}
+
+bool Manifest::Open(const fs::path& path, bool sources, bool entries, bool digests, bool known) {
+    with_sources = sources;
+    with_entries = entries;
+    with_digests = digests;
+    with_known = known;
+    if (path == "-") {
+        out = &std::cout;
+    } else {
+        file.open(path);
+        if (!file) {
+            std::cerr << "Failed to open manifest file.\n";
+            return false;
+        }
+        out = &file;
+    }
+    *out << "index,offset,type,width,height,payload_hash,blank,output" << (with_digests ? ",payload_sha256,output_sha256" : "") << (with_known ? ",known" : "")
+         << (with_entries ? ",entry" : "") << (with_sources ? ",source\n" : "\n");
+    return true;
+}
+
+void Manifest::Add(const HitRecord& hit) {
+    if (!out) return;
+    *out << hit.index << ',' << hit.offset << ',' << hit.type << ','
+         << hit.width << ',' << hit.height << ',';
+    if (hit.payload_read) {
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(hit.payload_hash));
+        *out << hash;
+    }
+    *out << ',';
+    if (hit.payload_read) *out << (hit.blank ? '1' : '0');
+    *out << ',';
+    WriteCsvField(*out, hit.output);
+    if (with_digests) {
+        char digests[130];
+        if (hit.digested) {
+            digests[0] = ',';
+            HexDigits(hit.payload_sha256.data(), hit.payload_sha256.size(), digests + 1);
+            digests[65] = ',';
+            HexDigits(hit.output_sha256.data(), hit.output_sha256.size(), digests + 66);
+            out->write(digests, sizeof(digests));
+        } else {
+            *out << ",,";
+        }
+    }
+    if (with_known) *out << ',' << hit.known;
+    if (with_entries) {
+        *out << ',';
+        WriteCsvField(*out, hit.entry);
+    }
+    if (with_sources) {
+        *out << ',';
+        WriteCsvField(*out, hit.source);
+    }
+    *out << '\n';
+}
+
+// Columns are located by name from the header line so manifests with extra
+// columns still load. Rows with an unknown header type are rejected, as are
+// manifests of archive scans, whose offsets point inside archive entries.
+
+std::vector<HitRecord> Manifest::Load(const fs::path& path, const fs::path& source) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Failed to open manifest file.");
+
+    std::string line;
+    if (!std::getline(file, line)) throw std::runtime_error("Manifest is empty.");
+
+    std::vector<std::string> columns = SplitCsvLine(line);
+    auto column = [&](std::string_view name) {
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i] == name) return i;
+        }
+        throw std::runtime_error("Manifest is missing the '" + std::string(name) + "' column.");
+    };
+    const std::size_t index_col = column("index");
+    const std::size_t offset_col = column("offset");
+    const std::size_t type_col = column("type");
+    const std::size_t width_col = column("width");
+    const std::size_t height_col = column("height");
+    const std::size_t hash_col = std::find(columns.begin(), columns.end(), "payload_hash") - columns.begin();
+    const std::size_t source_col = std::find(columns.begin(), columns.end(), "source") - columns.begin();
+    if (std::find(columns.begin(), columns.end(), "entry") != columns.end()) {
+        throw std::runtime_error("Manifest offsets are relative to archive entries and cannot be extracted; "
+                                 "unpack the member and extract from it, or rescan without --archive.");
+    }
+
+    std::string matched_source;
+    bool source_matches = false;
+    std::vector<HitRecord> hits;
+    while (std::getline(file, line)) {
+        if (line.empty()) continue;
+        std::vector<std::string> fields = SplitCsvLine(line);
+        if (fields.size() < columns.size()) throw std::runtime_error("Malformed manifest line: " + line);
+        if (source_col < columns.size() && !source.empty()) {
+            if (fields[source_col] != matched_source) {
+                std::error_code error;
+                matched_source = fields[source_col];
+                source_matches = matched_source == source.native() || fs::equivalent(matched_source, source, error);
+            }
+            if (!source_matches) continue;
+        }
+
+        HitRecord hit;
+        try {
+            hit.index = std::stoi(fields[index_col]);
+            hit.offset = std::stoull(fields[offset_col]);
+            hit.width = std::stoi(fields[width_col]);
+            hit.height = std::stoi(fields[height_col]);
+            if (hash_col < columns.size() && !fields[hash_col].empty()) {
+                hit.payload_hash = std::stoull(fields[hash_col], nullptr, 16);
+                hit.payload_read = true;
+            }
+        } catch (const std::exception&) {
+            throw std::runtime_error("Malformed manifest line: " + line);
+        }
+        if (hit.width < 1 || hit.width > ImageConfig::MaxWidth || hit.height < 1 || hit.height > ImageConfig::MaxHeight) {
+            throw std::runtime_error("Thumbnail size out of range in manifest line: " + line);
+        }
+        for (auto header : ImageConfig::Headers) {
+            if (fields[type_col] == header) hit.type = header;
+        }
+        if (hit.type.empty()) throw std::runtime_error("Unknown header type in manifest: " + fields[type_col]);
+        hits.push_back(std::move(hit));
+    }
+    return hits;
+}
+
+void HitIndexWriter::Add(const HitRecord& hit) {
+    HitIndexRecord record{};
+    record.offset = hit.offset;
+    record.payload_hash = hit.payload_hash;
+    record.index = static_cast<std::uint32_t>(hit.index);
+    record.width = static_cast<std::uint16_t>(hit.width);
+    record.height = static_cast<std::uint16_t>(hit.height);
+    for (std::size_t i = 0; i < ImageConfig::Headers.size(); ++i) {
+        if (ImageConfig::Headers[i] == hit.type) record.type = static_cast<std::uint8_t>(i);
+    }
+    if (hit.payload_read) record.flags |= HitIndexConfig::FlagHashed;
+    if (!hit.output.empty()) record.flags |= HitIndexConfig::FlagWritten;
+    if (hit.blank) record.flags |= HitIndexConfig::FlagBlank;
+    records.push_back(record);
+}
+
+// Records arrive in scan order, which is already sorted by offset for a single
+// pass; sort anyway so the invariant never depends on the caller.
+
+bool HitIndexWriter::Write(const fs::path& path) {
+    std::stable_sort(records.begin(), records.end(), [](const HitIndexRecord& a, const HitIndexRecord& b) {
+        return a.offset < b.offset;
+    });
+
+    std::vector<HitIndexHashEntry> hashes;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        if (records[i].flags & HitIndexConfig::FlagHashed) {
+            hashes.push_back({records[i].payload_hash, static_cast<std::uint32_t>(i), 0});
+        }
+    }
+    std::sort(hashes.begin(), hashes.end(), [](const HitIndexHashEntry& a, const HitIndexHashEntry& b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.record < b.record;
+    });
+
+    HitIndexHeader header{};
+    header.magic = HitIndexConfig::Magic;
+    header.version = HitIndexConfig::Version;
+    header.record_size = sizeof(HitIndexRecord);
+    header.record_count = records.size();
+    header.hash_count = hashes.size();
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open index file.\n";
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(HitIndexRecord));
+    file.write(reinterpret_cast<const char*>(hashes.data()), hashes.size() * sizeof(HitIndexHashEntry));
+    return static_cast<bool>(file);
+}
+
+HitIndex::~HitIndex() {
+    if (mapping) munmap(mapping, mapping_size);
+}
+
+bool HitIndex::Open(const fs::path& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(HitIndexHeader)) {
+        close(fd);
+        return false;
+    }
+    mapping_size = static_cast<std::size_t>(st.st_size);
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        return false;
+    }
+
+    const auto* header = static_cast<const HitIndexHeader*>(mapping);
+    const std::uint64_t expected = sizeof(HitIndexHeader)
+        + header->record_count * sizeof(HitIndexRecord)
+        + header->hash_count * sizeof(HitIndexHashEntry);
+    if (header->magic != HitIndexConfig::Magic || header->version != HitIndexConfig::Version
+        || header->record_size != sizeof(HitIndexRecord) || expected != mapping_size) {
+        return false;
+    }
+
+    records = reinterpret_cast<const HitIndexRecord*>(header + 1);
+    record_count = header->record_count;
+    hashes = reinterpret_cast<const HitIndexHashEntry*>(records + record_count);
+    hash_count = header->hash_count;
+    return true;
+}
+
+const HitIndexRecord* HitIndex::FindOffset(std::uint64_t offset) const {
+    const HitIndexRecord* found = std::lower_bound(begin(), end(), offset, [](const HitIndexRecord& record, std::uint64_t value) {
+        return record.offset < value;
+    });
+    return (found != end() && found->offset == offset) ? found : nullptr;
+}
+
+bool HitIndex::ContainsHash(std::uint64_t hash) const {
+    const HitIndexHashEntry* found = std::lower_bound(hashes, hashes + hash_count, hash, [](const HitIndexHashEntry& entry, std::uint64_t value) {
+        return entry.hash < value;
+    });
+    return found != hashes + hash_count && found->hash == hash;
+}
+
+// Returns true if the hash was not in the set yet. Growth runs in its own
+// stage, so the allocation accounting can tell the amortized doublings apart
+// from the inserts.
+
+bool PayloadSet::Insert(std::uint64_t hash) {
+    if (hash == 0) return !std::exchange(has_zero, true);
+    if (2 * (size + 1) > slots.size()) Grow();
+    const std::size_t mask = slots.size() - 1;
+    for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i] == hash) return false;
+        if (slots[i] == 0) {
+            slots[i] = hash;
+            ++size;
+            return true;
+        }
+    }
+}
+
+void PayloadSet::Grow() {
+    TraceSpan span("dedup growth");
+    std::vector<std::uint64_t> old = std::exchange(slots, std::vector<std::uint64_t>(std::max(DedupConfig::InitialSlots, 2 * slots.size())));
+    const std::size_t mask = slots.size() - 1;
+    for (std::uint64_t hash : old) {
+        if (hash == 0) continue;
+        std::size_t i = hash & mask;
+        while (slots[i] != 0) i = (i + 1) & mask;
+        slots[i] = hash;
+    }
+}
+
+// Keys are mixed with the murmur3 finalizer, so distinct keys get distinct
+// hashes for any seed. h0 falls anywhere in the first segment_count segments;
+// h1 and h2 lie in the two segments after it.
+
+static std::uint64_t FuseMix(std::uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static std::uint8_t FuseFingerprint(std::uint64_t hash) {
+    return static_cast<std::uint8_t>(hash ^ (hash >> 32));
+}
+
+std::array<std::uint32_t, 3> FuseFilter::Positions(std::uint64_t hash) const {
+    const std::uint32_t h0 = static_cast<std::uint32_t>((static_cast<unsigned __int128>(hash) * segment_count_length) >> 64);
+    const std::uint32_t h1 = (h0 + segment_length) ^ (static_cast<std::uint32_t>(hash >> 18) & segment_mask);
+    const std::uint32_t h2 = (h0 + 2 * segment_length) ^ (static_cast<std::uint32_t>(hash) & segment_mask);
+    return {h0, h1, h2};
+}
+
+bool FuseFilter::Contains(std::uint64_t key) const {
+    if (fingerprints.empty()) return false;
+    const std::uint64_t hash = FuseMix(key + seed);
+    const std::array<std::uint32_t, 3> h = Positions(hash);
+    return FuseFingerprint(hash) == (fingerprints[h[0]] ^ fingerprints[h[1]] ^ fingerprints[h[2]]);
+}
+
+// Construction peels the 3-hypergraph of keys and slots: a slot that only one
+// key maps to is assigned last for that key, which frees the key's other two
+// slots. Each slot's key count (times four), the xor of the key hashes and
+// the xor of which probe led there are tracked, so the lone key of a slot is
+// known without lists. When peeling gets stuck another seed is tried.
+// Fingerprints are then assigned in reverse peeling order.
+
+bool FuseFilter::Build(const std::vector<std::uint64_t>& keys) {
+    const std::size_t size = keys.size();
+    fingerprints.clear();
+    if (!size) return true;
+
+    const double log_size = std::log(static_cast<double>(size));
+    segment_length = size > 1 ? std::min(1u << static_cast<int>(std::floor(log_size / std::log(3.33) + 2.25)), 1u << 18) : 4;
+    const std::uint64_t capacity = size > 1 ? std::llround(size * std::max(1.125, 0.875 + 0.25 * std::log(1e6) / log_size)) : 0;
+    const std::uint64_t segments = (capacity + segment_length - 1) / segment_length;
+    const std::uint64_t segment_count = segments > 2 ? segments - 2 : 1;
+    const std::uint64_t array_length = (segment_count + 2) * segment_length;
+    if (array_length > std::numeric_limits<std::uint32_t>::max()) return false;
+    segment_count_length = static_cast<std::uint32_t>(segment_count * segment_length);
+    segment_mask = segment_length - 1;
+
+    std::vector<std::uint8_t> counts(array_length);
+    std::vector<std::uint64_t> xors(array_length);
+    std::vector<std::uint32_t> alone(array_length);
+    std::vector<std::uint64_t> stack(size);
+    std::vector<std::uint8_t> stack_probe(size);
+    std::uint64_t state = 0x726B2B9D438B9D4DULL;
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        state += 0x9E3779B97F4A7C15ULL;
+        seed = FuseMix(state);
+        std::fill(counts.begin(), counts.end(), 0);
+        std::fill(xors.begin(), xors.end(), 0);
+
+        bool overflow = false;
+        for (std::uint64_t key : keys) {
+            const std::uint64_t hash = FuseMix(key + seed);
+            const std::array<std::uint32_t, 3> h = Positions(hash);
+            for (std::uint8_t probe = 0; probe < 3; ++probe) {
+                counts[h[probe]] = static_cast<std::uint8_t>((counts[h[probe]] + 4) ^ probe);
+                xors[h[probe]] ^= hash;
+                overflow |= counts[h[probe]] < 4;
+            }
+        }
+        if (overflow) continue;
+
+        std::size_t queued = 0;
+        for (std::uint32_t i = 0; i < array_length; ++i) {
+            if ((counts[i] >> 2) == 1) alone[queued++] = i;
+        }
+        std::size_t stacked = 0;
+        while (queued) {
+            const std::uint32_t slot = alone[--queued];
+            if ((counts[slot] >> 2) != 1) continue;
+            const std::uint64_t hash = xors[slot];
+            const std::uint8_t found = counts[slot] & 3;
+            stack[stacked] = hash;
+            stack_probe[stacked] = found;
+            ++stacked;
+            const std::array<std::uint32_t, 3> h = Positions(hash);
+            for (std::uint8_t probe = 0; probe < 3; ++probe) {
+                const std::uint32_t other = h[probe];
+                if ((counts[other] >> 2) == 2 && probe != found) alone[queued++] = other;
+                counts[other] = static_cast<std::uint8_t>((counts[other] - 4) ^ probe);
+                xors[other] ^= hash;
+            }
+        }
+        if (stacked != size) continue;
+
+        fingerprints.assign(array_length, 0);
+        for (std::size_t i = stacked; i-- > 0;) {
+            const std::array<std::uint32_t, 3> h = Positions(stack[i]);
+            const std::uint8_t found = stack_probe[i];
+            fingerprints[h[found]] = FuseFingerprint(stack[i]) ^ fingerprints[h[(found + 1) % 3]] ^ fingerprints[h[(found + 2) % 3]];
+        }
+        return true;
+    }
+    return false;
+}
+
+// The first eight digest bytes as a big-endian number.
+
+static std::uint64_t DigestPrefix(const unsigned char* digest) {
+    std::uint64_t prefix = 0;
+    for (int i = 0; i < 8; ++i) prefix = prefix << 8 | digest[i];
+    return prefix;
+}
+
+bool KnownHashes::Load(const fs::path& path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open hash list " << path << ".\n";
+        return false;
+    }
+
+    auto nibble = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.size() < 64 || (line.size() > 64 && std::isxdigit(static_cast<unsigned char>(line[64])))) continue;
+        std::array<unsigned char, 32> digest;
+        bool valid = true;
+        for (std::size_t i = 0; i < digest.size() && valid; ++i) {
+            const int high = nibble(line[2 * i]);
+            const int low = nibble(line[2 * i + 1]);
+            valid = high >= 0 && low >= 0;
+            digest[i] = static_cast<unsigned char>(high << 4 | low);
+        }
+        if (valid) digests.push_back(digest);
+    }
+    if (digests.empty()) {
+        std::cerr << "No SHA-256 digests in hash list " << path << ".\n";
+        return false;
+    }
+    std::sort(digests.begin(), digests.end());
+    digests.erase(std::unique(digests.begin(), digests.end()), digests.end());
+
+// Sorted digests give sorted prefixes, so equal keys are adjacent.
+    std::vector<std::uint64_t> keys;
+    keys.reserve(digests.size());
+    for (const auto& digest : digests) {
+        const std::uint64_t key = DigestPrefix(digest.data());
+        if (keys.empty() || keys.back() != key) keys.push_back(key);
+    }
+    if (!filter.Build(keys)) {
+        std::cerr << "Failed to build the filter for hash list " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+bool KnownHashes::Contains(const unsigned char* sha256) const {
+    if (!filter.Contains(DigestPrefix(sha256))) return false;
+    std::array<unsigned char, 32> digest;
+    std::memcpy(digest.data(), sha256, digest.size());
+    return std::binary_search(digests.begin(), digests.end(), digest);
+}
+
+// 64-bit payload fingerprint used for deduplication (XXH64, seed 0).
+
+static std::uint64_t HashPayload(const unsigned char* data, std::size_t size) {
+    constexpr std::uint64_t P1 = 11400714785074694791ULL;
+    constexpr std::uint64_t P2 = 14029467366897019727ULL;
+    constexpr std::uint64_t P3 = 1609587929392839161ULL;
+    constexpr std::uint64_t P4 = 9650029242287828579ULL;
+    constexpr std::uint64_t P5 = 2870177450012600261ULL;
+
+    auto rotl = [](std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const unsigned char* p) { std::uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const unsigned char* p) { std::uint32_t v; std::memcpy(&v, p, 4); return v; };
+    auto round = [&](std::uint64_t acc, std::uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto merge = [&](std::uint64_t acc, std::uint64_t value) { return (acc ^ round(0, value)) * P1 + P4; };
+
+    const unsigned char* p = data;
+    const unsigned char* const end = data + size;
+    std::uint64_t h;
+
+    if (size >= 32) {
+        std::uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = P5;
+    }
+
+    h += size;
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+void Digest::Update(const unsigned char* data, std::size_t size) {
+    length += size;
+    if (pending_size) {
+        const std::size_t take = std::min(size, pending.size() - pending_size);
+        std::memcpy(pending.data() + pending_size, data, take);
+        pending_size += take;
+        data += take;
+        size -= take;
+        if (pending_size < pending.size()) return;
+        Blocks(pending.data(), 1);
+        pending_size = 0;
+    }
+    Blocks(data, size / 64);
+    pending_size = size % 64;
+    std::memcpy(pending.data(), data + size - pending_size, pending_size);
+}
+
+// Both pad with a one bit, zeros and the message length in bits, MD5 in
+// little-endian and SHA-256 in big-endian order.
+
+void Digest::Final(unsigned char* out) {
+    const std::uint64_t bits = length * 8;
+    unsigned char padding[72] = {0x80};
+    const std::size_t zeros = (pending_size < 56 ? 56 : 120) - pending_size;
+    for (int i = 0; i < 8; ++i) padding[zeros + i] = static_cast<unsigned char>(bits >> (BigEndian() ? 56 - 8 * i : 8 * i));
+    Update(padding, zeros + 8);
+    Store(out);
+}
+
+std::string Digest::Hex() {
+    unsigned char digest[32];
+    Final(digest);
+    return HexString(digest, Size());
+}
+
+void Md5Digest::Blocks(const unsigned char* data, std::size_t blocks) {
+    static constexpr std::uint32_t Sines[64] = {
+        0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+        0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+        0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+        0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+        0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+        0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+        0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+        0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391,
+    };
+    static constexpr int Shifts[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+
+    for (; blocks > 0; --blocks, data += 64) {
+        std::uint32_t m[16];
+        for (int i = 0; i < 16; ++i) {
+            const unsigned char* word = data + 4 * i;
+            m[i] = word[0] | (word[1] << 8) | (word[2] << 16) | (static_cast<std::uint32_t>(word[3]) << 24);
+        }
+        std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; ++i) {
+            const int round = i / 16;
+            std::uint32_t f;
+            int g;
+            switch (round) {
+            case 0:
+                f = (b & c) | (~b & d);
+                g = i;
+                break;
+            case 1:
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+                break;
+            case 2:
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+                break;
+            default:
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+                break;
+            }
+            const std::uint32_t sum = a + f + Sines[i] + m[g];
+            const int shift = Shifts[round][i % 4];
+            a = d;
+            d = c;
+            c = b;
+            b += (sum << shift) | (sum >> (32 - shift));
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+}
+
+void Md5Digest::Store(unsigned char* out) const {
+    for (int i = 0; i < 16; ++i) out[i] = static_cast<unsigned char>(state[i / 4] >> (8 * (i % 4)));
+}
+
+void Sha256Digest::Blocks(const unsigned char* data, std::size_t blocks) {
+    if (blocks) Isa::Selected().sha256_blocks(state.data(), data, blocks);
+}
+
+void Sha256Digest::Compute(const unsigned char* data, std::size_t size, unsigned char* out) {
+    Sha256Digest digest;
+    digest.Update(data, size);
+    digest.Final(out);
+}
+
+void Sha256Digest::Store(unsigned char* out) const {
+    for (int i = 0; i < 32; ++i) out[i] = static_cast<unsigned char>(state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+void Allocations::Count(std::size_t size) {
+    const char* name = stage ? stage : "other";
+    for (AllocCounter& counter : stages) {
+        const char* owner = counter.name.load(std::memory_order_acquire);
+        if (!owner && counter.name.compare_exchange_strong(owner, name, std::memory_order_acq_rel)) owner = name;
+        if (owner == name || std::strcmp(owner, name) == 0) {
+            counter.count.fetch_add(1, std::memory_order_relaxed);
+            counter.bytes.fetch_add(size, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+const char* Allocations::SetStage(const char* name) {
+    const char* previous = stage;
+    stage = name;
+    return previous;
+}
+
+std::uint64_t Allocations::HotPathCount() {
+    std::uint64_t total = 0;
+    for (const AllocCounter& counter : stages) {
+        const char* name = counter.name.load(std::memory_order_acquire);
+        if (!name) break;
+        if (std::find(AllocConfig::Bookkeeping.begin(), AllocConfig::Bookkeeping.end(), name) == AllocConfig::Bookkeeping.end()) {
+            total += counter.count.load(std::memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+void Allocations::MarkWarm() {
+    warm_count = HotPathCount();
+}
+
+void Allocations::MarkEnd(std::uint64_t hits) {
+    marked_end = true;
+    steady_hits = hits > AllocConfig::WarmupHits ? hits - AllocConfig::WarmupHits : 0;
+    steady_allocations = steady_hits ? HotPathCount() - warm_count : 0;
+}
+
+// The steady-state line needs a run that marked its warm-up and end. Async
+// runs do not: hits from many inputs interleave and every input starts a new
+// coroutine frame, so there is no single hot path to measure.
+
+void Allocations::Print(std::ostream& out) {
+    out << "allocations by stage:\n";
+    for (const AllocCounter& counter : stages) {
+        const char* name = counter.name.load(std::memory_order_acquire);
+        if (!name) break;
+        out << "  " << name << ": " << counter.count.load(std::memory_order_relaxed) << " ("
+            << counter.bytes.load(std::memory_order_relaxed) << " bytes)\n";
+    }
+    if (!marked_end) return;
+    out << "steady state: " << steady_allocations << " allocations in " << steady_hits << " hits after "
+        << AllocConfig::WarmupHits << " warm-up hits\n";
+}
+
+// Replacements for the global allocation functions. The array and nothrow
+// forms forward to these. The matching operator delete forms are replaced too
+// and hand the memory back with free(), so they never depend on what the
+// library's own operator delete does. They are kept out of line: once inlined
+// next to a call to operator new, GCC takes the free() for a mismatched
+// deallocation and warns.
+
+void* operator new(std::size_t size) {
+    if (Allocations::Enabled()) Allocations::Count(size);
+    if (size == 0) size = 1;
+    while (true) {
+        if (void* memory = std::malloc(size)) return memory;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (Allocations::Enabled()) Allocations::Count(size);
+    const std::size_t align = static_cast<std::size_t>(alignment);
+    size = (std::max<std::size_t>(size, 1) + align - 1) / align * align;
+    while (true) {
+        if (void* memory = std::aligned_alloc(align, size)) return memory;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+__attribute__((noinline))
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+__attribute__((noinline))
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+__attribute__((noinline))
+void operator delete(void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+__attribute__((noinline))
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+void Trace::Enable() {
+    origin = std::chrono::steady_clock::now();
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+std::int64_t Trace::Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+Trace::ThreadBuffer& Trace::Local() {
+    thread_local ThreadBuffer* local = nullptr;
+    if (!local) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(std::make_unique<ThreadBuffer>());
+        local = registry.back().get();
+        local->tid = static_cast<int>(registry.size());
+        local->events.reserve(1 << 14);
+    }
+    return *local;
+}
+
+void Trace::Record(const char* name, std::int64_t start, std::int64_t end) {
+    const char* previous = Allocations::SetStage("trace");
+    Local().events.push_back({name, start, end});
+    Allocations::SetStage(previous);
+}
+
+void Trace::SetThreadName(std::string_view name) {
+    if (Enabled()) Local().name = name;
+}
+
+// Like Write(), these must only be called while no traced thread is running.
+
+std::map<std::string, double> Trace::Totals() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::map<std::string, double> totals;
+    for (const auto& buffer : registry) {
+        for (const TraceEvent& event : buffer->events) totals[event.name] += (event.end - event.start) / 1e9;
+    }
+    return totals;
+}
+
+void Trace::Clear() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (const auto& buffer : registry) buffer->events.clear();
+}
+
+// Complete ("X") events with microsecond timestamps, one track per thread.
+// Must only be called once every traced thread has finished.
+
+bool Trace::Write(const fs::path& path) {
+    std::ofstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open trace file.\n";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    const char* separator = "";
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    file << std::fixed << std::setprecision(3);
+    for (const auto& buffer : registry) {
+        if (!buffer->name.empty()) {
+            file << separator << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                 << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+            separator = ",";
+        }
+        for (const TraceEvent& event : buffer->events) {
+            file << separator << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                 << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << (event.end - event.start) / 1000.0 << "}";
+            separator = ",";
+        }
+    }
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+}
+
+void Histogram::Observe(double seconds) {
+    const std::size_t bucket = std::lower_bound(Bounds.begin(), Bounds.end(), seconds) - Bounds.begin();
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(static_cast<std::uint64_t>(seconds * 1e9), std::memory_order_relaxed);
+}
+
+void Histogram::Render(std::ostream& out, std::string_view name) const {
+    std::uint64_t cumulative = 0;
+    out << "# TYPE " << name << " histogram\n"
+        << "# UNIT " << name << " seconds\n";
+    for (std::size_t i = 0; i <= Bounds.size(); ++i) {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        out << name << "_bucket{le=\"";
+        if (i < Bounds.size()) {
+            out << Bounds[i];
+        } else {
+            out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum " << sum_ns.load(std::memory_order_relaxed) / 1e9 << "\n"
+        << name << "_count " << cumulative << "\n";
+}
+
+std::string Metrics::Render() {
+    std::ostringstream out;
+    auto counter = [&](std::string_view name, std::string_view help) {
+        out << "# TYPE " << name << " counter\n# HELP " << name << " " << help << "\n";
+    };
+
+    counter("rtti_bytes_scanned", "Input bytes read by the scanner.");
+    out << "rtti_bytes_scanned_total " << bytes_scanned.load(std::memory_order_relaxed) << "\n";
+    counter("rtti_bytes_skipped", "Input bytes not searched for headers.");
+    out << "rtti_bytes_skipped_total{reason=\"entropy\"} " << bytes_skipped_entropy.load(std::memory_order_relaxed) << "\n"
+        << "rtti_bytes_skipped_total{reason=\"payload\"} " << bytes_skipped_payload.load(std::memory_order_relaxed) << "\n";
+    counter("rtti_hits", "Headers with valid dimensions.");
+    for (std::size_t i = 0; i < ImageConfig::Headers.size(); ++i) {
+        out << "rtti_hits_total{type=\"" << ImageConfig::Headers[i] << "\"} " << hits[i].load(std::memory_order_relaxed) << "\n";
+    }
+    counter("rtti_rejections", "Headers or hits dropped before output.");
+    for (std::size_t i = 0; i < RejectionCount; ++i) {
+        out << "rtti_rejections_total{reason=\"" << RejectionNames[i] << "\"} " << rejections[i].load(std::memory_order_relaxed) << "\n";
+    }
+    counter("rtti_outputs", "Output files written.");
+    out << "rtti_outputs_total " << outputs_written.load(std::memory_order_relaxed) << "\n";
+    counter("rtti_output_bytes", "Bytes written to output files.");
+    out << "rtti_output_bytes_total " << output_bytes.load(std::memory_order_relaxed) << "\n";
+    counter("rtti_alerts", "Payloads found on the --alert-hashes list.");
+    out << "rtti_alerts_total " << alerts.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE rtti_encode_queue_depth gauge\n# HELP rtti_encode_queue_depth Hits waiting for an encode thread.\n"
+        << "rtti_encode_queue_depth " << encode_queue_depth.load(std::memory_order_relaxed) << "\n";
+    encode_seconds.Render(out, "rtti_encode_seconds");
+    write_seconds.Render(out, "rtti_write_seconds");
+    out << "# EOF\n";
+    return out.str();
+}
+
+MetricsExporter::MetricsExporter(const fs::path& file_path, double interval, int port)
+    : file_path(file_path), interval(interval) {
+    if (port > 0) {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<std::uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        const int reuse = 1;
+        if (listen_fd >= 0) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(listen_fd, 8) != 0) {
+            std::cerr << "Failed to listen for metrics on port " << port << ".\n";
+            if (listen_fd >= 0) close(listen_fd);
+            listen_fd = -1;
+        } else {
+            server = std::thread([this] {
+                Allocations::SetStage("metrics");
+                Serve();
+            });
+        }
+    }
+    if (!file_path.empty()) writer = std::thread([this] {
+        Allocations::SetStage("metrics");
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (!stopping) {
+            lock.unlock();
+            WriteFile();
+            lock.lock();
+            wake.wait_for(lock, std::chrono::duration<double>(this->interval), [this] { return stopping; });
+        }
+    });
+}
+
+MetricsExporter::~MetricsExporter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (writer.joinable()) writer.join();
+    if (server.joinable()) server.join();
+    if (listen_fd >= 0) close(listen_fd);
+    if (!file_path.empty()) WriteFile();
+}
+
+void MetricsExporter::WriteFile() {
+    fs::path temporary = file_path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary);
+        if (!file) return;
+        file << Metrics::Render();
+    }
+    std::error_code ec;
+    fs::rename(temporary, file_path, ec);
+}
+
+// Minimal HTTP/1.0 responder: every request for /metrics gets the current
+// exposition, anything else a 404. The accept loop polls so shutdown is prompt.
+
+void MetricsExporter::Serve() {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+        }
+        pollfd waiting{listen_fd, POLLIN, 0};
+        if (poll(&waiting, 1, 200) <= 0) continue;
+
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+
+        char request[1024];
+        pollfd readable{client, POLLIN, 0};
+        ssize_t got = (poll(&readable, 1, 1000) > 0) ? recv(client, request, sizeof(request) - 1, 0) : 0;
+        const std::string_view line(request, got > 0 ? static_cast<std::size_t>(got) : 0);
+
+        std::string response;
+        if (line.substr(0, 13) == "GET /metrics " || line.substr(0, 13) == "GET /metrics?") {
+            const std::string body = Metrics::Render();
+            response = "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                       "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        } else {
+            response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        }
+        for (std::size_t sent = 0; sent < response.size();) {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += static_cast<std::size_t>(n);
+        }
+        close(client);
+    }
+}
+
+// Baseline kernels. memchr finds candidates for the first header byte and
+// memcmp confirms them.
+
+static const unsigned char* FindHeaderBaseline(const unsigned char* begin, const unsigned char* end) {
+    const std::string_view header = ImageConfig::Headers[0];
+    const unsigned char* cursor = begin;
+
+    while (end - cursor >= static_cast<std::ptrdiff_t>(header.size())) {
+        const void* first = std::memchr(cursor, header[0], end - cursor - header.size() + 1);
+        if (!first) return nullptr;
+        cursor = static_cast<const unsigned char*>(first);
+        if (std::memcmp(cursor, header.data(), header.size()) == 0) return cursor;
+        ++cursor;
+    }
+    return nullptr;
+}
+
+// Byte masks selecting one channel out of interleaved RGB, for a chunk of
+// three vector registers (the smallest span after which channels line up
+// with the same byte lanes again).
+
+template <std::size_t Chunk>
+static constexpr std::array<std::array<unsigned char, Chunk>, 3> ChannelMasks() {
+    std::array<std::array<unsigned char, Chunk>, 3> masks{};
+    for (std::size_t k = 0; k < Chunk; ++k) masks[k % 3][k] = 0xFF;
+    return masks;
+}
+
+template <std::size_t Chunk>
+static std::array<unsigned char, Chunk> MeanPattern(const unsigned char* mean) {
+    std::array<unsigned char, Chunk> pattern;
+    for (std::size_t k = 0; k < Chunk; ++k) pattern[k] = mean[k % 3];
+    return pattern;
+}
+
+// The channel masks are applied before summing each register with SAD
+// against zero, so every 64-bit lane sum only holds one channel.
+
+static void ChannelSumsBaseline(const unsigned char* data, std::size_t size, std::uint64_t* sums) {
+    constexpr std::size_t Chunk = 48;
+    const std::size_t vector_end = size - size % Chunk;
+#if defined(__SSE2__)
+    static constexpr auto masks = ChannelMasks<Chunk>();
+    const __m128i zero = _mm_setzero_si128();
+    __m128i totals[3] = {zero, zero, zero};
+    for (std::size_t i = 0; i < vector_end; i += Chunk) {
+        for (int v = 0; v < 3; ++v) {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + v * 16));
+            for (int c = 0; c < 3; ++c) {
+                const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[c].data() + v * 16));
+                totals[c] = _mm_add_epi64(totals[c], _mm_sad_epu8(_mm_and_si128(bytes, mask), zero));
+            }
+        }
+    }
+    for (int c = 0; c < 3; ++c) {
+        alignas(16) std::uint64_t lanes[2];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), totals[c]);
+        sums[c] += lanes[0] + lanes[1];
+    }
+#else
+    for (std::size_t i = 0; i < vector_end; ++i) sums[i % 3] += data[i];
+#endif
+    for (std::size_t i = vector_end; i < size; ++i) sums[i % 3] += data[i];
+}
+
+static std::uint64_t DeviationBaseline(const unsigned char* data, std::size_t size, const unsigned char* mean) {
+    constexpr std::size_t Chunk = 48;
+    const std::size_t vector_end = size - size % Chunk;
+    std::uint64_t deviation = 0;
+#if defined(__SSE2__)
+    const auto pattern = MeanPattern<Chunk>(mean);
+    __m128i total = _mm_setzero_si128();
+    const __m128i means[3] = {
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern.data())),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern.data() + 16)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern.data() + 32)),
+    };
+    for (std::size_t i = 0; i < vector_end; i += Chunk) {
+        for (int v = 0; v < 3; ++v) {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + v * 16));
+            total = _mm_add_epi64(total, _mm_sad_epu8(bytes, means[v]));
+        }
+    }
+    alignas(16) std::uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), total);
+    deviation = lanes[0] + lanes[1];
+#else
+    for (std::size_t i = 0; i < vector_end; ++i) deviation += std::abs(data[i] - mean[i % 3]);
+#endif
+    for (std::size_t i = vector_end; i < size; ++i) deviation += std::abs(data[i] - mean[i % 3]);
+    return deviation;
+}
+
+static void SwapRedBlueBaseline(unsigned char* out, const unsigned char* row, std::size_t size) {
+    for (std::size_t j = 0; j + 3 <= size; j += 3) {
+        out[j] = row[j + 2];
+        out[j + 1] = row[j + 1];
+        out[j + 2] = row[j];
+    }
+}
+
+alignas(16) static constexpr std::uint32_t Sha256Constants[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static void Sha256BlocksScalar(std::uint32_t* state, const unsigned char* data, std::size_t blocks) {
+    auto rotr = [](std::uint32_t x, int r) { return (x >> r) | (x << (32 - r)); };
+    for (; blocks > 0; --blocks, data += 64) {
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (static_cast<std::uint32_t>(data[4 * i]) << 24) | (data[4 * i + 1] << 16) | (data[4 * i + 2] << 8) | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            const std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + Sha256Constants[i] + w[i];
+            const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef RTTI_HAVE_ISA_DISPATCH
+
+// SHA-256 with the SHA extensions. The state is kept as ABEF and CDGH halves,
+// the layout sha256rnds2 works on; each step runs four rounds and extends the
+// message schedule four words ahead with sha256msg1/sha256msg2.
+
+__attribute__((target("sha,sse4.1")))
+static void Sha256BlocksShaNi(std::uint32_t* state, const unsigned char* data, std::size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, cdab, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+        const __m128i abef_saved = abef;
+        const __m128i cdgh_saved = cdgh;
+        __m128i words[4];
+        for (int step = 0; step < 16; ++step) {
+            __m128i& current = words[step % 4];
+            if (step < 4) current = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * step)), byte_swap);
+            __m128i message = _mm_add_epi32(current, _mm_load_si128(reinterpret_cast<const __m128i*>(Sha256Constants + 4 * step)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            if (step >= 3 && step < 15) {
+                __m128i& next = words[(step + 1) % 4];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(current, words[(step + 3) % 4], 4));
+                next = _mm_sha256msg2_epu32(next, current);
+            }
+            message = _mm_shuffle_epi32(message, 0x0E);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, message);
+            if (step >= 1 && step < 13) {
+                __m128i& previous = words[(step + 3) % 4];
+                previous = _mm_sha256msg1_epu32(previous, current);
+            }
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+// AVX2 and AVX-512 kernels. The header search compares the first and the last
+// header byte at every position of a register, so only positions matching
+// both (about one in 65536 on random data instead of one in 256) need a
+// memcmp; what is left of the range goes to the baseline.
+
+__attribute__((target("avx2")))
+static const unsigned char* FindHeaderAvx2(const unsigned char* begin, const unsigned char* end) {
+    const std::string_view header = ImageConfig::Headers[0];
+    const std::size_t last = header.size() - 1;
+    const __m256i first_byte = _mm256_set1_epi8(header.front());
+    const __m256i last_byte = _mm256_set1_epi8(header.back());
+    const unsigned char* cursor = begin;
+    for (; end - cursor >= static_cast<std::ptrdiff_t>(32 + last); cursor += 32) {
+        const __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cursor));
+        const __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cursor + last));
+        std::uint32_t mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first_byte), _mm256_cmpeq_epi8(tail, last_byte))));
+        for (; mask; mask &= mask - 1) {
+            const unsigned char* candidate = cursor + __builtin_ctz(mask);
+            if (std::memcmp(candidate + 1, header.data() + 1, last - 1) == 0) return candidate;
+        }
+    }
+    return FindHeaderBaseline(cursor, end);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const unsigned char* FindHeaderAvx512(const unsigned char* begin, const unsigned char* end) {
+    const std::string_view header = ImageConfig::Headers[0];
+    const std::size_t last = header.size() - 1;
+    const __m512i first_byte = _mm512_set1_epi8(header.front());
+    const __m512i last_byte = _mm512_set1_epi8(header.back());
+    const unsigned char* cursor = begin;
+    for (; end - cursor >= static_cast<std::ptrdiff_t>(64 + last); cursor += 64) {
+        __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(cursor), first_byte),
+                                                     _mm512_loadu_si512(cursor + last), last_byte);
+        for (; mask; mask &= mask - 1) {
+            const unsigned char* candidate = cursor + __builtin_ctzll(mask);
+            if (std::memcmp(candidate + 1, header.data() + 1, last - 1) == 0) return candidate;
+        }
+    }
+    return FindHeaderBaseline(cursor, end);
+}
+
+__attribute__((target("avx2")))
+static void ChannelSumsAvx2(const unsigned char* data, std::size_t size, std::uint64_t* sums) {
+    constexpr std::size_t Chunk = 96;
+    static constexpr auto masks = ChannelMasks<Chunk>();
+    const std::size_t vector_end = size - size % Chunk;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i totals[3] = {zero, zero, zero};
+    for (std::size_t i = 0; i < vector_end; i += Chunk) {
+        for (int v = 0; v < 3; ++v) {
+            const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + v * 32));
+            for (int c = 0; c < 3; ++c) {
+                const __m256i mask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(masks[c].data() + v * 32));
+                totals[c] = _mm256_add_epi64(totals[c], _mm256_sad_epu8(_mm256_and_si256(bytes, mask), zero));
+            }
+        }
+    }
+    for (int c = 0; c < 3; ++c) {
+        alignas(32) std::uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), totals[c]);
+        sums[c] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    for (std::size_t i = vector_end; i < size; ++i) sums[i % 3] += data[i];
+}
+
+__attribute__((target("avx2")))
+static std::uint64_t DeviationAvx2(const unsigned char* data, std::size_t size, const unsigned char* mean) {
+    constexpr std::size_t Chunk = 96;
+    const std::size_t vector_end = size - size % Chunk;
+    const auto pattern = MeanPattern<Chunk>(mean);
+    __m256i means[3];
+    for (int v = 0; v < 3; ++v) means[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern.data() + v * 32));
+    __m256i total = _mm256_setzero_si256();
+    for (std::size_t i = 0; i < vector_end; i += Chunk) {
+        for (int v = 0; v < 3; ++v) {
+            const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + v * 32));
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, means[v]));
+        }
+    }
+    alignas(32) std::uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), total);
+    std::uint64_t deviation = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (std::size_t i = vector_end; i < size; ++i) deviation += std::abs(data[i] - mean[i % 3]);
+    return deviation;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void ChannelSumsAvx512(const unsigned char* data, std::size_t size, std::uint64_t* sums) {
+    constexpr std::size_t Chunk = 192;
+    static constexpr auto masks = ChannelMasks<Chunk>();
+    const std::size_t vector_end = size - size % Chunk;
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i totals[3] = {zero, zero, zero};
+    for (std::size_t i = 0; i < vector_end; i += Chunk) {
+        for (int v = 0; v < 3; ++v) {
+            const __m512i bytes = _mm512_loadu_si512(data + i + v * 64);
+            for (int c = 0; c < 3; ++c) {
+                const __m512i mask = _mm512_loadu_si512(masks[c].data() + v * 64);
+                totals[c] = _mm512_add_epi64(totals[c], _mm512_sad_epu8(_mm512_and_si512(bytes, mask), zero));
+            }
+        }
+    }
+    for (int c = 0; c < 3; ++c) sums[c] += static_cast<std::uint64_t>(_mm512_reduce_add_epi64(totals[c]));
+    for (std::size_t i = vector_end; i < size; ++i) sums[i % 3] += data[i];
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static std::uint64_t DeviationAvx512(const unsigned char* data, std::size_t size, const unsigned char* mean) {
+    constexpr std::size_t Chunk = 192;
+    const std::size_t vector_end = size - size % Chunk;
+    const auto pattern = MeanPattern<Chunk>(mean);
+    __m512i means[3];
+    for (int v = 0; v < 3; ++v) means[v] = _mm512_loadu_si512(pattern.data() + v * 64);
+    __m512i total = _mm512_setzero_si512();
+    for (std::size_t i = 0; i < vector_end; i += Chunk) {
+        for (int v = 0; v < 3; ++v) {
+            total = _mm512_add_epi64(total, _mm512_sad_epu8(_mm512_loadu_si512(data + i + v * 64), means[v]));
+        }
+    }
+    std::uint64_t deviation = static_cast<std::uint64_t>(_mm512_reduce_add_epi64(total));
+    for (std::size_t i = vector_end; i < size; ++i) deviation += std::abs(data[i] - mean[i % 3]);
+    return deviation;
+}
+
+// The swizzles spread four pixels (12 bytes) into each 128-bit lane with a
+// dword permute, swap red and blue within the lanes with pshufb and pack the
+// lanes back together. The AVX2 version stores a whole register, the last 8
+// bytes of which are rewritten by the next step or the baseline tail.
+
+__attribute__((target("avx2")))
+static void SwapRedBlueAvx2(unsigned char* out, const unsigned char* row, std::size_t size) {
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    const __m256i swap = _mm256_setr_epi8(
+        2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1,
+        2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+    std::size_t j = 0;
+    for (; j + 32 <= size; j += 24) {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + j));
+        pixels = _mm256_permutevar8x32_epi32(pixels, spread);
+        pixels = _mm256_shuffle_epi8(pixels, swap);
+        pixels = _mm256_permutevar8x32_epi32(pixels, pack);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j), pixels);
+    }
+    SwapRedBlueBaseline(out + j, row + j, size - j);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void SwapRedBlueAvx512(unsigned char* out, const unsigned char* row, std::size_t size) {
+    const __m512i spread = _mm512_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5, 6, 7, 8, 8, 9, 10, 11, 11);
+    const __m512i pack = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 15, 15, 15, 15);
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1));
+    constexpr __mmask16 Pixels = 0x0FFF;
+    std::size_t j = 0;
+    for (; j + 48 <= size; j += 48) {
+        __m512i pixels = _mm512_maskz_loadu_epi32(Pixels, row + j);
+        pixels = _mm512_permutexvar_epi32(spread, pixels);
+        pixels = _mm512_shuffle_epi8(pixels, swap);
+        pixels = _mm512_permutexvar_epi32(pack, pixels);
+        _mm512_mask_storeu_epi32(out + j, Pixels, pixels);
+    }
+    SwapRedBlueBaseline(out + j, row + j, size - j);
+}
+
+#endif
+
+Kernels Isa::Select() {
+    IsaLevel cap = IsaLevel::Avx512;
+    if (const char* forced = std::getenv("RTTI_ISA")) {
+        const std::string_view name = forced;
+        if (name == "baseline") cap = IsaLevel::Baseline;
+        if (name == "avx2") cap = IsaLevel::Avx2;
+    }
+
+#if defined(__SSE2__)
+    Kernels kernels{IsaLevel::Baseline, "sse2", FindHeaderBaseline, ChannelSumsBaseline, DeviationBaseline, SwapRedBlueBaseline,
+                    "scalar", Sha256BlocksScalar};
+#else
+    Kernels kernels{IsaLevel::Baseline, "scalar", FindHeaderBaseline, ChannelSumsBaseline, DeviationBaseline, SwapRedBlueBaseline,
+                    "scalar", Sha256BlocksScalar};
+#endif
+
+// The SHA extensions come with CPUs of either vector level; the baseline cap
+// keeps the scalar rounds.
+#ifdef RTTI_HAVE_ISA_DISPATCH
+    __builtin_cpu_init();
+    if (cap >= IsaLevel::Avx512 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        kernels = {IsaLevel::Avx512, "avx512", FindHeaderAvx512, ChannelSumsAvx512, DeviationAvx512, SwapRedBlueAvx512,
+                   "scalar", Sha256BlocksScalar};
+    } else if (cap >= IsaLevel::Avx2 && __builtin_cpu_supports("avx2")) {
+        kernels = {IsaLevel::Avx2, "avx2", FindHeaderAvx2, ChannelSumsAvx2, DeviationAvx2, SwapRedBlueAvx2,
+                   "scalar", Sha256BlocksScalar};
+    }
+    if (cap > IsaLevel::Baseline && __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        kernels.sha256_name = "sha-ni";
+        kernels.sha256_blocks = Sha256BlocksShaNi;
+    } else {
+        kernels.sha256_name = "scalar";
+        kernels.sha256_blocks = Sha256BlocksScalar;
+    }
+#endif
+    return kernels;
+}
+
+const Kernels& Isa::Selected() {
+    static const Kernels kernels = Select();
+    return kernels;
+}
+
+const unsigned char* ImageFile::FindHeader(const unsigned char* begin, const unsigned char* end) {
+    return Isa::Selected().find_header(begin, end);
+}
+
+// Width and height are stored as consecutive little-endian 32-bit integers.
+
+std::pair<int, int> ImageFile::ReadDimensions(const unsigned char* bytes) {
+    int width, height;
+
+    for (int i = 0; i < 2; ++i) {
+        const unsigned char* field = bytes + i * 4;
+        int& dimension = (i == 0) ? width : height;
+        dimension = field[0] | (field[1] << 8) | (field[2] << 16) | (field[3] << 24);
+    }
+
+    return {width, height};
+}
+
+// Shannon entropy in bits per byte. Bytes are counted into four interleaved
+// histograms fed from 8-byte loads, which keeps consecutive increments of the
+// same counter from serializing on store-to-load forwarding.
+
+double ImageFile::ByteEntropy(const unsigned char* data, std::size_t size) {
+    if (size == 0) return 0;
+
+    std::uint32_t counts[4][256] = {};
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        ++counts[0][word & 0xFF];
+        ++counts[1][(word >> 8) & 0xFF];
+        ++counts[2][(word >> 16) & 0xFF];
+        ++counts[3][(word >> 24) & 0xFF];
+        ++counts[0][(word >> 32) & 0xFF];
+        ++counts[1][(word >> 40) & 0xFF];
+        ++counts[2][(word >> 48) & 0xFF];
+        ++counts[3][word >> 56];
+    }
+    for (; i < size; ++i) ++counts[0][data[i]];
+
+    double sum = 0;
+    for (int b = 0; b < 256; ++b) {
+        const double count = counts[0][b] + counts[1][b] + counts[2][b] + counts[3][b];
+        if (count > 0) sum += count * std::log2(count);
+    }
+    return std::log2(static_cast<double>(size)) - sum / size;
+}
+
+// Two vectorized passes over the interleaved RGB payload: one sums each
+// channel for the mean color, the other sums the absolute differences against
+// that color. Both are exact integer sums, so every kernel variant agrees.
+
+double ImageFile::MeanDeviation(const unsigned char* img_data, std::size_t size) {
+    if (size < 3) return 0;
+
+    const Kernels& kernels = Isa::Selected();
+    std::uint64_t channel_sum[3] = {0, 0, 0};
+    kernels.channel_sums(img_data, size, channel_sum);
+
+    const std::size_t pixels = size / 3;
+    unsigned char mean[3];
+    for (int c = 0; c < 3; ++c) mean[c] = static_cast<unsigned char>((channel_sum[c] + pixels / 2) / pixels);
+
+    return static_cast<double>(kernels.deviation(img_data, size, mean)) / size;
+}
+
+void ImageFile::EncodeBMP(
+    std::vector<unsigned char>& bmp,
+    const unsigned char* img_data,
+    int width,
+    int height
+)
+
+{
+    TraceSpan span("EncodeBMP");
+
+// Set up BMP file header and info header with appropriate values for a BMP image.
+// Adjust padding for each row based on width to ensure proper alignment.
+// Write the headers to the start of the output buffer.
+
+    unsigned char bmpFileHeader[14] = {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
+    unsigned char bmpInfoHeader[40] = {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
+    int paddingAmount = (4 - (width * 3) % 4) % 4;
+    int fileSize = 54 + (width * 3 + paddingAmount) * height;
+
+    bmpFileHeader[2] = fileSize;
+    bmpFileHeader[3] = fileSize >> 8;
+    bmpFileHeader[4] = fileSize >> 16;
+    bmpFileHeader[5] = fileSize >> 24;
+
+    bmpInfoHeader[4] = width;
+    bmpInfoHeader[5] = width >> 8;
+    bmpInfoHeader[6] = width >> 16;
+    bmpInfoHeader[7] = width >> 24;
+    bmpInfoHeader[8] = height;
+    bmpInfoHeader[9] = height >> 8;
+    bmpInfoHeader[10] = height >> 16;
+    bmpInfoHeader[11] = height >> 24;
+
+    bmp.resize(fileSize);
+    std::memcpy(bmp.data(), bmpFileHeader, sizeof(bmpFileHeader));
+    std::memcpy(bmp.data() + sizeof(bmpFileHeader), bmpInfoHeader, sizeof(bmpInfoHeader));
+
+// Rows are stored bottom-up. Copy each image row with red and blue swapped for
+// every pixel, followed by zero padding to align rows to 4-byte boundaries.
+
+    const auto swap_red_blue = Isa::Selected().swap_red_blue;
+    unsigned char* out = bmp.data() + 54;
+    for (int i = height - 1; i >= 0; --i) {
+        const unsigned char* row = img_data + static_cast<std::size_t>(i) * width * 3;
+        swap_red_blue(out, row, static_cast<std::size_t>(width) * 3);
+        out += width * 3;
+        for (int k = 0; k < paddingAmount; ++k) *out++ = 0;
+    }
+}
+
+// Encode into a per-thread buffer that is reused across calls and write the
+// whole file with a single call. Nothing here allocates once the buffer has
+// grown to the largest thumbnail, which an ofstream (with its own buffer per
+// file) would not allow.
+
+void ImageFile::SaveAsBMP(
+    const std::string& output_path,
+    const unsigned char* img_data,
+    int width,
+    int height,
+    unsigned char* payload_sha256,
+    unsigned char* output_sha256
+) 
+
+{
+    TraceSpan span("SaveAsBMP");
+    std::vector<unsigned char>& bmp = EncodeBuffer();
+
+    const auto encode_started = std::chrono::steady_clock::now();
+    EncodeBMP(bmp, img_data, width, height);
+    if (payload_sha256) {
+        TraceSpan digest_span("output digests");
+        Sha256Digest::Compute(img_data, static_cast<std::size_t>(width) * height * 3, payload_sha256);
+        Sha256Digest::Compute(bmp.data(), bmp.size(), output_sha256);
+    }
+    const auto write_started = std::chrono::steady_clock::now();
+    Metrics::encode_seconds.Observe(std::chrono::duration<double>(write_started - encode_started).count());
+
+    int fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open output file.\n";
+        return;
+}
+    for (std::size_t written = 0; written < bmp.size();) {
+        ssize_t n = write(fd, bmp.data() + written, bmp.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::cerr << "Failed to write output file.\n";
+            break;
+        }
+        written += static_cast<std::size_t>(n);
+    }
+    close(fd);
+
+    Metrics::write_seconds.Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - write_started).count());
+    Metrics::outputs_written.fetch_add(1, std::memory_order_relaxed);
+    Metrics::output_bytes.fetch_add(bmp.size(), std::memory_order_relaxed);
+}
+
+// The per-thread encode buffer, reserved on first use for the largest BMP so
+// it never grows afterwards.
+
+std::vector<unsigned char>& ImageFile::EncodeBuffer() {
+    thread_local std::vector<unsigned char> bmp;
+    if (bmp.capacity() == 0) bmp.reserve(54 + (ImageConfig::MaxWidth * 3 + 3) / 4 * 4 * static_cast<std::size_t>(ImageConfig::MaxHeight));
+    return bmp;
+}
+
+// Two job buffers per worker keep every worker busy while the scan thread
+// fills the next one. Workers reserve their encode buffer before taking work.
+
+EncodePool::EncodePool(int threads, bool numa, bool huge_pages, ThumbnailPack* pack) : pack(pack) {
+    const std::vector<NumaNode>& nodes = Numa::Nodes();
+    const std::size_t shard_count = numa ? std::min<std::size_t>(nodes.size(), threads) : 1;
+    for (std::size_t i = 0; i < shard_count; ++i) {
+        shards.push_back(std::make_unique<Shard>());
+        if (numa) shards.back()->node = static_cast<int>(i);
+    }
+
+    for (int i = 0; i < threads * 2; ++i) {
+        Shard& shard = *shards[i % shard_count];
+        shard.jobs.push_back(std::make_unique<EncodeJob>());
+        EncodeJob& job = *shard.jobs.back();
+        job.pixels = PageBuffer(ImageConfig::MaxPayloadSize, huge_pages);
+        job.output.reserve(256);
+        job.shard = i % shard_count;
+        if (shard.node >= 0) Numa::PreferNode(job.pixels.data(), job.pixels.size(), nodes[shard.node]);
+        shard.free_jobs.push_back(&job);
+    }
+    for (auto& shard : shards) shard->queue.resize(shard->jobs.size());
+    for (int i = 0; i < threads; ++i) workers.emplace_back(&EncodePool::Work, this, std::ref(*shards[i % shard_count]), i);
+}
+
+EncodePool::~EncodePool() {
+    for (auto& shard : shards) {
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->stopping = true;
+        }
+        shard->work_ready.notify_all();
+    }
+    for (std::thread& worker : workers) worker.join();
+}
+
+EncodeJob& EncodePool::Acquire() {
+    Shard& shard = *shards[next_shard];
+    next_shard = (next_shard + 1) % shards.size();
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    shard.job_free.wait(lock, [&shard] { return !shard.free_jobs.empty(); });
+    EncodeJob* job = shard.free_jobs.back();
+    shard.free_jobs.pop_back();
+    return *job;
+}
+
+void EncodePool::Submit(EncodeJob& job) {
+    Shard& shard = *shards[job.shard];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.queue[(shard.queue_head + shard.queued) % shard.queue.size()] = &job;
+        ++shard.queued;
+    }
+    Metrics::encode_queue_depth.fetch_add(1, std::memory_order_relaxed);
+    shard.work_ready.notify_one();
+}
+
+// Workers drain their queue before they exit, so every submitted job is
+// written. A pinned worker allocates its encode buffer after pinning, so the
+// buffer's pages are first touched on the worker's own node.
+
+void EncodePool::Work(Shard& shard, int worker) {
+    if (shard.node >= 0) Numa::PinThread(Numa::Nodes()[shard.node]);
+    Trace::SetThreadName("encode " + std::to_string(worker + 1));
+    ImageFile::EncodeBuffer();
+    if (pack) ThumbnailPack::Warm();
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    while (true) {
+        shard.work_ready.wait(lock, [&shard] { return shard.queued > 0 || shard.stopping; });
+        if (!shard.queued) return;
+        EncodeJob* job = shard.queue[shard.queue_head];
+        shard.queue_head = (shard.queue_head + 1) % shard.queue.size();
+        --shard.queued;
+        lock.unlock();
+
+        Metrics::encode_queue_depth.fetch_sub(1, std::memory_order_relaxed);
+        unsigned char* payload_sha256 = job->row ? job->row->hit.payload_sha256.data() : nullptr;
+        unsigned char* output_sha256 = job->row ? job->row->hit.output_sha256.data() : nullptr;
+        if (pack) {
+            pack->Add(job->output, job->index, job->pixels.data(), job->width, job->height, payload_sha256, output_sha256);
+        } else {
+            ImageFile::SaveAsBMP(job->output, job->pixels.data(), job->width, job->height, payload_sha256, output_sha256);
+        }
+        if (job->row) {
+            job->row->done.store(true, std::memory_order_release);
+            job->row->done.notify_one();
+        }
+
+        lock.lock();
+        shard.free_jobs.push_back(job);
+        shard.job_free.notify_one();
+    }
+}
+
+// Parse a sysfs CPU list such as "0-3,8-11".
+
+static std::vector<int> ParseCpuList(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+        const std::size_t comma = list.find(',');
+        const std::string_view range = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+        int first = 0;
+        int last = 0;
+        const char* end = range.data() + range.size();
+        auto [dash, ec] = std::from_chars(range.data(), end, first);
+        if (ec != std::errc()) continue;
+        last = first;
+        if (dash != end && *dash == '-') std::from_chars(dash + 1, end, last);
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+const std::vector<NumaNode>& Numa::Nodes() {
+    static const std::vector<NumaNode> nodes = [] {
+        std::vector<NumaNode> found;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+            const std::string name = entry.path().filename().string();
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4) continue;
+            std::ifstream file(entry.path() / "cpulist");
+            std::string list;
+            std::getline(file, list);
+            NumaNode node;
+            node.id = std::atoi(name.c_str() + 4);
+            node.cpus = ParseCpuList(list);
+            if (!node.cpus.empty()) found.push_back(std::move(node));
+        }
+        std::sort(found.begin(), found.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+        if (found.empty()) {
+            NumaNode all;
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) all.cpus.push_back(cpu);
+            found.push_back(std::move(all));
+        }
+        return found;
+    }();
+    return nodes;
+}
+
+bool Numa::PinThread(const NumaNode& node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : node.cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Only whole pages inside the range are bound. MPOL_PREFERRED falls back to
+// other nodes when the preferred one is full instead of failing allocations.
+
+void Numa::PreferNode(const void* data, std::size_t size, const NumaNode& node) {
+    const std::uintptr_t page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    const std::uintptr_t begin = (reinterpret_cast<std::uintptr_t>(data) + page - 1) / page * page;
+    const std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(data) + size) / page * page;
+    if (end <= begin || node.id < 0) return;
+
+    std::vector<unsigned long> mask(node.id / (8 * sizeof(unsigned long)) + 1);
+    mask[node.id / (8 * sizeof(unsigned long))] |= 1ul << (node.id % (8 * sizeof(unsigned long)));
+    syscall(__NR_mbind, begin, end - begin, MPOL_PREFERRED, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1, 0);
+}
+
+// Resolve a block device number through sysfs: a partition is replaced by its
+// disk and a volume with a single slave by that slave, until neither applies.
+// Devices without a sysfs entry (tmpfs, overlay, network file systems) are
+// named by their number and treated as solid-state.
+
+std::string Devices::DiskOf(dev_t device, bool& rotational) {
+    const std::string number = std::to_string(major(device)) + ":" + std::to_string(minor(device));
+    rotational = false;
+    std::error_code ec;
+    fs::path disk = fs::canonical("/sys/dev/block/" + number, ec);
+    if (ec) return number;
+
+    for (int depth = 0; depth < 8; ++depth) {
+        if (fs::exists(disk / "partition", ec)) disk = disk.parent_path();
+        std::vector<fs::path> slaves;
+        for (const auto& entry : fs::directory_iterator(disk / "slaves", ec)) slaves.push_back(entry.path());
+        if (slaves.size() != 1) break;
+        fs::path slave = fs::canonical(slaves.front(), ec);
+        if (ec) break;
+        disk = slave;
+    }
+
+    std::ifstream flag(disk / "queue" / "rotational");
+    int value = 0;
+    rotational = (flag >> value) && value == 1;
+    return disk.filename().string();
+}
+
+// Inputs that cannot be stat'ed form a group of their own; opening them
+// fails later with the usual message.
+
+std::vector<InputDevice> Devices::Group(const std::vector<fs::path>& files, int streams_per_device) {
+    std::vector<InputDevice> devices;
+    std::map<dev_t, std::size_t> by_number;
+    std::map<std::string, std::size_t> by_name;
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        struct stat info;
+        dev_t number = 0;
+        if (stat(files[i].c_str(), &info) == 0) number = S_ISBLK(info.st_mode) ? info.st_rdev : info.st_dev;
+
+        auto known = by_number.find(number);
+        if (known == by_number.end()) {
+            bool rotational = false;
+            const std::string name = number ? DiskOf(number, rotational) : "unknown";
+            auto [group, added] = by_name.emplace(name, devices.size());
+            if (added) {
+                InputDevice device;
+                device.name = name;
+                device.rotational = rotational;
+                devices.push_back(std::move(device));
+            }
+            known = by_number.emplace(number, group->second).first;
+        }
+        devices[known->second].files.push_back(i);
+    }
+
+    for (InputDevice& device : devices) {
+        device.streams = streams_per_device > 0 ? streams_per_device
+            : device.rotational ? AsyncConfig::RotationalStreams : AsyncConfig::SolidStateStreams;
+    }
+    return devices;
+}
+
+// Read until size bytes arrived, the file ended or an error occurred.
+// Returns the number of bytes actually read.
+
+static std::size_t PreadFully(int fd, unsigned char* buffer, std::size_t size, std::uint64_t offset) {
+    std::size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(fd, buffer + done, size - done, static_cast<off_t>(offset + done));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        done += static_cast<std::size_t>(got);
+    }
+    return done;
+}
+
+// Regular files report their size through fstat; block devices only through
+// seeking to the end.
+
+static std::uint64_t InputSize(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) return static_cast<std::uint64_t>(st.st_size);
+    const off_t end = lseek(fd, 0, SEEK_END);
+    return end > 0 ? static_cast<std::uint64_t>(end) : 0;
+}
+
+static bool PwriteFully(int fd, const unsigned char* buffer, std::size_t size, std::uint64_t offset) {
+    std::size_t done = 0;
+    while (done < size) {
+        ssize_t written = pwrite(fd, buffer + done, size - done, static_cast<off_t>(offset + done));
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        done += static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+// Photographic pixels leave LZ matchers little to find, so each channel is
+// replaced by its residual from the median edge predictor of LOCO-I (JPEG-LS)
+// before compression: the left, upper or left + upper - upper-left neighbour,
+// whichever is the median. Residuals wrap modulo 256 and cluster around zero.
+// Restoring runs in place, front to back, since every prediction only uses
+// neighbours that are already restored.
+
+static inline unsigned char PredictChannel(const unsigned char* data, std::size_t at, std::size_t x, std::size_t row) {
+    const int left = x >= 3 ? data[at - 3] : 0;
+    const int up = at >= row ? data[at - row] : 0;
+    const int corner = x >= 3 && at >= row ? data[at - row - 3] : 0;
+    if (corner >= std::max(left, up)) return static_cast<unsigned char>(std::min(left, up));
+    if (corner <= std::min(left, up)) return static_cast<unsigned char>(std::max(left, up));
+    return static_cast<unsigned char>(left + up - corner);
+}
+
+static void PredictPixels(const unsigned char* pixels, unsigned char* residuals, int width, int height) {
+    const std::size_t row = static_cast<std::size_t>(width) * 3;
+    for (std::size_t at = 0, y = 0; y < static_cast<std::size_t>(height); ++y) {
+        for (std::size_t x = 0; x < row; ++x, ++at) {
+            residuals[at] = static_cast<unsigned char>(pixels[at] - PredictChannel(pixels, at, x, row));
+        }
+    }
+}
+
+static void RestorePixels(unsigned char* data, int width, int height) {
+    const std::size_t row = static_cast<std::size_t>(width) * 3;
+    for (std::size_t at = 0, y = 0; y < static_cast<std::size_t>(height); ++y) {
+        for (std::size_t x = 0; x < row; ++x, ++at) {
+            data[at] = static_cast<unsigned char>(data[at] + PredictChannel(data, at, x, row));
+        }
+    }
+}
+
+// One zstd compression context, residual buffer and output buffer per thread,
+// reused for every thumbnail; the buffers hold the largest payload.
+
+struct PackStream {
+
+    ZSTD_CCtx* context = nullptr;
+    bool ready = false;
+    std::unique_ptr<unsigned char[]> residuals;
+    std::unique_ptr<unsigned char[]> out;
+    std::size_t out_size = 0;
+
+    ~PackStream() {
+        ZSTD_freeCCtx(context);
+    }
+
+};
+
+static PackStream& ThreadPackStream() {
+    thread_local PackStream pack_stream;
+    if (!pack_stream.ready) {
+        pack_stream.ready = true;
+        pack_stream.context = ZSTD_createCCtx();
+        if (pack_stream.context) {
+            ZSTD_CCtx_setParameter(pack_stream.context, ZSTD_c_compressionLevel, PackConfig::Level);
+            ZSTD_CCtx_setParameter(pack_stream.context, ZSTD_c_windowLog, PackConfig::WindowLog);
+        }
+        pack_stream.residuals.reset(new unsigned char[ImageConfig::MaxPayloadSize]);
+        pack_stream.out_size = ZSTD_compressBound(ImageConfig::MaxPayloadSize);
+        pack_stream.out.reset(new unsigned char[pack_stream.out_size]);
+    }
+    return pack_stream;
+}
+
+void ThumbnailPack::Warm() {
+    ThreadPackStream();
+}
+
+ThumbnailPack::~ThumbnailPack() {
+    ZSTD_freeCDict(cdict);
+    if (fd >= 0) close(fd);
+}
+
+// The training buffers are sized here, so holding payloads back never grows
+// them on the hot path.
+
+bool ThumbnailPack::Create(const fs::path& path) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create thumbnail pack.\n";
+        return false;
+    }
+    end = sizeof(PackHeader);
+    held.reserve(PackConfig::TrainingSamples);
+    sample_sizes.reserve(PackConfig::TrainingSamples);
+    samples.reserve(PackConfig::TrainingBytes);
+    held_names.reserve(PackConfig::TrainingNameBytes);
+    dictionary.reserve(PackConfig::DictionarySize);
+    return true;
+}
+
+void ThumbnailPack::Add(const std::string& name, int index, const unsigned char* pixels, int width, int height,
+                        unsigned char* payload_sha256, unsigned char* output_sha256) {
+    const std::size_t size = static_cast<std::size_t>(width) * height * 3;
+    if (payload_sha256) {
+        TraceSpan span("output digests");
+        std::vector<unsigned char>& bmp = ImageFile::EncodeBuffer();
+        ImageFile::EncodeBMP(bmp, pixels, width, height);
+        Sha256Digest::Compute(pixels, size, payload_sha256);
+        Sha256Digest::Compute(bmp.data(), bmp.size(), output_sha256);
+    }
+    unsigned char* residuals = ThreadPackStream().residuals.get();
+    {
+        TraceSpan span("pack predict");
+        PredictPixels(pixels, residuals, width, height);
+    }
+
+    bool held_back = false;
+    bool trained_here = false;
+    {
+        TraceSpan span("pack");
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!trained) {
+            held_back = held.size() < PackConfig::TrainingSamples && size <= samples.capacity() - samples.size()
+                && name.size() <= held_names.capacity() - held_names.size();
+            if (held_back) {
+                held.push_back({held_names.size(), name.size(), samples.size(), index, width, height});
+                held_names.append(name);
+                samples.insert(samples.end(), residuals, residuals + size);
+                sample_sizes.push_back(size);
+            }
+            if (!held_back || held.size() == PackConfig::TrainingSamples) {
+                Train();
+                trained_here = true;
+            }
+        }
+    }
+    if (trained_here) StoreHeld();
+    if (!held_back) Store(name, index, residuals, width, height);
+}
+
+// Called with the mutex held, on the payloads held back so far. With too few
+// of them, or when training fails, the pack goes without a dictionary rather
+// than carrying one copied from a handful of payloads.
+
+void ThumbnailPack::Train() {
+    trained = true;
+    if (held.size() < PackConfig::MinTrainingSamples) return;
+
+    TraceSpan span("pack train");
+    dictionary.resize(PackConfig::DictionarySize);
+    const std::size_t size = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(),
+                                                   sample_sizes.data(), static_cast<unsigned>(sample_sizes.size()));
+    if (!ZDICT_isError(size)) {
+        dictionary.resize(size);
+        cdict = ZSTD_createCDict(dictionary.data(), dictionary.size(), PackConfig::Level);
+    }
+    if (!cdict) {
+        dictionary.clear();
+        return;
+    }
+    if (!PwriteFully(fd, dictionary.data(), dictionary.size(), end)) std::cerr << "Failed to write thumbnail pack.\n";
+    end += dictionary.size();
+}
+
+// Once the dictionary is trained nothing is added to the held payloads, so
+// they are compressed without the mutex and the training buffers released.
+
+void ThumbnailPack::StoreHeld() {
+    for (const Held& entry : held) {
+        Store(std::string_view(held_names).substr(entry.name_offset, entry.name_size), entry.index,
+              samples.data() + entry.pixels_offset, entry.width, entry.height);
+    }
+    held.clear();
+    std::vector<unsigned char>().swap(samples);
+    std::string().swap(held_names);
+}
+
+void ThumbnailPack::Store(std::string_view name, int index, const unsigned char* residuals, int width, int height) {
+    const std::size_t size = static_cast<std::size_t>(width) * height * 3;
+    PackStream& pack_stream = ThreadPackStream();
+    std::size_t packed = 0;
+    {
+        TraceSpan span("pack compress");
+        bool compressed = pack_stream.context && !ZSTD_isError(ZSTD_CCtx_refCDict(pack_stream.context, cdict));
+        if (compressed) {
+            packed = ZSTD_compress2(pack_stream.context, pack_stream.out.get(), pack_stream.out_size, residuals, size);
+            compressed = !ZSTD_isError(packed);
+        }
+        if (!compressed) {
+            std::cerr << "Failed to compress thumbnail " << name << ".\n";
+            return;
+        }
+    }
+
+    PackEntry entry{};
+    entry.size = static_cast<std::uint32_t>(packed);
+    entry.index = static_cast<std::uint32_t>(index);
+    entry.width = static_cast<std::uint16_t>(width);
+    entry.height = static_cast<std::uint16_t>(height);
+    entry.name_size = static_cast<std::uint16_t>(name.size());
+    {
+        TraceSpan span("record");
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.offset = end;
+        end += name.size() + entry.size;
+        raw_bytes += size;
+        entries.push_back(entry);
+    }
+    const auto name_bytes = reinterpret_cast<const unsigned char*>(name.data());
+    if (!PwriteFully(fd, name_bytes, name.size(), entry.offset) || !PwriteFully(fd, pack_stream.out.get(), entry.size, entry.offset + name.size())) {
+        std::cerr << "Failed to write thumbnail pack.\n";
+        return;
+    }
+    Metrics::outputs_written.fetch_add(1, std::memory_order_relaxed);
+    Metrics::output_bytes.fetch_add(name.size() + entry.size, std::memory_order_relaxed);
+}
+
+// A run with fewer payloads than a full training sample trains on those.
+
+bool ThumbnailPack::Finish() {
+    if (fd < 0) return false;
+    if (!trained) {
+        Train();
+        StoreHeld();
+    }
+    std::sort(entries.begin(), entries.end(), [](const PackEntry& a, const PackEntry& b) { return a.index < b.index; });
+
+    PackHeader header{};
+    header.magic = PackConfig::Magic;
+    header.version = PackConfig::Version;
+    header.dictionary_size = static_cast<std::uint32_t>(dictionary.size());
+    header.entry_count = entries.size();
+    header.table_offset = end;
+    const std::size_t table_size = entries.size() * sizeof(PackEntry);
+    const bool written = PwriteFully(fd, reinterpret_cast<const unsigned char*>(entries.data()), table_size, end)
+        && PwriteFully(fd, reinterpret_cast<const unsigned char*>(&header), sizeof(header), 0);
+    end += table_size;
+    close(fd);
+    fd = -1;
+    if (!written) std::cerr << "Failed to write thumbnail pack.\n";
+    return written;
+}
+
+PageBuffer::PageBuffer(std::size_t size, bool huge_pages) {
+    const std::size_t page = huge_pages ? HugePageConfig::PageSize : static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    length = size;
+    mapped = (std::max<std::size_t>(size, 1) + page - 1) / page * page;
+
+    void* region = MAP_FAILED;
+    if (huge_pages) {
+        region = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) hugetlb_bytes.fetch_add(mapped, std::memory_order_relaxed);
+    }
+    if (region == MAP_FAILED && huge_pages) {
+// Over-allocate by one huge page and trim both ends so the buffer starts on
+// a huge page boundary, which THP needs to back it with whole huge pages.
+        void* raw = mmap(nullptr, mapped + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(raw);
+            const std::uintptr_t aligned = (start + page - 1) / page * page;
+            if (aligned > start) munmap(raw, aligned - start);
+            if (start + page > aligned) munmap(reinterpret_cast<void*>(aligned + mapped), start + page - aligned);
+            region = reinterpret_cast<void*>(aligned);
+            if (madvise(region, mapped, MADV_HUGEPAGE) == 0) thp_bytes.fetch_add(mapped, std::memory_order_relaxed);
+        }
+    }
+    if (region == MAP_FAILED) region = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) throw std::bad_alloc();
+    memory = static_cast<unsigned char*>(region);
+}
+
+PageBuffer::PageBuffer(PageBuffer&& other) noexcept
+    : memory(std::exchange(other.memory, nullptr)), length(std::exchange(other.length, 0)), mapped(std::exchange(other.mapped, 0)) {}
+
+PageBuffer& PageBuffer::operator=(PageBuffer&& other) noexcept {
+    if (this != &other) {
+        if (memory) munmap(memory, mapped);
+        memory = std::exchange(other.memory, nullptr);
+        length = std::exchange(other.length, 0);
+        mapped = std::exchange(other.mapped, 0);
+    }
+    return *this;
+}
+
+PageBuffer::~PageBuffer() {
+    if (memory) munmap(memory, mapped);
+}
+
+// Whether huge pages were actually obtained: the kernel's own accounting of
+// THP-backed anonymous memory, THP-mapped file pages and hugetlb pages for
+// the whole process, next to what was requested.
+
+static void PrintHugePageStats() {
+    std::uint64_t anon_kb = 0;
+    std::uint64_t file_kb = 0;
+    std::uint64_t hugetlb_kb = 0;
+    const char* previous_stage = Allocations::SetStage("stats");
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string line;
+    while (std::getline(smaps, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        std::uint64_t value = 0;
+        if (!(fields >> key >> value)) continue;
+        if (key == "AnonHugePages:") anon_kb = value;
+        if (key == "FilePmdMapped:") file_kb = value;
+        if (key == "Private_Hugetlb:" || key == "Shared_Hugetlb:") hugetlb_kb += value;
+    }
+    std::cerr << "huge pages: " << PageBuffer::hugetlb_bytes.load(std::memory_order_relaxed) / (1 << 20) << " MiB hugetlb, "
+              << PageBuffer::thp_bytes.load(std::memory_order_relaxed) / (1 << 20) << " MiB advised for THP; backed by "
+              << anon_kb / 1024 << " MiB anonymous THP, " << file_kb / 1024 << " MiB file THP, "
+              << hugetlb_kb / 1024 << " MiB hugetlb\n";
+    Allocations::SetStage(previous_stage);
+}
+
+PreadReader::PreadReader(int fd, std::uint64_t size, std::size_t block_size, bool huge_pages)
+    : fd(fd), size(size), buffer(block_size, huge_pages) {}
+
+bool PreadReader::Next(InputBlock& block) {
+    if (position >= size) return false;
+    const std::size_t wanted = static_cast<std::size_t>(std::min<std::uint64_t>(buffer.size(), size - position));
+    const std::size_t got = PreadFully(fd, buffer.data(), wanted, position);
+    if (got < wanted) {
+        std::cerr << "Read error at offset " << position + got << "; the rest of the input is not scanned"
+                  << " (--skip-errors reads past it).\n";
+        size = position + got;
+    }
+    if (got == 0) return false;
+
+    block = {position, buffer.data(), got};
+    position += got;
+    return true;
+}
+
+void PreadReader::SkipTo(std::uint64_t offset) {
+    position = std::max(position, offset);
+}
+
+RescueReader::RescueReader(int fd, std::uint64_t size, std::size_t block_size, std::vector<RescueRange> known_bad, bool huge_pages)
+    : fd(fd), size(size), buffer(block_size, huge_pages), bad(std::move(known_bad)) {}
+
+// A block read that comes up short is retried a sector-sized piece at a time
+// up to the first piece that fails, so good data in front of a bad sector is
+// kept. The failing piece is not read again: the next call probes past it.
+// Ranges of an input mapfile are skipped with the status they had there.
+
+bool RescueReader::Next(InputBlock& block) {
+    while (position < size) {
+        while (next_bad < bad.size() && bad[next_bad].offset + bad[next_bad].size <= position) ++next_bad;
+        if (next_bad < bad.size() && bad[next_bad].offset <= position) {
+            const std::uint64_t end = std::min(size, bad[next_bad].offset + bad[next_bad].size);
+            Record(position, end - position, bad[next_bad].status);
+            skipped_bytes += end - position;
+            ++skipped_ranges;
+            position = end;
+            continue;
+        }
+
+        if (failed_size) {
+            Record(position, failed_size, '-');
+            const std::uint64_t resume = Probe(position + failed_size);
+            failed_size = 0;
+            std::cerr << "Read error at offset " << position << "; skipped " << resume - position << " bytes.\n";
+            skipped_bytes += resume - position;
+            ++skipped_ranges;
+            position = resume;
+            continue;
+        }
+
+        std::uint64_t limit = std::min<std::uint64_t>(size, position + buffer.size());
+        if (next_bad < bad.size()) limit = std::min(limit, bad[next_bad].offset);
+        const std::size_t wanted = static_cast<std::size_t>(limit - position);
+        std::size_t got = PreadFully(fd, buffer.data(), wanted, position);
+        while (got < wanted) {
+            const std::size_t piece = std::min<std::size_t>(RescueConfig::ProbeSize - (position + got) % RescueConfig::ProbeSize, wanted - got);
+            if (PreadFully(fd, buffer.data() + got, piece, position + got) != piece) {
+                failed_size = piece;
+                break;
+            }
+            got += piece;
+        }
+        if (got == 0) continue;
+
+        block = {position, buffer.data(), got};
+        Record(position, got, '+');
+        position += got;
+        return true;
+    }
+    return false;
+}
+
+void RescueReader::SkipTo(std::uint64_t offset) {
+    if (offset <= position) return;
+    offset = std::min(offset, size);
+    RecordUntried(position, offset);
+    position = offset;
+    failed_size = 0;
+}
+
+// Probes start on sector boundaries. Returns the first offset found readable,
+// or the end of the input. Only the probes that fail are recorded as bad; the
+// ranges jumped over between them were never read and stay non-tried.
+
+std::uint64_t RescueReader::Probe(std::uint64_t from) {
+    std::uint64_t step = RescueConfig::FirstSkip;
+    std::uint64_t at = from;
+    std::uint64_t tried = from;
+    while (true) {
+        at = (at + step) / RescueConfig::ProbeSize * RescueConfig::ProbeSize;
+        if (at >= size) {
+            RecordUntried(tried, size);
+            return size;
+        }
+        RecordUntried(tried, at);
+        const std::size_t piece = static_cast<std::size_t>(std::min<std::uint64_t>(RescueConfig::ProbeSize, size - at));
+        if (PreadFully(fd, buffer.data(), piece, at) == piece) return at;
+        Record(at, piece, '-');
+        tried = at + piece;
+        step = std::min(step * 2, RescueConfig::MaxSkip);
+    }
+}
+
+// Ranges passed over without reading are non-tried, except where an input
+// mapfile already gave them a status.
+
+void RescueReader::RecordUntried(std::uint64_t from, std::uint64_t to) {
+    std::size_t next = next_bad;
+    while (from < to) {
+        while (next < bad.size() && bad[next].offset + bad[next].size <= from) ++next;
+        if (next < bad.size() && bad[next].offset <= from) {
+            const std::uint64_t end = std::min(to, bad[next].offset + bad[next].size);
+            Record(from, end - from, bad[next].status);
+            from = end;
+            continue;
+        }
+        const std::uint64_t end = next < bad.size() ? std::min(to, bad[next].offset) : to;
+        Record(from, end - from, '?');
+        from = end;
+    }
+}
+
+void RescueReader::Record(std::uint64_t offset, std::uint64_t length, char status) {
+    if (!length) return;
+    if (!map.empty() && map.back().status == status && map.back().offset + map.back().size == offset) {
+        map.back().size += length;
+    } else {
+        map.push_back({offset, length, status});
+    }
+}
+
+// The status line names where the scan stopped; anything after it was never
+// tried.
+
+bool RescueReader::WriteMapfile(const fs::path& path) const {
+    std::ofstream file(path);
+    if (!file) return false;
+    auto hex = [](std::uint64_t value) {
+        std::ostringstream text;
+        text << "0x" << std::hex << std::uppercase << std::setw(8) << std::setfill('0') << value;
+        return text.str();
+    };
+    file << "# Mapfile. Created by thumbnail_extractor\n"
+         << "# current_pos  current_status  current_pass\n"
+         << hex(position) << "     " << (position < size ? '?' : '+') << "               1\n"
+         << "#      pos        size  status\n";
+    for (const RescueRange& range : map) file << hex(range.offset) << "  " << hex(range.size) << "  " << range.status << "\n";
+    if (position < size) file << hex(position) << "  " << hex(size - position) << "  ?\n";
+    return static_cast<bool>(file);
+}
+
+// The first line that is not a comment is ddrescue's current position and
+// status; every following one is a "pos size status" range.
+
+bool RescueReader::LoadMapfile(const fs::path& path, std::vector<RescueRange>& bad) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::string line;
+    bool status_line = true;
+    while (std::getline(file, line)) {
+        const std::size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+        if (status_line) {
+            status_line = false;
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string offset_text;
+        std::string size_text;
+        std::string status;
+        if (!(fields >> offset_text >> size_text >> status) || status.size() != 1) return false;
+        RescueRange range;
+        try {
+            range.offset = std::stoull(offset_text, nullptr, 0);
+            range.size = std::stoull(size_text, nullptr, 0);
+        } catch (const std::exception&) {
+            return false;
+        }
+        range.status = status[0];
+        if (range.size && (range.status == '-' || range.status == '*' || range.status == '/')) bad.push_back(range);
+    }
+
+    std::sort(bad.begin(), bad.end(), [](const RescueRange& a, const RescueRange& b) { return a.offset < b.offset; });
+    std::vector<RescueRange> merged;
+    for (RescueRange range : bad) {
+        if (!merged.empty()) {
+            RescueRange& last = merged.back();
+            const std::uint64_t last_end = last.offset + last.size;
+            if (range.offset + range.size <= last_end) continue;
+            if (range.offset <= last_end && range.status == last.status) {
+                last.size = range.offset + range.size - last.offset;
+                continue;
+            }
+            if (range.offset < last_end) {
+                range.size -= last_end - range.offset;
+                range.offset = last_end;
+            }
+        }
+        merged.push_back(range);
+    }
+    bad = std::move(merged);
+    return true;
+}
+
+HashingReader::HashingReader(InputReader& inner, std::vector<std::unique_ptr<Digest>> digests)
+    : inner(inner), digests(std::move(digests)) {
+    for (auto& digest : this->digests) threads.emplace_back([this, &digest] { Work(*digest); });
+}
+
+HashingReader::~HashingReader() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto& thread : threads) thread.join();
+}
+
+void HashingReader::Work(Digest& digest) {
+    static constexpr unsigned char Zeros[64 * 1024] = {};
+    std::uint64_t seen = 0;
+    for (;;) {
+        std::unique_lock lock(mutex);
+        work_ready.wait(lock, [&] { return stopping || generation != seen; });
+        if (generation == seen) return;
+        seen = generation;
+        const std::uint64_t zeros = gap;
+        const unsigned char* bytes = data;
+        const std::size_t length = size;
+        lock.unlock();
+
+        for (std::uint64_t left = zeros; left > 0;) {
+            const std::size_t chunk = static_cast<std::size_t>(std::min<std::uint64_t>(left, sizeof(Zeros)));
+            digest.Update(Zeros, chunk);
+            left -= chunk;
+        }
+        if (length) digest.Update(bytes, length);
+
+        lock.lock();
+        if (--busy == 0) work_done.notify_all();
+    }
+}
+
+void HashingReader::Post(std::uint64_t zeros, const unsigned char* bytes, std::size_t length) {
+    {
+        std::lock_guard lock(mutex);
+        gap = zeros;
+        data = bytes;
+        size = length;
+        busy = threads.size();
+        ++generation;
+    }
+    work_ready.notify_all();
+}
+
+void HashingReader::Wait() {
+    std::unique_lock lock(mutex);
+    work_done.wait(lock, [this] { return busy == 0; });
+}
+
+bool HashingReader::Next(InputBlock& block) {
+    Wait();
+    if (!inner.Next(block)) return false;
+    const std::uint64_t zeros = block.offset > hashed_end ? block.offset - hashed_end : 0;
+    zero_filled += zeros;
+    Post(zeros, block.data, block.size);
+    hashed_end = block.offset + block.size;
+    return true;
+}
+
+void HashingReader::Finish() {
+    Wait();
+    const std::uint64_t end = Size();
+    if (end > hashed_end) {
+        zero_filled += end - hashed_end;
+        Post(end - hashed_end, nullptr, 0);
+        hashed_end = end;
+        Wait();
+    }
+}
+
+StreamReader::StreamReader(const fs::path& path, std::uint64_t size, std::size_t block_size)
+    : file(path, std::ios::binary), size(size), buffer(block_size) {}
+
+bool StreamReader::Next(InputBlock& block) {
+    if (!file || position >= size) return false;
+    file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    const std::size_t got = static_cast<std::size_t>(file.gcount());
+    if (got == 0) return false;
+
+    block = {position, buffer.data(), got};
+    position += got;
+    return true;
+}
+
+MmapReader::MmapReader(int fd, std::uint64_t size, std::size_t block_size, int advice, bool huge_pages)
+    : size(size), block_size(block_size) {
+    if (size == 0) return;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        this->size = 0;
+        return;
+    }
+    data = static_cast<const unsigned char*>(mapping);
+    if (advice) madvise(mapping, size, advice);
+    if (huge_pages && madvise(mapping, size, MADV_HUGEPAGE) == 0) PageBuffer::thp_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+MmapReader::~MmapReader() {
+    if (data) munmap(const_cast<unsigned char*>(data), size);
+}
+
+bool MmapReader::Next(InputBlock& block) {
+    if (position >= size) return false;
+    const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - position));
+    block = {position, data + position, count};
+    position += count;
+    return true;
+}
+
+void MmapReader::SkipTo(std::uint64_t offset) {
+    position = std::max(position, offset);
+}
+
+DirectReader::DirectReader(std::uint64_t size, std::size_t block_size)
+    : size(size), block_size(block_size) {
+    buffer = static_cast<unsigned char*>(std::aligned_alloc(BenchConfig::DirectAlignment, block_size));
+}
+
+DirectReader::~DirectReader() {
+    if (fd >= 0) close(fd);
+    std::free(buffer);
+}
+
+bool DirectReader::Open(const fs::path& path) {
+    fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    return fd >= 0 && buffer;
+}
+
+// The request is rounded up to whole alignment units; the read simply comes
+// back short at the end of the file.
+
+bool DirectReader::Next(InputBlock& block) {
+    if (position >= size) return false;
+    const std::uint64_t wanted = std::min<std::uint64_t>(block_size, size - position);
+    const std::size_t aligned = static_cast<std::size_t>((wanted + BenchConfig::DirectAlignment - 1) / BenchConfig::DirectAlignment * BenchConfig::DirectAlignment);
+    const std::size_t got = std::min<std::size_t>(PreadFully(fd, buffer, aligned, position), wanted);
+    if (got == 0) return false;
+
+    block = {position, buffer, got};
+    position += got;
+    return true;
+}
+
+void DirectReader::SkipTo(std::uint64_t offset) {
+    position = std::max(position, offset / BenchConfig::DirectAlignment * BenchConfig::DirectAlignment);
+}
+
+#ifdef RTTI_HAVE_IO_URING
+
+IoRing::~IoRing() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+// Set up the ring and map its queues as described in io_uring_setup(2).
+// Fails when the kernel or a seccomp filter does not allow io_uring.
+
+bool IoRing::Open(unsigned entries) {
+    io_uring_params params{};
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0) return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return false;
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring
+        : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) return false;
+    sq_entries = params.sq_entries;
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) return false;
+
+    auto* sq = static_cast<unsigned char*>(sq_ring);
+    auto* cq = static_cast<unsigned char*>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+void IoRing::Queue(int opcode, int fd, void* buffer, unsigned length, std::uint64_t offset, std::uint64_t user_data) {
+    if (queued == sq_entries) Submit();
+    const unsigned tail = *sq_tail;
+    const unsigned index = tail & *sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = static_cast<std::uint8_t>(opcode);
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(buffer);
+    sqe.len = length;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++queued;
+}
+
+// The kernel may take fewer entries than offered, or none while its
+// completion queue is backed up; what is left is offered again.
+
+void IoRing::Submit() {
+    while (queued) {
+        const long submitted = syscall(__NR_io_uring_enter, ring_fd, queued, 0, 0, nullptr, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            break;
+        }
+        queued -= static_cast<unsigned>(submitted);
+    }
+}
+
+bool IoRing::Wait() {
+    return syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0 || errno == EINTR;
+}
+
+UringReader::UringReader(int fd, std::uint64_t size, std::size_t block_size, unsigned depth)
+    : fd(fd), size(size), block_size(block_size), depth(depth),
+      buffers(depth, std::vector<unsigned char>(block_size)), slot_offset(depth), slot_result(depth), slot_pending(depth) {}
+
+UringReader::~UringReader() {
+    while (std::find(slot_pending.begin(), slot_pending.end(), true) != slot_pending.end() && Reap(true)) {}
+}
+
+bool UringReader::Open() {
+    if (!ring.Open(depth)) return false;
+    for (unsigned slot = 0; slot < depth; ++slot) Queue(slot);
+    ring.Submit();
+    return true;
+}
+
+void UringReader::Queue(unsigned slot) {
+    if (submit_offset >= size) return;
+    slot_offset[slot] = submit_offset;
+    slot_pending[slot] = true;
+    const unsigned length = static_cast<unsigned>(std::min<std::uint64_t>(block_size, size - submit_offset));
+    submit_offset += length;
+    ring.Queue(IORING_OP_READ, fd, buffers[slot].data(), length, slot_offset[slot], slot);
+}
+
+bool UringReader::Reap(bool wait) {
+    if (wait && !ring.Wait()) return false;
+    ring.Reap([this](std::uint64_t slot, int result) {
+        slot_result[slot] = result;
+        slot_pending[slot] = false;
+    });
+    return true;
+}
+
+// A short read is completed with pread so every block is whole.
+
+bool UringReader::Next(InputBlock& block) {
+    const unsigned previous = static_cast<unsigned>((delivered + depth - 1) % depth);
+    if (holding) {
+        Queue(previous);
+        ring.Submit();
+    }
+    holding = false;
+
+    const unsigned slot = static_cast<unsigned>(delivered % depth);
+    const std::uint64_t offset = delivered * block_size;
+    if (offset >= size) return false;
+    while (slot_pending[slot]) {
+        if (!Reap(true)) return false;
+    }
+    if (slot_result[slot] < 0) return false;
+
+    const std::size_t length = static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - offset));
+    std::size_t got = static_cast<std::size_t>(slot_result[slot]);
+    if (got < length) got += PreadFully(fd, buffers[slot].data() + got, length - got, offset + got);
+    if (got == 0) return false;
+
+    block = {offset, buffers[slot].data(), got};
+    ++delivered;
+    holding = true;
+    return true;
+}
+
+#endif
+
+std::uint64_t ByteStream::Skip(std::uint64_t size) {
+    unsigned char scratch[64 << 10];
+    std::uint64_t skipped = 0;
+    while (skipped < size) {
+        const std::size_t got = Read(scratch, static_cast<std::size_t>(std::min<std::uint64_t>(sizeof(scratch), size - skipped)));
+        if (got == 0) break;
+        skipped += got;
+    }
+    return skipped;
+}
+
+FileStream::FileStream(int fd, std::uint64_t begin, std::uint64_t end) : fd(fd), position(begin), end(end) {}
+
+std::size_t FileStream::Read(unsigned char* data, std::size_t size) {
+    if (position >= end) return 0;
+    const std::size_t got = PreadFully(fd, data, static_cast<std::size_t>(std::min<std::uint64_t>(size, end - position)), position);
+    position += got;
+    return got;
+}
+
+std::uint64_t FileStream::Skip(std::uint64_t size) {
+    const std::uint64_t skipped = std::min(size, end - std::min(end, position));
+    position += skipped;
+    return skipped;
+}
+
+InflateStream::InflateStream(ByteStream& source, int window_bits)
+    : source(source), window_bits(window_bits), input(256 << 10) {
+    failed = inflateInit2(&stream, window_bits) != Z_OK;
+}
+
+InflateStream::~InflateStream() {
+    if (!failed || stream.state) inflateEnd(&stream);
+}
+
+std::size_t InflateStream::Read(unsigned char* data, std::size_t size) {
+    stream.next_out = data;
+    stream.avail_out = static_cast<uInt>(std::min<std::size_t>(size, std::numeric_limits<uInt>::max()));
+    while (stream.avail_out > 0 && !finished && !failed) {
+        if (stream.avail_in == 0) {
+            stream.next_in = input.data();
+            stream.avail_in = static_cast<uInt>(source.Read(input.data(), input.size()));
+        }
+        const uInt before = stream.avail_out;
+        const int status = inflate(&stream, Z_NO_FLUSH);
+        if (status == Z_STREAM_END) {
+            if (window_bits <= MAX_WBITS) {
+                finished = true;
+                break;
+            }
+            if (stream.avail_in == 0) {
+                stream.next_in = input.data();
+                stream.avail_in = static_cast<uInt>(source.Read(input.data(), input.size()));
+            }
+            if (stream.avail_in == 0 || inflateReset(&stream) != Z_OK) finished = true;
+        } else if (status == Z_BUF_ERROR && stream.avail_in == 0 && stream.avail_out == before) {
+            std::cerr << "Compressed data ends early.\n";
+            failed = true;
+        } else if (status != Z_OK && status != Z_BUF_ERROR) {
+            std::cerr << "Corrupt compressed data.\n";
+            failed = true;
+        }
+    }
+    return static_cast<std::size_t>(stream.next_out - data);
+}
+
+static std::uint16_t LoadLe16(const unsigned char* p) {
+    return static_cast<std::uint16_t>(p[0] | (p[1] << 8));
+}
+
+static std::uint32_t LoadLe32(const unsigned char* p) {
+    return static_cast<std::uint32_t>(LoadLe16(p)) | (static_cast<std::uint32_t>(LoadLe16(p + 2)) << 16);
+}
+
+static std::uint64_t LoadLe64(const unsigned char* p) {
+    return static_cast<std::uint64_t>(LoadLe32(p)) | (static_cast<std::uint64_t>(LoadLe32(p + 4)) << 32);
+}
+
+std::unique_ptr<Archive> Archive::Open(int fd, std::uint64_t size) {
+    unsigned char magic[512] = {};
+    const std::size_t got = PreadFully(fd, magic, sizeof(magic), 0);
+    if (got >= 4 && magic[0] == 'P' && magic[1] == 'K' && ((magic[2] == 3 && magic[3] == 4) || (magic[2] == 5 && magic[3] == 6))) {
+        auto zip = std::make_unique<ZipArchive>(fd, size);
+        if (!zip->Load()) return nullptr;
+        return zip;
+    }
+    if (got >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) return std::make_unique<TarArchive>(fd, size, true);
+    if (got == sizeof(magic) && std::memcmp(magic + 257, "ustar", 5) == 0) return std::make_unique<TarArchive>(fd, size, false);
+    return nullptr;
+}
+
+TarArchive::TarArchive(int fd, std::uint64_t size, bool gzip) : file(fd, 0, size), source(&file) {
+    if (gzip) {
+        gunzip = std::make_unique<InflateStream>(file, MAX_WBITS + 16);
+        source = gunzip.get();
+    }
+}
+
+std::size_t TarArchive::EntryStream::Read(unsigned char* data, std::size_t size) {
+    const std::size_t got = archive.source->Read(data, static_cast<std::size_t>(std::min<std::uint64_t>(size, archive.remaining)));
+    archive.remaining -= got;
+    return got;
+}
+
+bool TarArchive::ReadString(std::uint64_t size, std::string& value) {
+    if (size > (1 << 20)) return false;
+    value.resize(static_cast<std::size_t>(size));
+    if (source->Read(reinterpret_cast<unsigned char*>(value.data()), value.size()) != value.size()) return false;
+    return source->Skip((512 - size % 512) % 512) == (512 - size % 512) % 512;
+}
+
+// Numeric fields are octal text, or big-endian binary when the top bit of the
+// first byte is set (GNU base-256, used for entries of 8 GiB and more).
+
+static std::uint64_t TarNumber(const unsigned char* field, std::size_t size) {
+    std::uint64_t value = 0;
+    if (field[0] & 0x80) {
+        for (std::size_t i = 1; i < size; ++i) value = (value << 8) | field[i];
+        return value;
+    }
+    for (std::size_t i = 0; i < size && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+bool TarArchive::Next(ArchiveEntry& entry) {
+    if (source->Skip(remaining + padding) != remaining + padding) return false;
+    remaining = padding = 0;
+
+    std::string long_name;
+    std::string pax_path;
+    std::uint64_t pax_size = 0;
+    bool have_pax_size = false;
+    unsigned char header[512];
+    while (source->Read(header, sizeof(header)) == sizeof(header)) {
+        if (std::all_of(header, header + sizeof(header), [](unsigned char byte) { return byte == 0; })) return false;
+
+        unsigned checksum = 0;
+        for (std::size_t i = 0; i < sizeof(header); ++i) checksum += (i >= 148 && i < 156) ? ' ' : header[i];
+        if (checksum != TarNumber(header + 148, 8)) {
+            std::cerr << "Bad tar header checksum, stopping.\n";
+            return false;
+        }
+
+        const char type = static_cast<char>(header[156]);
+        const std::uint64_t size = TarNumber(header + 124, 12);
+        if (type == 'L') {
+            if (!ReadString(size, long_name)) return false;
+            long_name.resize(std::strlen(long_name.c_str()));
+            continue;
+        }
+        if (type == 'x') {
+            std::string records;
+            if (!ReadString(size, records)) return false;
+            for (std::size_t at = 0; at < records.size();) {
+                const std::size_t space = records.find(' ', at);
+                const std::size_t length = std::strtoull(records.c_str() + at, nullptr, 10);
+                if (space == std::string::npos || length == 0 || at + length > records.size()) break;
+                const std::string_view record(records.data() + space + 1, at + length - space - 2);
+                const std::size_t equals = record.find('=');
+                if (equals != std::string_view::npos) {
+                    const std::string_view key = record.substr(0, equals);
+                    const std::string_view value = record.substr(equals + 1);
+                    if (key == "path") pax_path = value;
+                    if (key == "size") {
+                        pax_size = std::strtoull(std::string(value).c_str(), nullptr, 10);
+                        have_pax_size = true;
+                    }
+                }
+                at += length;
+            }
+            continue;
+        }
+
+        const std::uint64_t entry_size = have_pax_size ? pax_size : size;
+        if (type != '0' && type != '\0' && type != '7') {
+            const std::uint64_t skip = entry_size + (512 - entry_size % 512) % 512;
+            if (source->Skip(skip) != skip) return false;
+            long_name.clear();
+            pax_path.clear();
+            have_pax_size = false;
+            continue;
+        }
+
+        if (!pax_path.empty()) {
+            entry.name = pax_path;
+        } else if (!long_name.empty()) {
+            entry.name = long_name;
+        } else {
+            const std::string_view name(reinterpret_cast<const char*>(header), strnlen(reinterpret_cast<const char*>(header), 100));
+            const std::string_view prefix(reinterpret_cast<const char*>(header + 345), strnlen(reinterpret_cast<const char*>(header + 345), 155));
+            entry.name = prefix.empty() ? std::string(name) : std::string(prefix) + "/" + std::string(name);
+        }
+        entry.size = entry_size;
+        remaining = entry_size;
+        padding = (512 - entry_size % 512) % 512;
+        return true;
+    }
+    return false;
+}
+
+ZipArchive::ZipArchive(int fd, std::uint64_t size) : fd(fd), size(size) {}
+
+// The end of central directory record sits within the last 64 KiB + 22 bytes
+// (its comment is at most 65535 bytes). Zip64 archives put a locator right in
+// front of it that points at the zip64 end record with 64-bit counts.
+
+bool ZipArchive::Load() {
+    const std::size_t tail_size = static_cast<std::size_t>(std::min<std::uint64_t>(size, 65535 + 22));
+    std::vector<unsigned char> tail(tail_size);
+    if (PreadFully(fd, tail.data(), tail_size, size - tail_size) != tail_size || tail_size < 22) return false;
+
+    std::size_t end = tail_size - 22 + 1;
+    while (end-- > 0 && LoadLe32(tail.data() + end) != 0x06054B50) {}
+    if (end == static_cast<std::size_t>(-1)) {
+        std::cerr << "Zip end of central directory not found.\n";
+        return false;
+    }
+
+    std::uint64_t count = LoadLe16(tail.data() + end + 10);
+    std::uint64_t directory_size = LoadLe32(tail.data() + end + 12);
+    std::uint64_t directory_offset = LoadLe32(tail.data() + end + 16);
+    if (end >= 20 && LoadLe32(tail.data() + end - 20) == 0x07064B50) {
+        unsigned char record[56];
+        if (PreadFully(fd, record, sizeof(record), LoadLe64(tail.data() + end - 20 + 8)) == sizeof(record) && LoadLe32(record) == 0x06064B50) {
+            count = LoadLe64(record + 32);
+            directory_size = LoadLe64(record + 40);
+            directory_offset = LoadLe64(record + 48);
+        }
+    }
+    if (directory_offset + directory_size > size) return false;
+
+    std::vector<unsigned char> directory(static_cast<std::size_t>(directory_size));
+    if (PreadFully(fd, directory.data(), directory.size(), directory_offset) != directory.size()) return false;
+    std::size_t at = 0;
+    for (std::uint64_t i = 0; i < count && at + 46 <= directory.size() && LoadLe32(directory.data() + at) == 0x02014B50; ++i) {
+        const unsigned char* record = directory.data() + at;
+        const std::size_t name_size = LoadLe16(record + 28);
+        const std::size_t extra_size = LoadLe16(record + 30);
+        const std::size_t comment_size = LoadLe16(record + 32);
+        if (at + 46 + name_size + extra_size > directory.size()) break;
+
+        Member member;
+        member.flags = LoadLe16(record + 8);
+        member.method = LoadLe16(record + 10);
+        member.compressed = LoadLe32(record + 20);
+        member.size = LoadLe32(record + 24);
+        member.local_offset = LoadLe32(record + 42);
+        member.name.assign(reinterpret_cast<const char*>(record + 46), name_size);
+
+// Zip64 extended information holds the 64-bit values for exactly those
+// fields that are saturated in the record, in this order.
+        const unsigned char* extra = record + 46 + name_size;
+        for (std::size_t e = 0; e + 4 <= extra_size;) {
+            const std::uint16_t id = LoadLe16(extra + e);
+            const std::size_t length = LoadLe16(extra + e + 2);
+            if (id == 0x0001) {
+                std::size_t field = e + 4;
+                for (std::uint64_t* value : {&member.size, &member.compressed, &member.local_offset}) {
+                    if (*value != 0xFFFFFFFF || field + 8 > e + 4 + length) continue;
+                    *value = LoadLe64(extra + field);
+                    field += 8;
+                }
+            }
+            e += 4 + length;
+        }
+
+        if (member.name.empty() || member.name.back() != '/') members.push_back(std::move(member));
+        at += 46 + name_size + extra_size + comment_size;
+    }
+    return true;
+}
+
+bool ZipArchive::Next(ArchiveEntry& entry) {
+    inflate.reset();
+    raw.reset();
+    data = nullptr;
+
+    while (next < members.size()) {
+        const Member& member = members[next++];
+        if (member.flags & 1) {
+            std::cerr << "Skipping encrypted zip member " << member.name << ".\n";
+            continue;
+        }
+        if (member.method != 0 && member.method != 8) {
+            std::cerr << "Skipping zip member " << member.name << " (compression method " << member.method << ").\n";
+            continue;
+        }
+
+        unsigned char local[30];
+        if (PreadFully(fd, local, sizeof(local), member.local_offset) != sizeof(local) || LoadLe32(local) != 0x04034B50) {
+            std::cerr << "Bad local header for zip member " << member.name << ".\n";
+            continue;
+        }
+        const std::uint64_t begin = member.local_offset + sizeof(local) + LoadLe16(local + 26) + LoadLe16(local + 28);
+        raw = std::make_unique<FileStream>(fd, begin, std::min(size, begin + member.compressed));
+        data = raw.get();
+        if (member.method == 8) {
+            inflate = std::make_unique<InflateStream>(*raw, -MAX_WBITS);
+            data = inflate.get();
+        }
+        entry.name = member.name;
+        entry.size = member.size;
+        return true;
+    }
+    return false;
+}
+
+EntryReader::EntryReader(std::size_t block_size, bool huge_pages) : buffer(block_size, huge_pages) {}
+
+void EntryReader::Start(ByteStream& entry, std::uint64_t entry_size) {
+    stream = &entry;
+    size = entry_size;
+    position = 0;
+}
+
+bool EntryReader::Next(InputBlock& block) {
+    if (!stream || position >= size) return false;
+    const std::size_t wanted = static_cast<std::size_t>(std::min<std::uint64_t>(buffer.size(), size - position));
+    std::size_t got = 0;
+    while (got < wanted) {
+        const std::size_t n = stream->Read(buffer.data() + got, wanted - got);
+        if (n == 0) break;
+        got += n;
+    }
+    if (got == 0) {
+        size = position;
+        return false;
+    }
+    block = {position, buffer.data(), got};
+    position += got;
+    return true;
+}
+
+static std::uint32_t LoadBe32(const unsigned char* p) {
+    return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) | (p[2] << 8) | p[3];
+}
+
+static std::uint64_t LoadBe64(const unsigned char* p) {
+    return (static_cast<std::uint64_t>(LoadBe32(p)) << 32) | LoadBe32(p + 4);
+}
+
+// qcow2 compresses clusters as raw deflate, VMDK grains as zlib streams.
+
+ChunkInflater::~ChunkInflater() {
+    if (ready) inflateEnd(&stream);
+}
+
+bool ChunkInflater::Inflate(int fd, std::uint64_t offset, std::size_t size, unsigned char* out, std::size_t out_size) {
+    input.resize(size);
+    const std::size_t got = PreadFully(fd, input.data(), size, offset);
+    if (!ready) {
+        if (inflateInit2(&stream, window_bits) != Z_OK) return false;
+        ready = true;
+    } else if (inflateReset(&stream) != Z_OK) {
+        return false;
+    }
+    stream.next_in = input.data();
+    stream.avail_in = static_cast<uInt>(got);
+    stream.next_out = out;
+    stream.avail_out = static_cast<uInt>(out_size);
+    const int status = inflate(&stream, Z_FINISH);
+    return stream.avail_out == 0 && (status == Z_STREAM_END || status == Z_OK || status == Z_BUF_ERROR);
+}
+
+VirtualDisk::VirtualDisk(int fd, int window_bits) : fd(fd), inflater(window_bits) {}
+
+std::unique_ptr<VirtualDisk> VirtualDisk::Open(int fd, std::uint64_t size) {
+    unsigned char magic[32] = {};
+    const std::size_t got = PreadFully(fd, magic, sizeof(magic), 0);
+    if (got >= 4 && std::memcmp(magic, "QFI\xFB", 4) == 0) {
+        auto qcow2 = std::make_unique<Qcow2Disk>(fd, size);
+        if (!qcow2->Load()) return nullptr;
+        return qcow2;
+    }
+    if (got >= 4 && std::memcmp(magic, "KDMV", 4) == 0) {
+        auto vmdk = std::make_unique<VmdkDisk>(fd, size);
+        if (!vmdk->Load()) return nullptr;
+        return vmdk;
+    }
+    if (got >= 21 && std::memcmp(magic, "# Disk DescriptorFile", 21) == 0) {
+        std::cerr << "VMDK descriptor files are not supported; pass the sparse extent file instead.\n";
+        return nullptr;
+    }
+    std::cerr << "Not a qcow2 image or VMDK sparse extent.\n";
+    return nullptr;
+}
+
+bool VirtualDisk::Fetch(const ClusterLocation& location, unsigned char* out, std::size_t clusters) {
+    if (!location.compressed_size) {
+        const std::size_t length = clusters * cluster_size;
+        const std::size_t got = PreadFully(fd, out, length, location.host_offset);
+        std::memset(out + got, 0, length - got);
+        return true;
+    }
+    if (location.compressed_size > 2 * cluster_size) return false;
+    return inflater.Inflate(fd, location.host_offset, static_cast<std::size_t>(location.compressed_size), out, cluster_size);
+}
+
+std::size_t VirtualDisk::Read(unsigned char* data, std::size_t length, std::uint64_t offset) {
+    if (offset >= size) return 0;
+    length = static_cast<std::size_t>(std::min<std::uint64_t>(length, size - offset));
+    scratch.resize(cluster_size);
+
+    std::size_t done = 0;
+    while (done < length) {
+        const std::uint64_t at = offset + done;
+        const std::size_t within = static_cast<std::size_t>(at % cluster_size);
+        const std::size_t count = std::min(length - done, cluster_size - within);
+        ClusterLocation location;
+        if (!Locate(at / cluster_size, location)) {
+            std::memset(data + done, 0, count);
+        } else if (Fetch(location, scratch.data())) {
+            std::memcpy(data + done, scratch.data() + within, count);
+        } else {
+            break;
+        }
+        done += count;
+    }
+    return done;
+}
+
+Qcow2Disk::Qcow2Disk(int fd, std::uint64_t file_size) : VirtualDisk(fd, -MAX_WBITS), file_size(file_size) {}
+
+// Version 3 images may set incompatible feature bits; the dirty and corrupt
+// bits do not change how clusters are mapped, every other one does.
+
+bool Qcow2Disk::Load() {
+    unsigned char header[104] = {};
+    if (PreadFully(fd, header, sizeof(header), 0) < 72) {
+        std::cerr << "Truncated qcow2 header.\n";
+        return false;
+    }
+    const std::uint32_t version = LoadBe32(header + 4);
+    const std::uint64_t backing_offset = LoadBe64(header + 8);
+    cluster_bits = LoadBe32(header + 20);
+    size = LoadBe64(header + 24);
+    const std::uint32_t crypt_method = LoadBe32(header + 32);
+    const std::uint32_t l1_size = LoadBe32(header + 36);
+    const std::uint64_t l1_offset = LoadBe64(header + 40);
+
+    if (version < 2 || version > 3 || cluster_bits < 9 || cluster_bits > 21) {
+        std::cerr << "Unsupported qcow2 version or cluster size.\n";
+        return false;
+    }
+    if (crypt_method) {
+        std::cerr << "Encrypted qcow2 images are not supported.\n";
+        return false;
+    }
+    if (version == 3 && (LoadBe64(header + 72) & ~std::uint64_t{3})) {
+        std::cerr << "qcow2 image uses an external data file, zstd compression or extended L2 entries, which are not supported.\n";
+        return false;
+    }
+    cluster_size = std::size_t{1} << cluster_bits;
+
+    if (l1_size > VirtualDiskConfig::MaxL1Bytes / 8 || l1_offset > file_size || l1_size * std::uint64_t{8} > file_size - l1_offset) {
+        std::cerr << "Corrupt qcow2 L1 table.\n";
+        return false;
+    }
+    l1.resize(l1_size);
+    unsigned char* raw = reinterpret_cast<unsigned char*>(l1.data());
+    if (PreadFully(fd, raw, l1.size() * 8, l1_offset) != l1.size() * 8) {
+        std::cerr << "Corrupt qcow2 L1 table.\n";
+        return false;
+    }
+    for (std::size_t i = 0; i < l1.size(); ++i) l1[i] = LoadBe64(raw + 8 * i);
+
+    if (backing_offset) std::cerr << "qcow2 image has a backing file; clusters it provides are not scanned.\n";
+    return true;
+}
+
+// A compressed L2 entry keeps the host offset in its low bits and the number
+// of additional 512-byte sectors the data spans above them; the split depends
+// on the cluster size. A stored entry with bit 0 set reads as zeros.
+
+bool Qcow2Disk::Locate(std::uint64_t cluster, ClusterLocation& location) {
+    const unsigned l2_bits = cluster_bits - 3;
+    const std::uint64_t index = cluster >> l2_bits;
+    if (index >= l1.size()) return false;
+
+    if (index != l2_index) {
+        l2_index = index;
+        const std::uint64_t l2_offset = l1[index] & VirtualDiskConfig::Qcow2OffsetMask;
+        l2.resize(cluster_size / 8);
+        unsigned char* raw = reinterpret_cast<unsigned char*>(l2.data());
+        if (!l2_offset || PreadFully(fd, raw, cluster_size, l2_offset) != cluster_size) {
+            l2.clear();
+        } else {
+            for (std::size_t i = 0; i < l2.size(); ++i) l2[i] = LoadBe64(raw + 8 * i);
+        }
+    }
+    if (l2.empty()) return false;
+
+    const std::uint64_t entry = l2[cluster & ((std::uint64_t{1} << l2_bits) - 1)];
+    if (entry & (std::uint64_t{1} << 62)) {
+        const unsigned sector_bits = cluster_bits - 8;
+        const unsigned offset_bits = 62 - sector_bits;
+        location.host_offset = entry & ((std::uint64_t{1} << offset_bits) - 1);
+        const std::uint64_t sectors = (entry >> offset_bits) & ((std::uint64_t{1} << sector_bits) - 1);
+        location.compressed_size = (sectors + 1) * VirtualDiskConfig::SectorSize - (location.host_offset % VirtualDiskConfig::SectorSize);
+        return true;
+    }
+    location.host_offset = entry & VirtualDiskConfig::Qcow2OffsetMask;
+    location.compressed_size = 0;
+    return location.host_offset != 0 && !(entry & 1);
+}
+
+VmdkDisk::VmdkDisk(int fd, std::uint64_t file_size) : VirtualDisk(fd, MAX_WBITS), file_size(file_size) {}
+
+// streamOptimized extents are written front to back and only know where their
+// grain directory is at the end, so the header at the start says "at end" and
+// the real one is repeated in the footer, two sectors before the end.
+
+bool VmdkDisk::Load() {
+    constexpr std::uint64_t DirectoryAtEnd = ~std::uint64_t{0};
+    unsigned char header[VirtualDiskConfig::SectorSize] = {};
+    if (PreadFully(fd, header, sizeof(header), 0) != sizeof(header)) {
+        std::cerr << "Truncated VMDK header.\n";
+        return false;
+    }
+    if (LoadLe64(header + 56) == DirectoryAtEnd) {
+        if (file_size < 3 * sizeof(header)
+            || PreadFully(fd, header, sizeof(header), file_size - 2 * sizeof(header)) != sizeof(header)
+            || std::memcmp(header, "KDMV", 4) != 0) {
+            std::cerr << "VMDK footer not found.\n";
+            return false;
+        }
+    }
+    const std::uint32_t flags = LoadLe32(header + 8);
+    const std::uint64_t capacity = LoadLe64(header + 12);
+    const std::uint64_t grain = LoadLe64(header + 20);
+    table_entries = LoadLe32(header + 44);
+    const std::uint64_t directory_offset = LoadLe64(header + 56) * VirtualDiskConfig::SectorSize;
+    zeroed_grains = flags & (1u << 2);
+    compressed_grains = flags & (1u << 16);
+
+    if (grain < 8 || grain > 4096 || (grain & (grain - 1)) || table_entries == 0 || table_entries > 4096) {
+        std::cerr << "Unsupported VMDK grain size.\n";
+        return false;
+    }
+    if (compressed_grains && LoadLe16(header + 77) != 1) {
+        std::cerr << "Unsupported VMDK compression algorithm.\n";
+        return false;
+    }
+    size = capacity * VirtualDiskConfig::SectorSize;
+    cluster_size = static_cast<std::size_t>(grain * VirtualDiskConfig::SectorSize);
+
+    const std::uint64_t grains = (capacity + grain - 1) / grain;
+    const std::uint64_t tables = (grains + table_entries - 1) / table_entries;
+    if (directory_offset > file_size || tables * 4 > file_size - directory_offset) {
+        std::cerr << "Corrupt VMDK grain directory.\n";
+        return false;
+    }
+    directory.resize(static_cast<std::size_t>(tables));
+    unsigned char* raw = reinterpret_cast<unsigned char*>(directory.data());
+    if (PreadFully(fd, raw, directory.size() * 4, directory_offset) != directory.size() * 4) {
+        std::cerr << "Corrupt VMDK grain directory.\n";
+        return false;
+    }
+    for (std::size_t i = 0; i < directory.size(); ++i) directory[i] = LoadLe32(raw + 4 * i);
+    return true;
+}
+
+// Grain table entries are sector numbers; 0 is unallocated and, when the
+// header enables it, 1 is a zeroed grain. A compressed grain starts with a 12-byte marker: its logical sector
+// and the length of the deflate data that follows.
+
+bool VmdkDisk::Locate(std::uint64_t cluster, ClusterLocation& location) {
+    const std::uint64_t index = cluster / table_entries;
+    if (index >= directory.size()) return false;
+
+    if (index != table_index) {
+        table_index = index;
+        table.resize(table_entries);
+        unsigned char* raw = reinterpret_cast<unsigned char*>(table.data());
+        const std::size_t bytes = table.size() * 4;
+        if (!directory[index]
+            || PreadFully(fd, raw, bytes, std::uint64_t{directory[index]} * VirtualDiskConfig::SectorSize) != bytes) {
+            table.clear();
+        } else {
+            for (std::size_t i = 0; i < table.size(); ++i) table[i] = LoadLe32(raw + 4 * i);
+        }
+    }
+    if (table.empty()) return false;
+
+    const std::uint32_t entry = table[cluster % table_entries];
+    if (entry == 0 || (entry == 1 && zeroed_grains)) return false;
+    location.host_offset = std::uint64_t{entry} * VirtualDiskConfig::SectorSize;
+    location.compressed_size = 0;
+    if (compressed_grains) {
+        unsigned char marker[12];
+        if (PreadFully(fd, marker, sizeof(marker), location.host_offset) != sizeof(marker)) return false;
+        location.compressed_size = LoadLe32(marker + 8);
+        location.host_offset += sizeof(marker);
+    }
+    return true;
+}
+
+VirtualDiskReader::VirtualDiskReader(VirtualDisk& disk, std::size_t block_size, bool huge_pages)
+    : disk(disk), buffer(std::max(block_size, disk.ClusterSize()) / disk.ClusterSize() * disk.ClusterSize(), huge_pages) {}
+
+// A cluster that fails to decompress is reported and left out, ending the
+// block before it like an unallocated one.
+
+bool VirtualDiskReader::Next(InputBlock& block) {
+    const std::size_t cluster_size = disk.ClusterSize();
+    const std::uint64_t clusters = (disk.Size() + cluster_size - 1) / cluster_size;
+    const std::size_t capacity = buffer.size() / cluster_size;
+
+    while (next_cluster < clusters) {
+        const std::uint64_t first = next_cluster;
+        std::size_t count = 0;
+        std::uint64_t run_host = 0;
+        std::size_t run_begin = 0;
+        std::size_t run_count = 0;
+        auto flush = [&] {
+            if (run_count) disk.Fetch({run_host, 0}, buffer.data() + run_begin * cluster_size, run_count);
+            run_count = 0;
+        };
+
+        ClusterLocation location;
+        while (count < capacity && next_cluster < clusters && disk.Locate(next_cluster, location)) {
+            if (location.compressed_size) {
+                flush();
+                if (!disk.Fetch(location, buffer.data() + count * cluster_size)) {
+                    std::cerr << "Cluster " << next_cluster << " of the virtual disk could not be decompressed.\n";
+                    ++next_cluster;
+                    break;
+                }
+            } else if (run_count && location.host_offset == run_host + run_count * cluster_size) {
+                ++run_count;
+            } else {
+                flush();
+                run_host = location.host_offset;
+                run_begin = count;
+                run_count = 1;
+            }
+            ++count;
+            ++next_cluster;
+        }
+        flush();
+
+        const std::uint64_t offset = first * cluster_size;
+        if (count) {
+            block = {offset, buffer.data(), static_cast<std::size_t>(std::min<std::uint64_t>(count * cluster_size, disk.Size() - offset))};
+            return true;
+        }
+        if (next_cluster == first) {
+            unallocated += std::min<std::uint64_t>(cluster_size, disk.Size() - offset);
+            ++next_cluster;
+        }
+    }
+    return false;
+}
+
+void VirtualDiskReader::SkipTo(std::uint64_t offset) {
+    next_cluster = std::max(next_cluster, offset / disk.ClusterSize());
+}
+
+EwfImage::EwfImage(const fs::path& path, int fd) : path(path), fds{fd} {}
+
+EwfImage::~EwfImage() {
+    for (std::size_t i = 1; i < fds.size(); ++i) close(fds[i]);
+}
+
+// E01 to E99 are followed by EAA to EZZ, then FAA and on, in the case of the
+// first segment's extension.
+
+fs::path EwfImage::SegmentPath(std::uint32_t segment) const {
+    const std::string extension = path.extension().string();
+    if (extension.size() != 4) return {};
+    const char first = extension[1];
+    const char letter = std::islower(static_cast<unsigned char>(first)) ? 'a' : 'A';
+    std::string name = ".";
+    if (segment <= 99) {
+        name += {first, static_cast<char>('0' + segment / 10), static_cast<char>('0' + segment % 10)};
+    } else {
+        const std::uint32_t n = segment - 100;
+        name += {static_cast<char>(first + n / 676), static_cast<char>(letter + n / 26 % 26), static_cast<char>(letter + n % 26)};
+    }
+    fs::path next = path;
+    return next.replace_extension(name);
+}
+
+// Segments are chained by their last section: "next" means another segment
+// follows, "done" that this was the last one. A missing segment leaves the
+// chunks it would have held unreadable but does not stop the scan.
+
+bool EwfImage::Load() {
+    bool last = false;
+    for (std::uint32_t segment = 1; !last; ++segment) {
+        if (segment > 1) {
+            const fs::path next = SegmentPath(segment);
+            const int fd = next.empty() ? -1 : open(next.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "EWF segment " << segment << " is missing; the image ends early.\n";
+                break;
+            }
+            fds.push_back(fd);
+        }
+        if (!LoadSegment(segment, last)) return false;
+    }
+    if (!chunk_size) {
+        std::cerr << "EWF image has no volume section.\n";
+        return false;
+    }
+    return true;
+}
+
+// Every section starts with a 76-byte descriptor: its type, the file offset
+// of the next section and its own size. Tables list the chunks of the sectors
+// section before them as 31-bit offsets from a base, with the top bit set for
+// compressed chunks; a chunk ends where the next one starts, and the last one
+// where the sectors section ends. Images from EnCase 1 have no sectors
+// section and keep the chunks in the table section after its entries.
+
+bool EwfImage::LoadSegment(std::uint32_t segment, bool& last) {
+    static constexpr unsigned char Signature[8] = {'E', 'V', 'F', 0x09, 0x0D, 0x0A, 0xFF, 0x00};
+    const int fd = fds[segment - 1];
+    unsigned char header[13];
+    if (PreadFully(fd, header, sizeof(header), 0) != sizeof(header) || std::memcmp(header, Signature, sizeof(Signature)) != 0) {
+        if (segment == 1) {
+            std::cerr << "Not an EWF (E01) image.\n";
+        } else {
+            std::cerr << "EWF segment " << segment << " has no EWF signature.\n";
+        }
+        return false;
+    }
+
+    const std::uint64_t file_size = InputSize(fd);
+    std::uint64_t offset = sizeof(header);
+    std::uint64_t sectors_end = 0;
+    while (offset + EwfConfig::DescriptorSize <= file_size) {
+        unsigned char descriptor[EwfConfig::DescriptorSize];
+        if (PreadFully(fd, descriptor, sizeof(descriptor), offset) != sizeof(descriptor)) break;
+        const char* type_field = reinterpret_cast<const char*>(descriptor);
+        const std::string_view type(type_field, strnlen(type_field, 16));
+        const std::uint64_t next = LoadLe64(descriptor + 16);
+        const std::uint64_t section_size = LoadLe64(descriptor + 24);
+
+        if ((type == "volume" || type == "disk") && !chunk_size) {
+            unsigned char volume[24];
+            if (PreadFully(fd, volume, sizeof(volume), offset + sizeof(descriptor)) != sizeof(volume)) break;
+            const std::uint64_t sectors_per_chunk = LoadLe32(volume + 8);
+            const std::uint64_t bytes_per_sector = LoadLe32(volume + 12);
+            if (!sectors_per_chunk || !bytes_per_sector || sectors_per_chunk * bytes_per_sector > EwfConfig::MaxChunkSize) {
+                std::cerr << "Unsupported EWF chunk size.\n";
+                return false;
+            }
+            chunk_size = static_cast<std::size_t>(sectors_per_chunk * bytes_per_sector);
+            size = LoadLe64(volume + 16) * bytes_per_sector;
+        } else if (type == "sectors") {
+            sectors_end = offset + section_size;
+        } else if (type == "hash" || type == "digest") {
+            unsigned char md5[16];
+            if (PreadFully(fd, md5, sizeof(md5), offset + sizeof(descriptor)) == sizeof(md5) &&
+                std::any_of(md5, md5 + sizeof(md5), [](unsigned char byte) { return byte != 0; })) {
+                acquisition_md5 = HexString(md5, sizeof(md5));
+            }
+        } else if (type == "table") {
+            unsigned char table_header[EwfConfig::TableHeaderSize];
+            if (PreadFully(fd, table_header, sizeof(table_header), offset + sizeof(descriptor)) != sizeof(table_header)) break;
+            Table table;
+            table.first_chunk = table_chunks;
+            table.count = LoadLe32(table_header);
+            table.segment = segment - 1;
+            table.entries_offset = offset + sizeof(descriptor) + sizeof(table_header);
+            table.base_offset = LoadLe64(table_header + 8);
+            table.data_end = sectors_end ? sectors_end : offset + section_size;
+            if (table.count) {
+                tables.push_back(table);
+                table_chunks += table.count;
+            }
+        } else if (type == "next" || type == "done") {
+            last = type == "done";
+            return true;
+        }
+        if (next <= offset) break;
+        offset = next;
+    }
+    std::cerr << "EWF segment " << segment << " ends without a next or done section.\n";
+    last = true;
+    return true;
+}
+
+bool EwfImage::Locate(std::uint64_t chunk, EwfChunk& location) {
+    auto after = std::upper_bound(tables.begin(), tables.end(), chunk,
+                                  [](std::uint64_t value, const Table& table) { return value < table.first_chunk; });
+    if (after == tables.begin()) return false;
+    const std::size_t index = static_cast<std::size_t>(after - tables.begin() - 1);
+    const Table& table = tables[index];
+    if (chunk >= table.first_chunk + table.count) return false;
+
+    if (index != loaded) {
+        loaded = index;
+        entries.resize(table.count);
+        unsigned char* raw = reinterpret_cast<unsigned char*>(entries.data());
+        const std::size_t bytes = entries.size() * 4;
+        if (PreadFully(fds[table.segment], raw, bytes, table.entries_offset) != bytes) {
+            entries.clear();
+        } else {
+            for (std::size_t i = 0; i < entries.size(); ++i) entries[i] = LoadLe32(raw + 4 * i);
+        }
+    }
+    if (entries.empty()) return false;
+
+    const std::size_t i = static_cast<std::size_t>(chunk - table.first_chunk);
+    location.segment = table.segment;
+    location.compressed = entries[i] >> 31;
+    location.offset = table.base_offset + (entries[i] & 0x7FFFFFFF);
+    const std::uint64_t end = i + 1 < entries.size() ? table.base_offset + (entries[i + 1] & 0x7FFFFFFF) : table.data_end;
+    if (end <= location.offset) return false;
+    location.size = end - location.offset;
+    return true;
+}
+
+bool EwfImage::Fetch(const EwfChunk& location, unsigned char* out, std::size_t length, ChunkInflater& chunk_inflater) const {
+    const int fd = fds[location.segment];
+    if (location.compressed) {
+        if (location.size > 2 * chunk_size) return false;
+        return chunk_inflater.Inflate(fd, location.offset, static_cast<std::size_t>(location.size), out, length);
+    }
+    return location.size >= length && PreadFully(fd, out, length, location.offset) == length;
+}
+
+std::size_t EwfImage::Read(unsigned char* data, std::size_t length, std::uint64_t offset) {
+    if (offset >= size) return 0;
+    length = static_cast<std::size_t>(std::min<std::uint64_t>(length, size - offset));
+    scratch.resize(chunk_size);
+
+    std::size_t done = 0;
+    while (done < length) {
+        const std::uint64_t at = offset + done;
+        const std::uint64_t chunk = at / chunk_size;
+        const std::size_t within = static_cast<std::size_t>(at % chunk_size);
+        const std::size_t count = std::min(length - done, chunk_size - within);
+        const std::size_t decoded = static_cast<std::size_t>(std::min<std::uint64_t>(chunk_size, size - chunk * chunk_size));
+        EwfChunk location;
+        if (!Locate(chunk, location) || !Fetch(location, scratch.data(), decoded, inflater)) break;
+        std::memcpy(data + done, scratch.data() + within, count);
+        done += count;
+    }
+    return done;
+}
+
+// The cache holds at least two blocks' worth of chunks so that workers fill
+// the next block while the current one is scanned, and no more chunks than
+// the image has.
+
+EwfReader::EwfReader(EwfImage& image, std::size_t block_size, std::uint64_t cache_bytes, bool huge_pages)
+    : image(image),
+      block_chunks(std::max<std::size_t>(1, block_size / image.ChunkSize())),
+      slots(static_cast<std::size_t>(std::min<std::uint64_t>(std::max<std::uint64_t>(cache_bytes / image.ChunkSize(), 2 * block_chunks),
+                                                              std::max<std::uint64_t>(image.Chunks(), 1)))),
+      cache(slots * image.ChunkSize(), huge_pages),
+      locations(slots),
+      states(slots, SlotState::Free) {
+    const int threads = std::clamp(static_cast<int>(std::thread::hardware_concurrency()) - 1, 1, EwfConfig::MaxWorkers);
+    for (int i = 0; i < threads; ++i) workers.emplace_back([this] { Work(); });
+}
+
+EwfReader::~EwfReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+// Hand chunks to the workers, up to a full cache ahead of the block last
+// returned. A slot is only reassigned once the chunk in it is finished, which
+// matters after SkipTo() moved past chunks still being decompressed.
+// Called with the mutex held.
+
+void EwfReader::Schedule() {
+    const std::uint64_t chunks = image.Chunks();
+    bool added = false;
+    while (scheduled < chunks && scheduled < released + slots) {
+        const std::size_t slot = static_cast<std::size_t>(scheduled % slots);
+        if (states[slot] == SlotState::Pending) break;
+        if (image.Locate(scheduled, locations[slot])) {
+            states[slot] = SlotState::Pending;
+            ++pending;
+            added = true;
+        } else {
+            if (!warned_missing) std::cerr << "EWF image lists no chunk " << scheduled << "; later chunks may be missing too.\n";
+            warned_missing = true;
+            locations[slot] = {};
+            states[slot] = SlotState::Failed;
+        }
+        ++scheduled;
+    }
+    if (added) work_ready.notify_all();
+}
+
+void EwfReader::Work() {
+    ChunkInflater inflater(MAX_WBITS);
+    const std::size_t chunk_size = image.ChunkSize();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_ready.wait(lock, [&] { return stopping || claimed < scheduled; });
+        if (stopping) return;
+        const std::uint64_t chunk = claimed++;
+        const std::size_t slot = static_cast<std::size_t>(chunk % slots);
+        if (states[slot] != SlotState::Pending) continue;
+
+        const EwfChunk location = locations[slot];
+        const std::size_t length = static_cast<std::size_t>(std::min<std::uint64_t>(chunk_size, image.Size() - chunk * chunk_size));
+        lock.unlock();
+        const bool fetched = image.Fetch(location, cache.data() + slot * chunk_size, length, inflater);
+        lock.lock();
+        states[slot] = fetched ? SlotState::Done : SlotState::Failed;
+        --pending;
+        chunk_done.notify_all();
+    }
+}
+
+// Return the next run of decompressed chunks that sit side by side in the
+// cache, waiting for the workers where they have not caught up. Runs stop at
+// the end of the ring and before a chunk that could not be read.
+
+bool EwfReader::Next(InputBlock& block) {
+    const std::size_t chunk_size = image.ChunkSize();
+    const std::uint64_t chunks = image.Chunks();
+    std::unique_lock<std::mutex> lock(mutex);
+    released = cursor;
+    while (cursor < chunks) {
+        auto finished = [&](std::uint64_t chunk) {
+            Schedule();
+            return chunk < scheduled && states[chunk % slots] != SlotState::Pending;
+        };
+        chunk_done.wait(lock, [&] { return finished(cursor); });
+
+        const std::size_t first_slot = static_cast<std::size_t>(cursor % slots);
+        if (states[first_slot] == SlotState::Failed) {
+            if (locations[first_slot].size) std::cerr << "Chunk " << cursor << " of the EWF image could not be read.\n";
+            released = ++cursor;
+            continue;
+        }
+
+        std::size_t count = 1;
+        while (count < block_chunks && cursor + count < chunks && (cursor + count) % slots != 0) {
+            chunk_done.wait(lock, [&] { return finished(cursor + count); });
+            if (states[(cursor + count) % slots] != SlotState::Done) break;
+            ++count;
+        }
+
+        const std::uint64_t offset = cursor * chunk_size;
+        block = {offset, cache.data() + first_slot * chunk_size, static_cast<std::size_t>(std::min<std::uint64_t>(count * chunk_size, image.Size() - offset))};
+        cursor += count;
+        return true;
+    }
+    return false;
+}
+
+// Chunks already handed to the workers are still decompressed; skipping past
+// all of them waits for those to finish so that scheduling can jump ahead.
+
+void EwfReader::SkipTo(std::uint64_t offset) {
+    const std::uint64_t target = std::min(offset / image.ChunkSize(), image.Chunks());
+    std::unique_lock<std::mutex> lock(mutex);
+    if (target <= cursor) return;
+    cursor = target;
+    if (target > scheduled) {
+        chunk_done.wait(lock, [&] { return pending == 0; });
+        scheduled = claimed = target;
+    }
+}
+
+// Only as many slots as the input has blocks are used, and buffers are only
+// added when the caller's set is short, so small inputs do not map a whole
+// window.
+
+WindowReader::WindowReader(std::vector<PageBuffer>& buffers, std::uint64_t size, std::size_t block_size, std::size_t lookahead, bool huge_pages)
+    : size(size), block_size(block_size), lookahead(lookahead), buffers(buffers) {
+    const std::uint64_t blocks = std::max<std::uint64_t>(1, (size + block_size - 1) / block_size);
+    slots = static_cast<std::size_t>(std::min<std::uint64_t>(blocks, (lookahead + block_size - 1) / block_size + 2));
+    while (buffers.size() < slots) buffers.emplace_back(block_size, huge_pages);
+    slot_size.resize(slots);
+}
+
+bool WindowReader::Reserve(Slot& slot) {
+    const std::uint64_t offset = reserved * block_size;
+    const std::uint64_t released = delivered - (holding ? 1 : 0);
+    if (offset >= size || reserved - released >= slots) return false;
+
+    slot = {buffers[reserved % slots].data(), static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - offset)), offset};
+    ++reserved;
+    return true;
+}
+
+void WindowReader::Commit(std::size_t got) {
+    if (loaded >= reserved) return;
+    const std::uint64_t offset = loaded * block_size;
+    const std::size_t length = static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - offset));
+    slot_size[loaded % slots] = got;
+    ++loaded;
+    if (got < length) {
+        size = offset + got;
+        reserved = loaded;
+    }
+}
+
+bool WindowReader::Next(InputBlock& block) {
+    holding = false;
+    const std::uint64_t offset = delivered * block_size;
+    if (delivered >= loaded || offset >= size) return false;
+
+    const std::size_t slot = static_cast<std::size_t>(delivered % slots);
+    block = {offset, buffers[slot].data(), slot_size[slot]};
+    ++delivered;
+    holding = true;
+    return true;
+}
+
+bool WindowReader::Ready() const {
+    const std::uint64_t next = delivered * block_size;
+    if (next >= size) return true;
+    const std::uint64_t needed = std::min<std::uint64_t>(size, next + block_size + lookahead);
+    return std::min<std::uint64_t>(size, loaded * block_size) >= needed;
+}
+
+// The assembly buffer is sized for the largest possible payload so that it
+// never grows mid-scan; pages that are never touched cost nothing. Without
+// payloads it only ever holds header dimensions.
+
+HitScanner::HitScanner(InputReader& reader, bool read_payloads, double entropy_threshold, bool huge_pages)
+    : reader(reader), read_payloads(read_payloads), entropy_threshold(entropy_threshold),
+      assembly(read_payloads ? ImageConfig::MaxPayloadSize : ImageConfig::Headers[0].size() + 1 + 8, read_payloads && huge_pages),
+      assembled(assembly.data()) {}
+
+HitScanner::HitScanner(InputReader& reader, double entropy_threshold, unsigned char* assembly)
+    : reader(reader), read_payloads(true), entropy_threshold(entropy_threshold), assembled(assembly) {}
+
+// Fetch the block that holds position, dropping blocks that end before it. A
+// block that does not continue the previous one invalidates the saved tail.
+
+bool HitScanner::Pull() {
+    const std::uint64_t previous_end = block.offset + block.size;
+    if (position > previous_end) reader.SkipTo(position);
+
+    do {
+        TraceSpan span("read");
+        if (!reader.Next(block)) {
+            block = {};
+            done = true;
+            return false;
+        }
+        stats.bytes_read += block.size;
+        Metrics::bytes_scanned.fetch_add(block.size, std::memory_order_relaxed);
+    } while (block.offset + block.size <= position);
+
+    if (block.offset != previous_end) tail_size = 0;
+    position = std::max(position, block.offset);
+    Classify();
+    return true;
+}
+
+// Mark extents to skip. An extent is only skipped when it and the extent after
+// it are both high-entropy, so a header near the end of a noisy extent whose
+// payload follows in the next one is never lost. The last extent of a block has
+// no known successor and is always searched.
+
+void HitScanner::Classify() {
+    skip_extent.clear();
+    if (entropy_threshold <= 0) return;
+
+    const std::size_t extents = (block.size + ScanConfig::ExtentSize - 1) / ScanConfig::ExtentSize;
+    skip_extent.resize(extents, false);
+    bool next_high = false;
+    for (std::size_t e = extents; e-- > 0;) {
+        const std::size_t begin = e * ScanConfig::ExtentSize;
+        const std::size_t size = std::min(ScanConfig::ExtentSize, block.size - begin);
+        const bool high = ImageFile::ByteEntropy(block.data + begin, size) >= entropy_threshold;
+        skip_extent[e] = high && next_high;
+        next_high = high;
+    }
+}
+
+// Return size contiguous bytes starting at from. Ranges inside the current
+// block are returned in place; anything else is assembled from the saved tail
+// and following blocks. Returns null at end of input or when a gap interrupts
+// the range, unless the reader's gaps are holes that read as zeros.
+
+const unsigned char* HitScanner::Ensure(std::uint64_t from, std::size_t size) {
+    if (from >= block.offset && from + size <= block.offset + block.size) return block.data + (from - block.offset);
+
+    std::size_t filled = 0;
+    if (from < block.offset) {
+        if (!tail_size || from < tail_offset || tail_offset + tail_size != block.offset) return nullptr;
+        filled = static_cast<std::size_t>(std::min<std::uint64_t>(size, block.offset - from));
+        std::memcpy(assembled, tail.data() + (from - tail_offset), filled);
+    }
+
+    while (true) {
+        const std::uint64_t at = from + filled;
+        const std::uint64_t block_end = block.offset + block.size;
+        if (at >= block.offset && at < block_end) {
+            const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(size - filled, block_end - at));
+            std::memcpy(assembled + filled, block.data + (at - block.offset), count);
+            filled += count;
+        }
+        if (filled == size) return assembled;
+
+        tail_size = 0;
+        position = from + filled;
+        const bool pulled = Pull();
+        if (pulled && block.offset <= from + filled) continue;
+        if (!reader.HolesAreZero()) return nullptr;
+
+        const std::uint64_t hole_end = pulled ? block.offset : reader.Size();
+        const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(size - filled, hole_end - std::min(hole_end, from + filled)));
+        if (!count) return nullptr;
+        std::memset(assembled + filled, 0, count);
+        filled += count;
+        if (filled == size) return assembled;
+        if (!pulled) return nullptr;
+    }
+}
+
+// Search forward for the next header with valid dimensions. A header that
+// straddles two blocks is found by searching the saved tail of the previous
+// block together with the start of the next one. After a hit the scan resumes
+// behind its payload, after a rejected header right behind its dimensions. A
+// payload cut short by the end of the input ends the scan; one interrupted by
+// a gap is dropped and scanning resumes after the gap. Holes of a sparse
+// input are not gaps; they read as zeros.
+
+bool HitScanner::Next(ScannedHit& hit) {
+    const std::string_view header = ImageConfig::Headers[0];
+    const std::size_t header_span = header.size() + 1 + 8;
+
+    stalled = false;
+    while (!done) {
+        if (position >= block.offset + block.size) {
+            if (!reader.Ready()) {
+                stalled = true;
+                return false;
+            }
+            if (!Pull()) return false;
+        }
+
+        std::uint64_t found = 0;
+        bool have_header = false;
+
+        if (tail_size) {
+            unsigned char stitch[32];
+            const std::size_t head = std::min(header.size() - 1, block.size);
+            std::memcpy(stitch, tail.data(), tail_size);
+            std::memcpy(stitch + tail_size, block.data, head);
+            TraceSpan span("FindHeader");
+            const unsigned char* match = ImageFile::FindHeader(stitch, stitch + tail_size + head);
+            if (match && static_cast<std::size_t>(match - stitch) < tail_size) {
+                found = tail_offset + (match - stitch);
+                have_header = true;
+            } else {
+                tail_size = 0;
+            }
+        }
+
+        while (!have_header && position < block.offset + block.size) {
+            const std::size_t relative = static_cast<std::size_t>(position - block.offset);
+            std::size_t extent = relative / ScanConfig::ExtentSize;
+            if (!skip_extent.empty() && skip_extent[extent]) {
+                const std::size_t extent_end = std::min((extent + 1) * ScanConfig::ExtentSize, block.size);
+                stats.bytes_skipped_entropy += extent_end - relative;
+                Metrics::bytes_skipped_entropy.fetch_add(extent_end - relative, std::memory_order_relaxed);
+                position = block.offset + extent_end;
+                continue;
+            }
+
+            while (extent + 1 < skip_extent.size() && !skip_extent[extent + 1]) ++extent;
+            const std::size_t run_end = skip_extent.empty() ? block.size : std::min((extent + 1) * ScanConfig::ExtentSize, block.size);
+            const unsigned char* match;
+            {
+                TraceSpan span("FindHeader");
+                match = ImageFile::FindHeader(block.data + relative, block.data + std::min(run_end + header.size() - 1, block.size));
+            }
+            if (match) {
+                found = block.offset + (match - block.data);
+                have_header = true;
+                break;
+            }
+
+            if (run_end == block.size) {
+                const std::size_t keep_from = std::max(relative, block.size - std::min(block.size, header.size() - 1));
+                tail_size = block.size - keep_from;
+                tail_offset = block.offset + keep_from;
+                std::memcpy(tail.data(), block.data + keep_from, tail_size);
+            }
+            position = block.offset + run_end;
+        }
+        if (!have_header) continue;
+
+        ++stats.headers;
+        const unsigned char* dimensions;
+        int width = 0;
+        int height = 0;
+        {
+            TraceSpan span("ReadDimensions");
+            dimensions = Ensure(found + header.size() + 1, 8);
+            if (dimensions) std::tie(width, height) = ImageFile::ReadDimensions(dimensions);
+        }
+        tail_size = 0;
+        if (!dimensions) continue;
+
+        position = found + header_span;
+        if (width <= 0 || height <= 0 || width > ImageConfig::MaxWidth || height > ImageConfig::MaxHeight) {
+            ++stats.rejected;
+            Metrics::Reject(Metrics::RejectDimensions);
+            continue;
+        }
+
+        hit.offset = found;
+        hit.type = header;
+        hit.width = width;
+        hit.height = height;
+        hit.payload_size = static_cast<std::size_t>(width) * height * 3;
+        hit.payload = nullptr;
+
+        if (!read_payloads) {
+            if (position + hit.payload_size > reader.Size()) {
+                Metrics::Reject(Metrics::RejectTruncated);
+                done = true;
+                return false;
+            }
+            const std::uint64_t block_end = block.offset + block.size;
+            if (position + hit.payload_size > block_end) {
+                const std::uint64_t skipped = position + hit.payload_size - std::max(position, block_end);
+                stats.bytes_skipped_payload += skipped;
+                Metrics::bytes_skipped_payload.fetch_add(skipped, std::memory_order_relaxed);
+            }
+            position += hit.payload_size;
+            ++stats.hits;
+            Metrics::hits[0].fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        TraceSpan payload_span("pixel read");
+        const std::uint64_t payload_end = position + hit.payload_size;
+        hit.payload = Ensure(position, hit.payload_size);
+        if (!hit.payload) {
+            ++stats.rejected;
+            Metrics::Reject(Metrics::RejectTruncated);
+            continue;
+        }
+        position = payload_end;
+        ++stats.hits;
+        Metrics::hits[0].fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+static void AddScanStats(ScanStats& total, const ScanStats& stats) {
+    total.bytes_read += stats.bytes_read;
+    total.bytes_skipped_entropy += stats.bytes_skipped_entropy;
+    total.bytes_skipped_payload += stats.bytes_skipped_payload;
+    total.headers += stats.headers;
+    total.rejected += stats.rejected;
+    total.hits += stats.hits;
+}
+
+static void PrintScanStats(const ScanStats& stats, double seconds) {
+    const double scanned = static_cast<double>(stats.bytes_read + stats.bytes_skipped_payload);
+    std::cerr << std::fixed << std::setprecision(2)
+              << "read " << stats.bytes_read << " bytes in " << seconds << " s ("
+              << (seconds > 0 ? stats.bytes_read / seconds / (1 << 20) : 0.0) << " MiB/s)\n"
+              << "headers " << stats.headers << ", hits " << stats.hits << ", rejected " << stats.rejected << "\n"
+              << "skipped " << stats.bytes_skipped_entropy << " high-entropy bytes ("
+              << (scanned > 0 ? 100.0 * stats.bytes_skipped_entropy / scanned : 0.0) << "% of input)\n"
+              << "skipped " << stats.bytes_skipped_payload << " payload bytes without reading them\n"
+              << "kernels " << Isa::Selected().name << ", sha256 " << Isa::Selected().sha256_name << "\n";
+}
+
+// Both known-hash lists are optional; --stats reports their size.
+
+static bool LoadKnownHashes(const ProcessOptions& options, KnownHashes& ignore, KnownHashes& alert) {
+    if (!options.ignore_hashes_path.empty() && !ignore.Load(options.ignore_hashes_path)) return false;
+    if (!options.alert_hashes_path.empty() && !alert.Load(options.alert_hashes_path)) return false;
+    if (options.stats && (!ignore.Empty() || !alert.Empty())) {
+        std::cerr << "known hashes: " << ignore.Size() << " to ignore, " << alert.Size() << " to alert on ("
+                  << (ignore.FilterBytes() + alert.FilterBytes()) / 1024 << " KiB of filters)\n";
+    }
+    return true;
+}
+
+// Hash the payload and look it up before anything is encoded. A payload on
+// the alert list is reported right away, and wins over the ignore list.
+
+static void CheckKnownHashes(HitRecord& hit, const unsigned char* payload, std::size_t size,
+                             const KnownHashes& ignore, const KnownHashes& alert, std::string_view input) {
+    hit.known = {};
+    if (ignore.Empty() && alert.Empty()) return;
+    TraceSpan span("known hashes");
+    Sha256Digest::Compute(payload, size, hit.payload_sha256.data());
+    if (alert.Contains(hit.payload_sha256.data())) {
+        hit.known = "alert";
+        Metrics::alerts.fetch_add(1, std::memory_order_relaxed);
+        char hex[64];
+        HexDigits(hit.payload_sha256.data(), hit.payload_sha256.size(), hex);
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cerr << "ALERT: known payload " << std::string_view(hex, sizeof(hex)) << " in " << input;
+        if (!hit.entry.empty()) std::cerr << " entry " << hit.entry;
+        std::cerr << " at offset " << hit.offset << " (hit " << hit.index << ")\n";
+    } else if (ignore.Contains(hit.payload_sha256.data())) {
+        hit.known = "ignore";
+    }
+}
+
+// Scan the input block by block and hand every hit to the manifest and index.
+// In index-only mode payloads are skipped by seeking past them, so their pages
+// are never read. Otherwise each payload is hashed, checked for blankness and,
+// unless suppressed, written out as a BMP.
+
+void ImageFile::Process(const fs::path& file_path, const ProcessOptions& options) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    Manifest manifest;
+    if (!options.manifest_path.empty() && !manifest.Open(options.manifest_path, false, options.archive, options.output_hashes,
+                                                                !options.ignore_hashes_path.empty() || !options.alert_hashes_path.empty())) {
+        close(fd);
+        return;
+    }
+
+    HitIndex known_payloads;
+    if (!options.dedup_index_path.empty() && !known_payloads.Open(options.dedup_index_path)) {
+        std::cerr << "Failed to open dedup index.\n";
+        close(fd);
+        return;
+    }
+    PayloadSet seen_payloads;
+
+    KnownHashes ignore_hashes;
+    KnownHashes alert_hashes;
+    if (!LoadKnownHashes(options, ignore_hashes, alert_hashes)) {
+        close(fd);
+        return;
+    }
+    const std::string input_name = file_path.string();
+
+    HitIndexWriter index;
+    auto record = [&](const HitRecord& hit) {
+        manifest.Add(hit);
+        if (!options.index_path.empty()) index.Add(hit);
+    };
+
+// The scan thread stays on the first node so that the read buffer allocated
+// below is first touched there.
+    if (options.numa) Numa::PinThread(Numa::Nodes().front());
+
+    const auto started = std::chrono::steady_clock::now();
+    const std::size_t block_size = options.index_only ? ScanConfig::IndexOnlyBlockSize : ScanConfig::BlockSize;
+    std::unique_ptr<ThumbnailPack> pack;
+    if (!options.pack_path.empty()) {
+        pack = std::make_unique<ThumbnailPack>();
+        if (!pack->Create(options.pack_path)) {
+            close(fd);
+            return;
+        }
+    }
+    std::unique_ptr<EncodePool> pool;
+    if (options.threads > 1 && !options.index_only) pool = std::make_unique<EncodePool>(options.threads, options.numa, options.huge_pages, pack.get());
+    if (pack && !pool) ThumbnailPack::Warm();
+
+    std::vector<PendingRow> rows(pool && options.output_hashes ? EncodeConfig::PendingRows : 0);
+    std::size_t rows_head = 0;
+    std::size_t rows_queued = 0;
+    auto flush_rows = [&](bool all) {
+        while (rows_queued) {
+            PendingRow& row = rows[rows_head];
+            if (!row.done.load(std::memory_order_acquire)) {
+                if (!all) break;
+                row.done.wait(false, std::memory_order_acquire);
+            }
+            record(row.hit);
+            rows_head = (rows_head + 1) % rows.size();
+            --rows_queued;
+        }
+    };
+    auto queue_row = [&](const HitRecord& hit, bool pending) -> PendingRow& {
+        if (rows_queued == rows.size()) {
+            rows[rows_head].done.wait(false, std::memory_order_acquire);
+            flush_rows(false);
+        }
+        PendingRow& row = rows[(rows_head + rows_queued++) % rows.size()];
+        row.hit = hit;
+        row.done.store(!pending, std::memory_order_relaxed);
+        return row;
+    };
+    auto add_row = [&](const HitRecord& hit) {
+        if (rows.empty()) {
+            record(hit);
+            return;
+        }
+        queue_row(hit, false);
+        flush_rows(false);
+    };
+
+// The hit record and its output name are reused across iterations so that,
+// after the first few hits, the loop runs without touching the heap.
+
+    static int image_counter = 0;
+    const std::string output_prefix = file_path.stem().string() + "_extracted_";
+    std::uint64_t hits = 0;
+    HitRecord hit;
+    hit.output.reserve(output_prefix.size() + 16);
+    for (PendingRow& row : rows) row.hit.output.reserve(hit.output.capacity());
+    ScannedHit scanned;
+    ScanStats stats;
+    auto carve = [&](HitScanner& scanner) {
+        while (scanner.Next(scanned)) {
+            if (hits++ == AllocConfig::WarmupHits) Allocations::MarkWarm();
+            hit.index = ++image_counter;
+            hit.offset = scanned.offset;
+            hit.type = scanned.type;
+            hit.width = scanned.width;
+            hit.height = scanned.height;
+            hit.payload_read = false;
+            hit.payload_hash = 0;
+            hit.blank = false;
+            hit.output.clear();
+            hit.digested = false;
+
+            if (!scanned.payload) {
+                TraceSpan span("record");
+                add_row(hit);
+                continue;
+            }
+
+            {
+                TraceSpan span("payload checks");
+                hit.payload_hash = HashPayload(scanned.payload, scanned.payload_size);
+                hit.payload_read = true;
+                hit.blank = MeanDeviation(scanned.payload, scanned.payload_size) <= options.blank_threshold;
+            }
+            CheckKnownHashes(hit, scanned.payload, scanned.payload_size, ignore_hashes, alert_hashes, input_name);
+
+// With deduplication on, a payload already written by this run or listed in
+// the --dedup-against index is still recorded but not written again.
+// Blank payloads are always flagged and only suppressed with --skip-blank.
+// Payloads on the ignore list are recorded and never written.
+
+            bool duplicate = false;
+            bool queued = false;
+            if (options.dedup && hit.known != "ignore") {
+                TraceSpan span("dedup");
+                duplicate = !seen_payloads.Insert(hit.payload_hash) || known_payloads.ContainsHash(hit.payload_hash);
+            }
+            if (hit.known == "ignore") {
+                Metrics::Reject(Metrics::RejectKnown);
+            } else if (duplicate) {
+                Metrics::Reject(Metrics::RejectDuplicate);
+            } else if (hit.blank && options.skip_blank) {
+                Metrics::Reject(Metrics::RejectBlank);
+            } else {
+                char number[16];
+                const char* number_end = std::to_chars(number, number + sizeof(number), hit.index).ptr;
+                hit.output.assign(output_prefix).append(number, number_end - number).append(".bmp");
+                if (pool) {
+                    TraceSpan span("queue payload");
+                    EncodeJob& job = pool->Acquire();
+                    job.output = hit.output;
+                    std::memcpy(job.pixels.data(), scanned.payload, scanned.payload_size);
+                    job.width = hit.width;
+                    job.height = hit.height;
+                    job.index = hit.index;
+                    job.row = nullptr;
+                    if (!rows.empty()) {
+                        hit.digested = true;
+                        job.row = &queue_row(hit, true);
+                        queued = true;
+                    }
+                    pool->Submit(job);
+                } else if (pack) {
+                    hit.digested = options.output_hashes;
+                    pack->Add(hit.output, hit.index, scanned.payload, hit.width, hit.height,
+                              hit.digested ? hit.payload_sha256.data() : nullptr, hit.output_sha256.data());
+                } else {
+                    hit.digested = options.output_hashes;
+                    SaveAsBMP(hit.output, scanned.payload, hit.width, hit.height,
+                              hit.digested ? hit.payload_sha256.data() : nullptr, hit.output_sha256.data());
+                }
+            }
+            TraceSpan span("record");
+            if (queued) {
+                flush_rows(false);
+            } else {
+                add_row(hit);
+            }
+        }
+        AddScanStats(stats, scanner.Stats());
+    };
+
+// With --hash the reader is wrapped so that the image digests are computed
+// during the carve; they are printed once the whole input has been hashed.
+    std::string image_md5;
+    auto scan = [&](InputReader& reader) {
+        if (!options.hash_md5 && !options.hash_sha256) {
+            HitScanner scanner(reader, !options.index_only, options.entropy_threshold, options.huge_pages);
+            carve(scanner);
+            return;
+        }
+        std::vector<std::unique_ptr<Digest>> digests;
+        if (options.hash_md5) digests.push_back(std::make_unique<Md5Digest>());
+        if (options.hash_sha256) digests.push_back(std::make_unique<Sha256Digest>());
+        HashingReader hashing(reader, std::move(digests));
+        {
+            HitScanner scanner(hashing, !options.index_only, options.entropy_threshold, options.huge_pages);
+            carve(scanner);
+        }
+        hashing.Finish();
+        for (const auto& digest : hashing.Digests()) {
+            const std::string hex = digest->Hex();
+            if (digest->Name() == "md5") image_md5 = hex;
+            std::cerr << digest->Name() << " " << hex << "  " << file_path.string() << "\n";
+        }
+        if (hashing.ZeroFilled() && !reader.HolesAreZero()) {
+            std::cerr << "hashes include " << hashing.ZeroFilled() << " unreadable bytes as zeros\n";
+        }
+    };
+
+// Archive entries are scanned one after another through the same entry
+// reader and assembly buffer; hit offsets are relative to their entry.
+    if (options.archive) {
+        std::unique_ptr<Archive> archive = Archive::Open(fd, InputSize(fd));
+        if (!archive) {
+            std::cerr << "Not a tar or zip archive.\n";
+        } else {
+            EntryReader reader(block_size, options.huge_pages);
+            PageBuffer assembly;
+            if (!options.index_only) assembly = PageBuffer(ImageConfig::MaxPayloadSize, options.huge_pages);
+            ArchiveEntry entry;
+            while (archive->Next(entry)) {
+                reader.Start(archive->Data(), entry.size);
+                hit.entry = entry.name;
+                if (options.index_only) {
+                    HitScanner scanner(reader, false, options.entropy_threshold);
+                    carve(scanner);
+                } else {
+                    HitScanner scanner(reader, options.entropy_threshold, assembly.data());
+                    carve(scanner);
+                }
+                // Queued rows point at this entry's name.
+                flush_rows(true);
+            }
+            hit.entry = {};
+        }
+    } else if (options.ewf) {
+        EwfImage image(file_path, fd);
+        if (image.Load()) {
+            EwfReader reader(image, block_size, options.memory_budget, options.huge_pages);
+            if (options.stats) {
+                std::cerr << "EWF image of " << image.Size() << " bytes in " << image.Segments() << " segments, "
+                          << image.ChunkSize() << "-byte chunks, " << reader.Slots() << " cached, "
+                          << reader.Workers() << " decompression threads\n";
+            }
+            scan(reader);
+            if (!image_md5.empty() && !image.AcquisitionMd5().empty()) {
+                std::cerr << (image_md5 == image.AcquisitionMd5() ? "md5 matches" : "md5 DOES NOT match")
+                          << " the acquisition hash " << image.AcquisitionMd5() << "\n";
+            }
+        }
+    } else if (options.virtual_disk) {
+        std::unique_ptr<VirtualDisk> disk = VirtualDisk::Open(fd, InputSize(fd));
+        if (disk) {
+            VirtualDiskReader reader(*disk, block_size, options.huge_pages);
+            scan(reader);
+            if (options.stats) std::cerr << "skipped " << reader.Unallocated() << " unallocated bytes of the virtual disk\n";
+        }
+    } else if (options.skip_errors) {
+        std::vector<RescueRange> known_bad;
+        if (!options.mapfile_path.empty() && !RescueReader::LoadMapfile(options.mapfile_path, known_bad)) {
+            std::cerr << "Failed to read mapfile.\n";
+        } else {
+            RescueReader reader(fd, InputSize(fd), block_size, std::move(known_bad), options.huge_pages);
+            scan(reader);
+            if (options.stats) std::cerr << "skipped " << reader.SkippedBytes() << " unreadable bytes in " << reader.SkippedRanges() << " ranges\n";
+            if (!options.write_mapfile_path.empty() && !reader.WriteMapfile(options.write_mapfile_path)) std::cerr << "Failed to write mapfile.\n";
+        }
+    } else {
+        std::unique_ptr<InputReader> reader;
+        if (options.mmap_input) {
+            reader = std::make_unique<MmapReader>(fd, InputSize(fd), block_size, MADV_SEQUENTIAL, options.huge_pages);
+        } else {
+            reader = std::make_unique<PreadReader>(fd, InputSize(fd), block_size, options.huge_pages);
+        }
+        scan(*reader);
+    }
+    if (options.stats && (options.huge_pages || options.mmap_input)) PrintHugePageStats();
+    pool.reset();
+    flush_rows(true);
+    Allocations::MarkEnd(hits);
+    close(fd);
+
+    if (pack && pack->Finish() && options.stats) {
+        std::cerr << "packed " << pack->Entries() << " thumbnails, " << pack->RawBytes() << " bytes of pixels into "
+                  << pack->PackedBytes() << " bytes with a " << pack->DictionaryBytes() << "-byte dictionary\n";
+    }
+
+    if (!options.index_path.empty()) index.Write(options.index_path);
+    if (options.stats) {
+        PrintScanStats(stats, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        if (Allocations::Enabled()) Allocations::Print(std::cerr);
+    }
+}
+
+Scheduler::Scheduler(int threads) {
+    for (int i = 0; i < threads; ++i) workers.emplace_back(&Scheduler::Work, this, i);
+}
+
+// Workers only exit once the queue is empty, so every posted coroutine runs.
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+void Scheduler::Post(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(handle);
+    }
+    ready.notify_one();
+}
+
+void Scheduler::Work(int worker) {
+    Trace::SetThreadName("async " + std::to_string(worker + 1));
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        ready.wait(lock, [this] { return !queue.empty() || stopping; });
+        if (queue.empty()) return;
+        std::coroutine_handle<> handle = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        handle.resume();
+        lock.lock();
+    }
+}
+
+// Owns nothing but itself: the frame is freed as soon as the body returns.
+
+struct DetachedTask {
+
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+};
+
+static DetachedTask RunDetached(Scheduler& scheduler, Task task, std::latch& done) {
+    co_await scheduler.Schedule();
+    try {
+        co_await task;
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+    }
+    done.count_down();
+}
+
+void Scheduler::Spawn(Task task, std::latch& done) {
+    RunDetached(*this, std::move(task), done);
+}
+
+AsyncIo::AsyncIo(Scheduler& scheduler, unsigned depth) : scheduler(scheduler) {
+#ifdef RTTI_HAVE_IO_URING
+    uring = ring.Open(depth);
+    if (uring) reaper = std::thread(&AsyncIo::Reap, this);
+#else
+    (void)depth;
+#endif
+}
+
+// A no-op tagged with user data 0 tells the reaper to stop. Every request
+// has completed by then because its coroutine was awaited.
+
+AsyncIo::~AsyncIo() {
+#ifdef RTTI_HAVE_IO_URING
+    if (!uring) return;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex);
+        ring.Queue(IORING_OP_NOP, -1, nullptr, 0, 0, 0);
+        ring.Submit();
+    }
+    reaper.join();
+#endif
+}
+
+IoBatch AsyncIo::Read(int fd, IoRequest* requests, std::size_t count) {
+    return {*this, false, fd, requests, count};
+}
+
+IoBatch AsyncIo::Write(int fd, IoRequest* requests, std::size_t count) {
+    return {*this, true, fd, requests, count};
+}
+
+// The user data of each completion is its IoRequest. The last request of a
+// batch to complete hands the waiting coroutine to the scheduler.
+
+void AsyncIo::Reap() {
+#ifdef RTTI_HAVE_IO_URING
+    Trace::SetThreadName("io");
+    bool stop = false;
+    while (!stop) {
+        ring.Wait();
+        ring.Reap([&](std::uint64_t user_data, int result) {
+            if (!user_data) {
+                stop = true;
+                return;
+            }
+            IoRequest* request = reinterpret_cast<IoRequest*>(user_data);
+            IoBatch* batch = request->batch;
+            request->result = result;
+            if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) scheduler.Post(batch->handle);
+        });
+    }
+#endif
+}
+
+// Without a ring the requests are served right here and the awaiting
+// coroutine carries on without suspending.
+
+bool IoBatch::await_ready() {
+    if (io.uring) return count == 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        IoRequest& request = requests[i];
+        ssize_t n;
+        do {
+            n = write ? pwrite(fd, request.buffer, request.length, static_cast<off_t>(request.offset))
+                      : pread(fd, request.buffer, request.length, static_cast<off_t>(request.offset));
+        } while (n < 0 && errno == EINTR);
+        request.result = n < 0 ? -errno : n;
+    }
+    return true;
+}
+
+// All requests are queued and then entered into the ring with one system call.
+// The last completion may resume the coroutine, and destroy this batch,
+// before that call returns, so nothing of the batch is read once the requests
+// are queued.
+
+void IoBatch::await_suspend(std::coroutine_handle<> awaiting) {
+#ifdef RTTI_HAVE_IO_URING
+    handle = awaiting;
+    remaining.store(count, std::memory_order_relaxed);
+    AsyncIo& owner = io;
+    IoRequest* const first = requests;
+    const std::size_t total = count;
+    const int opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    const int target = fd;
+    for (std::size_t i = 0; i < total; ++i) first[i].batch = this;
+
+    std::lock_guard<std::mutex> lock(owner.submit_mutex);
+    for (std::size_t i = 0; i < total; ++i) {
+        IoRequest& request = first[i];
+        owner.ring.Queue(opcode, target, request.buffer, static_cast<unsigned>(request.length), request.offset, reinterpret_cast<std::uint64_t>(&request));
+    }
+    owner.ring.Submit();
+#else
+    (void)awaiting;
+#endif
+}
+
+// State shared by the coroutines of one async run. The mutex guards the dedup
+// set, the manifest and the summed scan statistics.
+
+struct AsyncCarve {
+
+    const ProcessOptions& options;
+    const std::vector<fs::path>& files;
+    const std::vector<InputDevice>& devices;
+    AsyncIo& io;
+    const HitIndex& known_payloads;
+    const KnownHashes& ignore_hashes;
+    const KnownHashes& alert_hashes;
+    Manifest& manifest;
+    const std::vector<std::string>& output_prefixes;
+    std::vector<std::atomic<std::size_t>> next_file;
+    std::mutex mutex{};
+    PayloadSet seen_payloads{};
+    ScanStats stats{};
+
+};
+
+// Buffers a lane reuses for every input it carves: the read window, the
+// scanner's payload assembly buffer, the encoded BMP and the hit record.
+
+struct CarveBuffers {
+
+    std::vector<PageBuffer> window;
+    PageBuffer assembly;
+    std::vector<unsigned char> bmp;
+    std::vector<IoRequest> requests;
+    HitRecord hit;
+
+};
+
+// Carve one input. Reads for every free window slot are issued together, then
+// the scanner runs over what has arrived until it stalls for more. A read that
+// fails on the ring (-EIO, or -EINVAL where the kernel predates IORING_OP_READ)
+// or comes up short is finished with pread; only if that fails too does the
+// input end there, with the offset reported. Hits are numbered per input and
+// named after the input's output prefix, and each BMP is written
+// asynchronously while other inputs keep going.
+
+static Task CarveFileAsync(AsyncCarve& carve, CarveBuffers& buffers, std::size_t file) {
+    const ProcessOptions& options = carve.options;
+    const fs::path& path = carve.files[file];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open input file " << path << ".\n";
+        co_return;
+    }
+
+    const std::size_t header_span = ImageConfig::Headers[0].size() + 1 + 8;
+    WindowReader reader(buffers.window, InputSize(fd), AsyncConfig::BlockSize, ImageConfig::MaxPayloadSize + header_span, options.huge_pages);
+    HitScanner scanner(reader, options.entropy_threshold, buffers.assembly.data());
+    const std::string& output_prefix = carve.output_prefixes[file];
+    const std::string source = path.string();
+    std::vector<IoRequest>& requests = buffers.requests;
+    HitRecord& hit = buffers.hit;
+    hit.source = source;
+    IoRequest write_request;
+    int image_counter = 0;
+    ScannedHit scanned;
+
+    do {
+        requests.clear();
+        WindowReader::Slot slot;
+        while (reader.Reserve(slot)) requests.push_back({slot.data, slot.length, slot.offset});
+        if (!requests.empty()) co_await carve.io.Read(fd, requests.data(), requests.size());
+        for (IoRequest& request : requests) {
+            std::size_t got = request.result > 0 ? static_cast<std::size_t>(request.result) : 0;
+            if (got < request.length) {
+                got += PreadFully(fd, static_cast<unsigned char*>(request.buffer) + got, request.length - got, request.offset + got);
+            }
+            reader.Commit(got);
+            if (got < request.length) {
+                std::cerr << "Read error at offset " << request.offset + got << " of " << path << "; the rest of the input is not scanned.\n";
+                break;
+            }
+        }
+
+        while (scanner.Next(scanned)) {
+            hit.index = ++image_counter;
+            hit.offset = scanned.offset;
+            hit.type = scanned.type;
+            hit.width = scanned.width;
+            hit.height = scanned.height;
+            hit.payload_read = true;
+            hit.output.clear();
+            hit.digested = false;
+            {
+                TraceSpan span("payload checks");
+                hit.payload_hash = HashPayload(scanned.payload, scanned.payload_size);
+                hit.blank = ImageFile::MeanDeviation(scanned.payload, scanned.payload_size) <= options.blank_threshold;
+            }
+            CheckKnownHashes(hit, scanned.payload, scanned.payload_size, carve.ignore_hashes, carve.alert_hashes, source);
+            bool duplicate = false;
+            if (options.dedup && hit.known != "ignore") {
+                std::lock_guard<std::mutex> lock(carve.mutex);
+                duplicate = !carve.seen_payloads.Insert(hit.payload_hash) || carve.known_payloads.ContainsHash(hit.payload_hash);
+            }
+
+            if (hit.known == "ignore") {
+                Metrics::Reject(Metrics::RejectKnown);
+            } else if (duplicate) {
+                Metrics::Reject(Metrics::RejectDuplicate);
+            } else if (hit.blank && options.skip_blank) {
+                Metrics::Reject(Metrics::RejectBlank);
+            } else {
+                char number[16];
+                const char* number_end = std::to_chars(number, number + sizeof(number), hit.index).ptr;
+                hit.output.assign(output_prefix).append(number, number_end - number).append(".bmp");
+                std::vector<unsigned char>& bmp = buffers.bmp;
+                const auto encode_started = std::chrono::steady_clock::now();
+                ImageFile::EncodeBMP(bmp, scanned.payload, scanned.width, scanned.height);
+                if (options.output_hashes) {
+                    TraceSpan span("output digests");
+                    Sha256Digest::Compute(scanned.payload, scanned.payload_size, hit.payload_sha256.data());
+                    Sha256Digest::Compute(bmp.data(), bmp.size(), hit.output_sha256.data());
+                    hit.digested = true;
+                }
+                const auto write_started = std::chrono::steady_clock::now();
+                Metrics::encode_seconds.Observe(std::chrono::duration<double>(write_started - encode_started).count());
+
+                int out = open(hit.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (out < 0) {
+                    std::cerr << "Failed to open output file.\n";
+                } else {
+                    for (std::size_t written = 0; written < bmp.size();) {
+                        write_request = {bmp.data() + written, bmp.size() - written, written};
+                        co_await carve.io.Write(out, &write_request, 1);
+                        if (write_request.result <= 0) {
+                            std::cerr << "Failed to write output file.\n";
+                            break;
+                        }
+                        written += static_cast<std::size_t>(write_request.result);
+                    }
+                    close(out);
+                    Metrics::write_seconds.Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - write_started).count());
+                    Metrics::outputs_written.fetch_add(1, std::memory_order_relaxed);
+                    Metrics::output_bytes.fetch_add(bmp.size(), std::memory_order_relaxed);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(carve.mutex);
+            carve.manifest.Add(hit);
+        }
+    } while (scanner.Stalled() && !requests.empty());
+    close(fd);
+    hit.source = {};
+
+    std::lock_guard<std::mutex> lock(carve.mutex);
+    AddScanStats(carve.stats, scanner.Stats());
+}
+
+// A lane carves the inputs of one device one after another until none are
+// left; the lanes of a device bound how many of its inputs are streamed at
+// once. Its buffers are mapped once and serve every input the lane takes.
+
+static Task CarveLane(AsyncCarve& carve, std::size_t device) {
+    CarveBuffers buffers;
+    buffers.assembly = PageBuffer(ImageConfig::MaxPayloadSize, carve.options.huge_pages);
+    const std::vector<std::size_t>& files = carve.devices[device].files;
+    for (std::size_t next; (next = carve.next_file[device].fetch_add(1)) < files.size();) {
+        co_await CarveFileAsync(carve, buffers, files[next]);
+    }
+}
+
+// Output name prefixes for the inputs of an async run. An input whose stem is
+// unique among the inputs gets the prefix a separate run on it would use.
+// Inputs that share a stem get their position in the input list appended to
+// it, so they do not overwrite each other's BMPs.
+
+static std::vector<std::string> AsyncOutputPrefixes(const std::vector<fs::path>& files) {
+    std::unordered_set<std::string> seen;
+    std::unordered_set<std::string> shared;
+    for (const fs::path& file : files) {
+        std::string stem = file.stem().string();
+        if (!seen.insert(stem).second) shared.insert(std::move(stem));
+    }
+
+    std::unordered_set<std::string> taken;
+    for (const fs::path& file : files) {
+        std::string stem = file.stem().string();
+        if (!shared.contains(stem)) taken.insert(std::move(stem));
+    }
+    std::vector<std::string> prefixes(files.size());
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        std::string name = files[i].stem().string();
+        if (shared.contains(name)) {
+            name += "_" + std::to_string(i + 1);
+            while (!taken.insert(name).second) name += "_";
+        }
+        prefixes[i] = name + "_extracted_";
+    }
+    return prefixes;
+}
+
+// Carve many inputs with a few threads: inputs are scanned concurrently, a
+// bounded number per device, as coroutines on options.threads scheduler
+// threads, with reads and writes going through io_uring (or pread/pwrite where
+// io_uring is not available) instead of blocking a thread.
+
+void ImageFile::ProcessAsync(const std::vector<fs::path>& files, const ProcessOptions& options) {
+    HitIndex known_payloads;
+    if (!options.dedup_index_path.empty() && !known_payloads.Open(options.dedup_index_path)) {
+        std::cerr << "Failed to open dedup index.\n";
+        return;
+    }
+
+    Manifest manifest;
+    if (!options.manifest_path.empty() && !manifest.Open(options.manifest_path, true, false, options.output_hashes,
+                                                                !options.ignore_hashes_path.empty() || !options.alert_hashes_path.empty())) {
+        return;
+    }
+
+    KnownHashes ignore_hashes;
+    KnownHashes alert_hashes;
+    if (!LoadKnownHashes(options, ignore_hashes, alert_hashes)) return;
+
+// Lanes are started a round at a time across devices, so every device has a
+// stream going before any device gets its second.
+    const auto started = std::chrono::steady_clock::now();
+    const std::vector<InputDevice> devices = Devices::Group(files, options.streams_per_device);
+    std::vector<std::size_t> lanes_of(devices.size());
+    std::size_t lanes = 0;
+    for (std::size_t d = 0; d < devices.size(); ++d) {
+        lanes_of[d] = std::min<std::size_t>(devices[d].files.size(), devices[d].streams);
+        lanes += lanes_of[d];
+    }
+
+    std::latch done(static_cast<std::ptrdiff_t>(lanes));
+    Scheduler scheduler(options.threads);
+    AsyncIo io(scheduler, AsyncConfig::IoDepth);
+    const std::vector<std::string> output_prefixes = AsyncOutputPrefixes(files);
+    AsyncCarve carve{options, files, devices, io, known_payloads, ignore_hashes, alert_hashes, manifest, output_prefixes, std::vector<std::atomic<std::size_t>>(devices.size())};
+    for (std::size_t round = 0, started_lanes = 0; started_lanes < lanes; ++round) {
+        for (std::size_t d = 0; d < devices.size(); ++d) {
+            if (round >= lanes_of[d]) continue;
+            scheduler.Spawn(CarveLane(carve, d), done);
+            ++started_lanes;
+        }
+    }
+    done.wait();
+
+    if (options.stats) {
+        if (options.huge_pages) PrintHugePageStats();
+        std::cerr << "async " << files.size() << " inputs, " << lanes << " in flight on " << options.threads
+                  << (options.threads == 1 ? " thread" : " threads") << " with " << (io.Uring() ? "io_uring" : "pread/pwrite") << "\n";
+        for (std::size_t d = 0; d < devices.size(); ++d) {
+            std::cerr << "device " << devices[d].name << (devices[d].rotational ? " (rotational): " : ": ") << devices[d].files.size()
+                      << " inputs, " << lanes_of[d] << (lanes_of[d] == 1 ? " stream\n" : " streams\n");
+        }
+        PrintScanStats(carve.stats, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        if (Allocations::Enabled()) Allocations::Print(std::cerr);
+    }
+}
+
+// Select the requested hits from the manifest and sort them by offset so the
+// input is read front to back. Hits close to each other are read as one batch.
+// Every hit is revalidated against the input before it is written: the header
+// must still be present and ReadDimensions must return the recorded size.
+
+void ImageFile::Extract(const fs::path& file_path, const ExtractOptions& options) {
+    std::vector<HitRecord> hits;
+    if (!options.index_path.empty()) {
+        HitIndex index;
+        if (!index.Open(options.index_path)) throw std::runtime_error("Failed to open hit index.");
+        for (const HitIndexRecord& record : index) {
+            if (record.type >= ImageConfig::Headers.size()) continue;
+            HitRecord hit;
+            hit.index = static_cast<int>(record.index);
+            hit.offset = record.offset;
+            hit.type = ImageConfig::Headers[record.type];
+            hit.width = record.width;
+            hit.height = record.height;
+            if (hit.width < 1 || hit.width > ImageConfig::MaxWidth || hit.height < 1 || hit.height > ImageConfig::MaxHeight) {
+                throw std::runtime_error("Thumbnail size out of range for hit " + std::to_string(hit.index) + " in the hit index.");
+            }
+            hits.push_back(std::move(hit));
+        }
+    } else {
+        hits = Manifest::Load(options.manifest_path, file_path);
+    }
+
+    if (!options.hits.empty()) {
+        std::vector<HitRecord> selected;
+        std::vector<int> found;
+        for (auto& hit : hits) {
+            if (HitSelected(options.hits, hit.index)) {
+                found.push_back(hit.index);
+                selected.push_back(std::move(hit));
+            }
+        }
+        hits = std::move(selected);
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+        ReportMissingHits(options.hits, found, options.index_path.empty() ? "manifest" : "index");
+    }
+    std::sort(hits.begin(), hits.end(), [](const HitRecord& a, const HitRecord& b) { return a.offset < b.offset; });
+
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open input file.");
+    std::unique_ptr<VirtualDisk> disk;
+    if (options.virtual_disk) {
+        disk = VirtualDisk::Open(fd, InputSize(fd));
+        if (!disk) {
+            close(fd);
+            throw std::runtime_error("Failed to open virtual disk.");
+        }
+    }
+    std::unique_ptr<EwfImage> ewf;
+    if (options.ewf) {
+        ewf = std::make_unique<EwfImage>(file_path, fd);
+        if (!ewf->Load()) {
+            ewf.reset();
+            close(fd);
+            throw std::runtime_error("Failed to open EWF image.");
+        }
+    }
+
+    auto hit_end = [](const HitRecord& hit) {
+        return hit.offset + hit.type.size() + 1 + 8 + static_cast<std::uint64_t>(hit.width) * hit.height * 3;
+    };
+
+    std::vector<unsigned char> batch;
+    std::vector<unsigned char> img_data;
+    std::size_t first = 0;
+    while (first < hits.size()) {
+        const std::uint64_t batch_begin = hits[first].offset;
+        std::uint64_t batch_end = hit_end(hits[first]);
+        std::size_t last = first + 1;
+        while (last < hits.size()
+               && hits[last].offset <= batch_end + ExtractConfig::MaxBatchGap
+               && hit_end(hits[last]) - batch_begin <= ExtractConfig::MaxBatchBytes) {
+            batch_end = std::max(batch_end, hit_end(hits[last]));
+            ++last;
+        }
+
+        batch.resize(batch_end - batch_begin);
+        std::size_t batch_size;
+        if (disk) {
+            batch_size = disk->Read(batch.data(), batch.size(), batch_begin);
+        } else if (ewf) {
+            batch_size = ewf->Read(batch.data(), batch.size(), batch_begin);
+        } else {
+            batch_size = PreadFully(fd, batch.data(), batch.size(), batch_begin);
+        }
+
+        for (std::size_t i = first; i < last; ++i) {
+            const HitRecord& hit = hits[i];
+            const std::size_t start = hit.offset - batch_begin;
+            const std::size_t payload_start = start + hit.type.size() + 1 + 8;
+            const std::size_t payload_size = hit_end(hit) - hit.offset - (payload_start - start);
+
+            if (payload_start + payload_size > batch_size
+                || std::string_view(reinterpret_cast<const char*>(batch.data() + start), hit.type.size()) != hit.type) {
+                std::cerr << "Hit " << hit.index << " not found at offset " << hit.offset << ".\n";
+                continue;
+            }
+
+            auto [width, height] = ReadDimensions(batch.data() + start + hit.type.size() + 1);
+            if (width != hit.width || height != hit.height) {
+                std::cerr << "Hit " << hit.index << " dimensions do not match the manifest.\n";
+                continue;
+            }
+
+            img_data.assign(batch.begin() + payload_start, batch.begin() + payload_start + payload_size);
+            fs::path output_path = file_path.stem().string() + "_extracted_" + std::to_string(hit.index) + ".bmp";
+            SaveAsBMP(output_path.string(), img_data.data(), width, height);
+        }
+
+        first = last;
+    }
+
+    close(fd);
+}
+
+// The entry table is sorted by hit index, so selected hits are found by
+// binary search and only their records are read.
+
+void ImageFile::Unpack(const fs::path& pack_path, const UnpackOptions& options) {
+    int fd = open(pack_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Failed to open thumbnail pack.");
+    const std::uint64_t file_size = InputSize(fd);
+
+    PackHeader header{};
+    if (PreadFully(fd, reinterpret_cast<unsigned char*>(&header), sizeof(header), 0) != sizeof(header)
+        || header.magic != PackConfig::Magic || header.version != PackConfig::Version
+        || header.dictionary_size > PackConfig::DictionarySize || header.table_offset > file_size
+        || header.entry_count > (file_size - header.table_offset) / sizeof(PackEntry)) {
+        close(fd);
+        throw std::runtime_error("Not a thumbnail pack.");
+    }
+    std::vector<unsigned char> dictionary(header.dictionary_size);
+    std::vector<PackEntry> entries(header.entry_count);
+    const std::size_t table_size = entries.size() * sizeof(PackEntry);
+    if (PreadFully(fd, dictionary.data(), dictionary.size(), sizeof(header)) != dictionary.size()
+        || PreadFully(fd, reinterpret_cast<unsigned char*>(entries.data()), table_size, header.table_offset) != table_size) {
+        close(fd);
+        throw std::runtime_error("Thumbnail pack is truncated.");
+    }
+
+    if (!options.hits.empty()) {
+        std::vector<PackEntry> selected;
+        std::vector<int> found;
+        for (const HitRange& range : options.hits) {
+            auto at = std::lower_bound(entries.begin(), entries.end(), static_cast<std::uint32_t>(range.first),
+                                       [](const PackEntry& entry, std::uint32_t value) { return entry.index < value; });
+            for (; at != entries.end() && at->index <= static_cast<std::uint32_t>(range.last); ++at) {
+                if (!found.empty() && found.back() == static_cast<int>(at->index)) continue;
+                found.push_back(static_cast<int>(at->index));
+                selected.push_back(*at);
+            }
+        }
+        ReportMissingHits(options.hits, found, "pack");
+        entries = std::move(selected);
+    }
+
+    ZSTD_DCtx* context = ZSTD_createDCtx();
+    ZSTD_DDict* ddict = dictionary.empty() ? nullptr : ZSTD_createDDict(dictionary.data(), dictionary.size());
+    if (!context || (!dictionary.empty() && !ddict)) {
+        ZSTD_freeDCtx(context);
+        ZSTD_freeDDict(ddict);
+        close(fd);
+        throw std::runtime_error("Failed to set up zstd decompression.");
+    }
+    std::vector<unsigned char> record;
+    std::vector<unsigned char> img_data;
+    for (const PackEntry& entry : entries) {
+        const std::size_t payload_size = static_cast<std::size_t>(entry.width) * entry.height * 3;
+        record.resize(entry.name_size + static_cast<std::size_t>(entry.size));
+        img_data.resize(payload_size);
+        bool unpacked = PreadFully(fd, record.data(), record.size(), entry.offset) == record.size();
+        if (unpacked) {
+            const std::size_t size = ZSTD_decompress_usingDDict(context, img_data.data(), payload_size,
+                                                                record.data() + entry.name_size, entry.size, ddict);
+            unpacked = !ZSTD_isError(size) && size == payload_size;
+        }
+        if (unpacked) RestorePixels(img_data.data(), entry.width, entry.height);
+        if (!unpacked) {
+            std::cerr << "Hit " << entry.index << " could not be unpacked.\n";
+            continue;
+        }
+// Only the file name is used, so a crafted pack cannot write elsewhere.
+        const fs::path name = fs::path(std::string(reinterpret_cast<const char*>(record.data()), entry.name_size)).filename();
+        if (name.empty() || name == "." || name == "..") {
+            std::cerr << "Hit " << entry.index << " has no usable output name.\n";
+            continue;
+        }
+        SaveAsBMP(name.string(), img_data.data(), entry.width, entry.height);
+    }
+    ZSTD_freeDDict(ddict);
+    ZSTD_freeDCtx(context);
+    close(fd);
+}
+
+// Pick the blocks to sample: one uniformly chosen block per equal-sized
+// stratum, or a simple random sample without replacement (Floyd's algorithm).
+// A time-bounded run visits them in random order so stopping early still
+// leaves an unbiased sample; otherwise they are read front to back.
+
+static std::vector<std::uint64_t> ChooseSampleBlocks(
+    std::uint64_t block_count,
+    std::uint64_t sample_count,
+    const TriageOptions& options,
+    std::mt19937_64& rng
+) {
+    std::vector<std::uint64_t> blocks;
+    if (options.stratified) {
+        for (std::uint64_t k = 0; k < sample_count; ++k) {
+            const std::uint64_t first = k * block_count / sample_count;
+            const std::uint64_t last = (k + 1) * block_count / sample_count;
+            blocks.push_back(std::uniform_int_distribution<std::uint64_t>(first, last - 1)(rng));
+        }
+    } else {
+        std::unordered_set<std::uint64_t> chosen;
+        for (std::uint64_t j = block_count - sample_count; j < block_count; ++j) {
+            const std::uint64_t t = std::uniform_int_distribution<std::uint64_t>(0, j)(rng);
+            chosen.insert(chosen.count(t) ? j : t);
+        }
+        blocks.assign(chosen.begin(), chosen.end());
+    }
+
+    if (options.time_limit > 0) {
+        std::shuffle(blocks.begin(), blocks.end(), rng);
+    } else {
+        std::sort(blocks.begin(), blocks.end());
+    }
+    return blocks;
+}
+
+// Scan the sampled blocks with the regular header matcher and count valid hits
+// per block. A header counts for the block it starts in, so every block is read
+// with enough overlap to see the header and its dimensions in full. Hit counts
+// are extrapolated as a sample mean with a finite population correction; when
+// nothing was found the upper bound falls back to the rule of three.
+
+void ImageFile::Triage(const fs::path& file_path, const TriageOptions& options) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open input file.");
+
+    const off_t end_offset = lseek(fd, 0, SEEK_END);
+    const std::uint64_t file_size = end_offset > 0 ? static_cast<std::uint64_t>(end_offset) : 0;
+    const std::uint64_t block_size = options.block_size;
+    const std::uint64_t block_count = (file_size + block_size - 1) / block_size;
+    if (block_count == 0) {
+        close(fd);
+        std::cout << "Input is empty.\n";
+        return;
+    }
+    const std::uint64_t sample_count = std::clamp<std::uint64_t>(options.sample_bytes / block_size, 1, block_count);
+
+    std::mt19937_64 rng(options.seed ? options.seed : std::random_device{}());
+    const std::vector<std::uint64_t> blocks = ChooseSampleBlocks(block_count, sample_count, options, rng);
+
+    const std::size_t header_span = ImageConfig::Headers[0].size() + 1 + 8;
+    std::vector<unsigned char> buffer(block_size + header_span - 1);
+    std::vector<double> hits_per_block;
+    std::vector<HitRecord> probes;
+    std::uint64_t sampled_bytes = 0;
+    std::uint64_t sampled_hits = 0;
+    double sampled_bmp_bytes = 0;
+
+    const auto started = std::chrono::steady_clock::now();
+    auto elapsed = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(); };
+
+    for (std::uint64_t block : blocks) {
+        const std::uint64_t block_offset = block * block_size;
+        const std::size_t got = PreadFully(fd, buffer.data(), buffer.size(), block_offset);
+        const unsigned char* block_end = buffer.data() + std::min<std::size_t>(got, block_size);
+        const unsigned char* data_end = buffer.data() + got;
+        sampled_bytes += block_end - buffer.data();
+
+        int hits = 0;
+        const unsigned char* cursor = buffer.data();
+        while (const unsigned char* header = FindHeader(cursor, data_end)) {
+            if (header >= block_end || header + header_span > data_end) break;
+            auto [width, height] = ReadDimensions(header + ImageConfig::Headers[0].size() + 1);
+            cursor = header + header_span;
+            if (width <= 0 || height <= 0 || width > ImageConfig::MaxWidth || height > ImageConfig::MaxHeight) continue;
+
+            ++hits;
+            const std::uint64_t payload_size = static_cast<std::uint64_t>(width) * height * 3;
+            sampled_bmp_bytes += 54 + static_cast<double>(width * 3 + (4 - (width * 3) % 4) % 4) * height;
+            if (probes.size() < TriageConfig::EncodeProbes) {
+                HitRecord probe;
+                probe.offset = block_offset + (header - buffer.data());
+                probe.width = width;
+                probe.height = height;
+                probes.push_back(probe);
+            }
+            if (payload_size >= static_cast<std::uint64_t>(data_end - cursor)) break;
+            cursor += payload_size;
+        }
+        hits_per_block.push_back(hits);
+        sampled_hits += hits;
+
+        if (options.time_limit > 0 && elapsed() >= options.time_limit) break;
+    }
+    const double scan_seconds = elapsed();
+
+// Encode the first few sampled hits to /dev/null to time the per-hit cost of
+// reading a payload and running SaveAsBMP, without touching the output disk.
+
+    double encode_seconds = 0;
+    std::vector<unsigned char> img_data;
+    for (const HitRecord& probe : probes) {
+        const auto probe_started = std::chrono::steady_clock::now();
+        img_data.resize(static_cast<std::size_t>(probe.width) * probe.height * 3);
+        PreadFully(fd, img_data.data(), img_data.size(), probe.offset + header_span);
+        SaveAsBMP("/dev/null", img_data.data(), probe.width, probe.height);
+        encode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - probe_started).count();
+    }
+    close(fd);
+
+    const double n = static_cast<double>(hits_per_block.size());
+    const double population = static_cast<double>(block_count);
+    double mean = 0;
+    for (double x : hits_per_block) mean += x;
+    mean /= n;
+    double variance = 0;
+    for (double x : hits_per_block) variance += (x - mean) * (x - mean);
+    variance = n > 1 ? variance / (n - 1) : 0;
+
+    const double estimate = mean * population;
+    const double standard_error = std::sqrt(variance / n * (1 - n / population)) * population;
+    double lower = std::max<double>(sampled_hits, estimate - TriageConfig::Z95 * standard_error);
+    double upper = estimate + TriageConfig::Z95 * standard_error;
+    if (sampled_hits == 0) upper = (n < population) ? std::min(population, 3.0 / n * population) : 0;
+    if (n == population) lower = upper = estimate;
+
+    const double mean_bmp_bytes = sampled_hits ? sampled_bmp_bytes / sampled_hits : 0;
+    const double per_hit_seconds = probes.empty() ? 0 : encode_seconds / probes.size();
+    const double full_scan_seconds = sampled_bytes ? scan_seconds * file_size / sampled_bytes : 0;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "input:             " << file_size << " bytes in " << block_count << " blocks of " << block_size << " bytes\n"
+              << "sampled:           " << hits_per_block.size() << " blocks (" << sampled_bytes << " bytes, "
+              << (options.stratified ? "stratified" : "random") << ") in " << std::setprecision(2) << scan_seconds << " s\n"
+              << "hits in sample:    " << sampled_hits << "\n"
+              << std::setprecision(1)
+              << "estimated hits:    " << estimate << " (95% CI " << lower << " - " << upper << ")\n"
+              << "estimated output:  ";
+    if (sampled_hits) {
+        std::cout << estimate * mean_bmp_bytes / (1 << 20) << " MiB (95% CI "
+                  << lower * mean_bmp_bytes / (1 << 20) << " - " << upper * mean_bmp_bytes / (1 << 20) << ")\n";
+    } else {
+        std::cout << "unknown, no hits in sample\n";
+    }
+    std::cout << "estimated runtime: " << full_scan_seconds + estimate * per_hit_seconds << " s (scan "
+              << full_scan_seconds << " s + " << estimate * per_hit_seconds << " s for hits, 95% CI "
+              << full_scan_seconds + lower * per_hit_seconds << " - " << full_scan_seconds + upper * per_hit_seconds << " s)\n";
+}
+
+// Generate a synthetic disk image: xorshift noise with a thumbnail every
+// BenchConfig::SyntheticHitSpacing bytes. It is flushed to disk so that the
+// cold-cache runs can evict it from the page cache.
+
+static fs::path WriteSyntheticImage(std::uint64_t size) {
+    const fs::path path = "rtti_bench_" + std::to_string(size) + ".img";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::runtime_error("Failed to create synthetic image.");
+
+    const std::string_view header = ImageConfig::Headers[0];
+    const std::size_t payload_size = static_cast<std::size_t>(BenchConfig::SyntheticWidth) * BenchConfig::SyntheticHeight * 3;
+    std::vector<unsigned char> chunk(BenchConfig::SyntheticHitSpacing);
+    std::uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (std::uint64_t written = 0; written < size;) {
+        for (std::size_t i = 0; i + 8 <= chunk.size(); i += 8) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            std::memcpy(chunk.data() + i, &state, 8);
+        }
+        const std::size_t at = chunk.size() / 2;
+        if (at + header.size() + 9 + payload_size <= chunk.size()) {
+            std::memcpy(chunk.data() + at, header.data(), header.size());
+            chunk[at + header.size()] = '\n';
+            for (int i = 0; i < 4; ++i) {
+                chunk[at + header.size() + 1 + i] = static_cast<unsigned char>(BenchConfig::SyntheticWidth >> (8 * i));
+                chunk[at + header.size() + 5 + i] = static_cast<unsigned char>(BenchConfig::SyntheticHeight >> (8 * i));
+            }
+        }
+
+        const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(chunk.size(), size - written));
+        if (write(fd, chunk.data(), count) != static_cast<ssize_t>(count)) {
+            close(fd);
+            fs::remove(path);
+            throw std::runtime_error("Failed to write synthetic image.");
+        }
+        written += count;
+    }
+    fdatasync(fd);
+    close(fd);
+    return path;
+}
+
+static double CpuSeconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Run the same scan as Process over every input with every backend and
+// report the median run per cell. Each backend's hit count and a checksum of
+// the hit offsets and payloads must match the first backend's. Unless --warm
+// is given the input is evicted from the page cache before each run, so the
+// numbers reflect the device.
+// Backends that cannot be used here (O_DIRECT on tmpfs, io_uring blocked by
+// the kernel) are listed as unavailable.
+
+void ImageFile::BenchIO(const BenchOptions& options) {
+    enum Kind { Stream, Pread, Mmap, Direct, Uring };
+    struct Backend {
+        const char* name;
+        Kind kind;
+        std::size_t block_size;
+        int advice;
+    };
+    const std::vector<Backend> backends = {
+        {"ifstream 4M", Stream, 4 << 20, 0},
+        {"pread 64K", Pread, 64 << 10, 0},
+        {"pread 1M", Pread, 1 << 20, 0},
+        {"pread 4M", Pread, 4 << 20, 0},
+        {"pread 16M", Pread, 16 << 20, 0},
+        {"mmap", Mmap, 4 << 20, 0},
+        {"mmap sequential", Mmap, 4 << 20, MADV_SEQUENTIAL},
+        {"mmap hugepage", Mmap, 4 << 20, MADV_HUGEPAGE},
+        {"O_DIRECT 4M", Direct, 4 << 20, 0},
+        {"io_uring 4M x4", Uring, 4 << 20, 0},
+    };
+
+    std::vector<fs::path> inputs = options.inputs;
+    std::vector<fs::path> synthetic;
+    for (std::uint64_t size : options.synthetic_sizes) synthetic.push_back(WriteSyntheticImage(size));
+    inputs.insert(inputs.end(), synthetic.begin(), synthetic.end());
+
+    std::cout << std::left << std::setw(28) << "input" << std::setw(18) << "backend" << std::right
+              << std::setw(10) << "MiB/s" << std::setw(10) << "wall s" << std::setw(10) << "cpu s" << std::setw(8) << "hits" << "\n";
+
+    for (const fs::path& input : inputs) {
+        std::uint64_t reference_hits = 0;
+        std::uint64_t reference_checksum = 0;
+        const Backend* reference = nullptr;
+
+        for (const Backend& backend : backends) {
+            struct Run { double wall; double cpu; std::uint64_t hits; std::uint64_t checksum; };
+            std::vector<Run> runs;
+            std::uint64_t size = 0;
+
+            for (int r = 0; r < options.runs; ++r) {
+                int fd = open(input.c_str(), O_RDONLY);
+                if (fd < 0) throw std::runtime_error("Failed to open input file: " + input.string());
+                size = InputSize(fd);
+                if (!options.warm) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+                const auto started = std::chrono::steady_clock::now();
+                const double cpu_started = CpuSeconds();
+                std::unique_ptr<InputReader> reader;
+                switch (backend.kind) {
+                case Stream:
+                    reader = std::make_unique<StreamReader>(input, size, backend.block_size);
+                    break;
+                case Pread:
+                    reader = std::make_unique<PreadReader>(fd, size, backend.block_size);
+                    break;
+                case Mmap:
+                    reader = std::make_unique<MmapReader>(fd, size, backend.block_size, backend.advice);
+                    break;
+                case Direct: {
+                    auto direct = std::make_unique<DirectReader>(size, backend.block_size);
+                    if (direct->Open(input)) reader = std::move(direct);
+                    break;
+                }
+                case Uring:
+#ifdef RTTI_HAVE_IO_URING
+                    auto uring = std::make_unique<UringReader>(fd, size, backend.block_size, BenchConfig::UringDepth);
+                    if (uring->Open()) reader = std::move(uring);
+#endif
+                    break;
+                }
+                if (!reader) {
+                    close(fd);
+                    break;
+                }
+
+                std::uint64_t hits = 0;
+                std::uint64_t checksum = 0;
+                {
+                    HitScanner scanner(*reader, true, 0);
+                    ScannedHit scanned;
+                    while (scanner.Next(scanned)) {
+                        checksum = (checksum ^ scanned.offset ^ HashPayload(scanned.payload, scanned.payload_size)) * 0x100000001B3ULL;
+                        ++hits;
+                    }
+                }
+                reader.reset();
+                runs.push_back({std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(),
+                                CpuSeconds() - cpu_started, hits, checksum});
+                close(fd);
+            }
+
+            std::cout << std::left << std::setw(28) << input.filename().string().substr(0, 27) << std::setw(18) << backend.name << std::right;
+            if (runs.empty()) {
+                std::cout << std::setw(38) << "unavailable" << "\n";
+                continue;
+            }
+            std::sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.wall < b.wall; });
+            const Run& median = runs[runs.size() / 2];
+            std::cout << std::fixed << std::setprecision(1) << std::setw(10) << (median.wall > 0 ? size / median.wall / (1 << 20) : 0.0)
+                      << std::setprecision(3) << std::setw(10) << median.wall << std::setw(10) << median.cpu
+                      << std::setw(8) << median.hits << "\n";
+
+            if (!reference) {
+                reference = &backend;
+                reference_hits = median.hits;
+                reference_checksum = median.checksum;
+            } else if (median.hits != reference_hits) {
+                std::cerr << "warning: " << backend.name << " found " << median.hits << " hits, expected " << reference_hits << "\n";
+            } else if (median.checksum != reference_checksum) {
+                std::cerr << "warning: " << backend.name << " returned different payload bytes than " << reference->name << "\n";
+            }
+        }
+    }
+
+    for (const fs::path& path : synthetic) fs::remove(path);
+}
+
+// Run the whole corpus through Process once per thread count (median of
+// --runs), writing outputs into a scratch directory that is removed after
+// each run. Stage busy time comes from the trace spans: <stage>_busy is the
+// average number of threads inside that stage over the run, so a stage whose
+// value approaches its thread count is the bottleneck, and wait stages such as
+// "queue payload" growing with the thread count point at contention.
+
+void ImageFile::BenchThreads(const ScalingOptions& options) {
+    std::vector<fs::path> inputs;
+    std::uint64_t corpus_bytes = 0;
+    for (const fs::path& input : options.inputs) {
+        inputs.push_back(fs::absolute(input));
+        corpus_bytes += fs::file_size(input);
+    }
+
+    struct Result {
+        int threads;
+        double seconds;
+        std::uint64_t hits;
+        std::map<std::string, double> busy;
+    };
+    std::vector<Result> results;
+    std::vector<std::string> stages;
+
+    const fs::path previous = fs::current_path();
+    const fs::path scratch = previous / "rtti_bench_threads";
+    Trace::Enable();
+
+    for (int threads = 1; threads <= options.max_threads; ++threads) {
+        std::vector<Result> runs;
+        for (int r = 0; r < options.runs; ++r) {
+            fs::create_directory(scratch);
+            fs::current_path(scratch);
+            Trace::Clear();
+            const std::uint64_t hits_before = Metrics::hits[0].load(std::memory_order_relaxed);
+
+            ProcessOptions process_options;
+            process_options.threads = threads;
+            const auto started = std::chrono::steady_clock::now();
+            for (const fs::path& input : inputs) Process(input, process_options);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+            fs::current_path(previous);
+            fs::remove_all(scratch);
+            runs.push_back({threads, seconds, Metrics::hits[0].load(std::memory_order_relaxed) - hits_before, Trace::Totals()});
+        }
+        std::sort(runs.begin(), runs.end(), [](const Result& a, const Result& b) { return a.seconds < b.seconds; });
+        results.push_back(runs[runs.size() / 2]);
+        for (const auto& stage : results.back().busy) {
+            if (std::find(stages.begin(), stages.end(), stage.first) == stages.end()) stages.push_back(stage.first);
+        }
+        std::cerr << threads << " threads: " << std::fixed << std::setprecision(3) << results.back().seconds << " s\n";
+    }
+
+    std::ofstream file;
+    if (!options.csv_path.empty()) {
+        file.open(options.csv_path);
+        if (!file) throw std::runtime_error("Failed to open CSV file.");
+    }
+    std::ostream& out = options.csv_path.empty() ? std::cout : file;
+
+    out << "threads,seconds,mib_per_s,hits_per_s,speedup,efficiency";
+    for (const std::string& stage : stages) {
+        out << ',';
+        WriteCsvField(out, stage + "_busy");
+    }
+    out << '\n' << std::fixed << std::setprecision(4);
+    const double baseline = results.front().seconds;
+    for (const Result& result : results) {
+        const double speedup = result.seconds > 0 ? baseline / result.seconds : 0;
+        out << result.threads << ',' << result.seconds << ','
+            << (result.seconds > 0 ? corpus_bytes / result.seconds / (1 << 20) : 0) << ','
+            << (result.seconds > 0 ? result.hits / result.seconds : 0) << ','
+            << speedup << ',' << speedup / result.threads;
+        for (const std::string& stage : stages) {
+            const auto busy = result.busy.find(stage);
+            out << ',' << (busy != result.busy.end() && result.seconds > 0 ? busy->second / result.seconds : 0);
         }
+        out << '\n';
     }
 }